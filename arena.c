@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define CHUNK_SIZE ( 256 * 1024 )
+
+/* Chunks start with the pointer to the next one, padded so the blocks after it stay aligned. */
+#define CHUNK_HEADER ARENA_GRANULE
+
+static size_t size_class( size_t size )
+{
+  return ( size - 1 ) / ARENA_GRANULE;
+}
+
+static void* alloc_small( arena_t* arena, size_t size )
+{
+  size_t index = size_class( size );
+  void* block = arena->free[ index ];
+  
+  if ( block != NULL )
+  {
+    arena->free[ index ] = *(void**)block;
+    return block;
+  }
+  
+  size = ( index + 1 ) * ARENA_GRANULE;
+  
+  if ( arena->next == NULL || (size_t)( arena->end - arena->next ) < size )
+  {
+    /* What's left of the current chunk is abandoned, it's less than ARENA_MAX_SMALL bytes. */
+    char* chunk = (char*)malloc( CHUNK_SIZE );
+    
+    if ( chunk == NULL )
+    {
+      return NULL;
+    }
+    
+    *(void**)chunk = arena->chunks;
+    arena->chunks = chunk;
+    arena->next = chunk + CHUNK_HEADER;
+    arena->end = chunk + CHUNK_SIZE;
+    arena->reserved += CHUNK_SIZE;
+  }
+  
+  block = arena->next;
+  arena->next += size;
+  return block;
+}
+
+static void release( arena_t* arena, void* ptr, size_t size )
+{
+  if ( ptr == NULL )
+  {
+    return;
+  }
+  
+  if ( size > ARENA_MAX_SMALL )
+  {
+    free( ptr );
+    arena->reserved -= size;
+    return;
+  }
+  
+  size_t index = size_class( size );
+  *(void**)ptr = arena->free[ index ];
+  arena->free[ index ] = ptr;
+}
+
+void arena_init( arena_t* arena )
+{
+  memset( arena, 0, sizeof( *arena ) );
+}
+
+void* arena_realloc( arena_t* arena, void* ptr, size_t osize, size_t nsize )
+{
+  if ( nsize == 0 )
+  {
+    release( arena, ptr, osize );
+    return NULL;
+  }
+  
+  if ( osize > ARENA_MAX_SMALL && nsize > ARENA_MAX_SMALL )
+  {
+    void* block = realloc( ptr, nsize );
+    
+    if ( block != NULL )
+    {
+      arena->reserved += nsize - osize;
+    }
+    
+    return block;
+  }
+  
+  /* Blocks stay where they are when their size class doesn't change. */
+  if ( ptr != NULL && osize <= ARENA_MAX_SMALL && nsize <= ARENA_MAX_SMALL && size_class( osize ) == size_class( nsize ) )
+  {
+    return ptr;
+  }
+  
+  void* block;
+  
+  if ( nsize <= ARENA_MAX_SMALL )
+  {
+    block = alloc_small( arena, nsize );
+  }
+  else if ( ( block = malloc( nsize ) ) != NULL )
+  {
+    arena->reserved += nsize;
+  }
+  
+  if ( block != NULL && ptr != NULL )
+  {
+    memcpy( block, ptr, osize < nsize ? osize : nsize );
+    release( arena, ptr, osize );
+  }
+  
+  return block;
+}
+
+void arena_destroy( arena_t* arena )
+{
+  void* chunk = arena->chunks;
+  
+  while ( chunk != NULL )
+  {
+    void* next = *(void**)chunk;
+    free( chunk );
+    chunk = next;
+  }
+  
+  arena_init( arena );
+}
@@ -0,0 +1,33 @@
+#ifndef PAS2LUA_ARENA_H
+#define PAS2LUA_ARENA_H
+
+#include <stddef.h>
+
+/* Blocks up to this size are carved from chunks, bigger ones come from malloc. */
+#define ARENA_MAX_SMALL 512
+#define ARENA_GRANULE   16
+#define ARENA_CLASSES   ( ARENA_MAX_SMALL / ARENA_GRANULE )
+
+/* A bump allocator for the Lua state. Small blocks are rounded up to a
+   multiple of ARENA_GRANULE and taken from the free list of their size, or
+   from the end of the current chunk. Freed blocks go back to their free list,
+   and the chunks are only released all at once by arena_destroy. */
+typedef struct
+{
+  void*  chunks;                   /* linked through their first word */
+  char*  next;                     /* bump pointer in the current chunk */
+  char*  end;
+  void*  free[ ARENA_CLASSES ];    /* linked through their first word */
+  size_t reserved;                 /* bytes in chunks and in big blocks */
+}
+arena_t;
+
+void arena_init( arena_t* arena );
+
+/* Has the semantics of lua_Alloc, except that osize must be 0 when ptr is NULL. */
+void* arena_realloc( arena_t* arena, void* ptr, size_t osize, size_t nsize );
+
+/* Releases the chunks, the big blocks must have been freed already. */
+void arena_destroy( arena_t* arena );
+
+#endif /* PAS2LUA_ARENA_H */
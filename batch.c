@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <pthread.h>
+
+#include <lua.h>
+
+#include "translator.h"
+#include "batch.h"
+#include "cache.h"
+#include "cpu.h"
+#include "stats.h"
+
+#define MAX_JOBS 64
+
+typedef struct
+{
+  char*   input;
+  char*   output;
+  int     status;
+  double  ms;
+  stats_t stats;
+  char    error[ 2048 ];
+}
+unit_t;
+
+typedef struct
+{
+  unit_t*         units;
+  int             count;
+  int             next;
+  double          startup;
+  const char*     datadir;
+  pthread_mutex_t lock;
+}
+batch_t;
+
+static int usage( void )
+{
+  fprintf( stderr, "Usage: pas2lua [--cache <dir>] [--units <path>] [--no-hoist] [--lazy] [--stats <file>] [--arena] --batch [-j <jobs>] <outdir> <datadir> <input.pas | @manifest>...\n" );
+  return 1;
+}
+
+static int add_input( batch_t* batch, int* reserved, const char* input )
+{
+  if ( batch->count == *reserved )
+  {
+    int size = *reserved ? *reserved * 2 : 64;
+    unit_t* units = (unit_t*)realloc( batch->units, size * sizeof( unit_t ) );
+    
+    if ( units == NULL )
+    {
+      return -1;
+    }
+    
+    batch->units = units;
+    *reserved = size;
+  }
+  
+  unit_t* unit = batch->units + batch->count++;
+  memset( unit, 0, sizeof( *unit ) );
+  unit->input = strdup( input );
+  return unit->input != NULL ? 0 : -1;
+}
+
+static int add_manifest( batch_t* batch, int* reserved, const char* path )
+{
+  /* A manifest has one input file per line, empty lines and lines starting with # are ignored. */
+  FILE* file = fopen( path, "r" );
+  
+  if ( file == NULL )
+  {
+    fprintf( stderr, "Error reading from %s\n", path );
+    return -1;
+  }
+  
+  char line[ 4096 ];
+  
+  while ( fgets( line, sizeof( line ), file ) != NULL )
+  {
+    size_t length = strlen( line );
+    
+    while ( length != 0 && ( line[ length - 1 ] == '\n' || line[ length - 1 ] == '\r' || line[ length - 1 ] == ' ' ) )
+    {
+      line[ --length ] = 0;
+    }
+    
+    if ( length != 0 && line[ 0 ] != '#' && add_input( batch, reserved, line ) != 0 )
+    {
+      fclose( file );
+      return -1;
+    }
+  }
+  
+  fclose( file );
+  return 0;
+}
+
+char* batch_output_path( const char* outdir, const char* input )
+{
+  /* <outdir>/<input file name without the .pas extension>.lua */
+  const char* name = input;
+  const char* aux;
+  
+  for ( aux = input; *aux; aux++ )
+  {
+    if ( *aux == '/' || *aux == '\\' )
+    {
+      name = aux + 1;
+    }
+  }
+  
+  size_t length = strlen( name );
+  
+  if ( length > 4 && ( !strcmp( name + length - 4, ".pas" ) || !strcmp( name + length - 4, ".PAS" ) ) )
+  {
+    length -= 4;
+  }
+  
+  size_t size = strlen( outdir ) + length + 6;
+  char* output = (char*)malloc( size );
+  
+  if ( output != NULL )
+  {
+    snprintf( output, size, "%s/%.*s.lua", outdir, (int)length, name );
+  }
+  
+  return output;
+}
+
+static int compare_outputs( const void* a, const void* b )
+{
+  /* Case insensitive, unit names are, and the pictures are named after them in lower case. */
+  const unsigned char* s1 = (const unsigned char*)( *(const unit_t* const*)a )->output;
+  const unsigned char* s2 = (const unsigned char*)( *(const unit_t* const*)b )->output;
+  
+  while ( *s1 != 0 && tolower( *s1 ) == tolower( *s2 ) )
+  {
+    s1++, s2++;
+  }
+  
+  return tolower( *s1 ) - tolower( *s2 );
+}
+
+static int check_outputs( const batch_t* batch )
+{
+  /* Two workers writing the same file would leave whichever finished last. */
+  unit_t** sorted = (unit_t**)malloc( batch->count * sizeof( unit_t* ) );
+  int i, duplicates = 0;
+  
+  if ( sorted == NULL )
+  {
+    fprintf( stderr, "Out of memory\n" );
+    return -1;
+  }
+  
+  for ( i = 0; i < batch->count; i++ )
+  {
+    sorted[ i ] = batch->units + i;
+  }
+  
+  qsort( sorted, batch->count, sizeof( unit_t* ), compare_outputs );
+  
+  for ( i = 1; i < batch->count; i++ )
+  {
+    if ( compare_outputs( sorted + i - 1, sorted + i ) == 0 )
+    {
+      fprintf( stderr, "%s and %s would both be written to %s\n", sorted[ i - 1 ]->input, sorted[ i ]->input, sorted[ i ]->output );
+      duplicates++;
+    }
+  }
+  
+  free( sorted );
+  return duplicates != 0 ? -1 : 0;
+}
+
+static void* worker( void* arg )
+{
+  batch_t* batch = (batch_t*)arg;
+  char error[ 2048 ];
+  
+  /* Each worker pays for the state creation and the script loading only once. */
+  double start = stats_now();
+  lua_State* L = translator_new( error, sizeof( error ) );
+  double startup = stats_now() - start;
+  
+  for ( ;; )
+  {
+    pthread_mutex_lock( &batch->lock );
+    int index = batch->next++;
+    batch->startup += startup;
+    startup = 0.0;
+    pthread_mutex_unlock( &batch->lock );
+    
+    if ( index >= batch->count )
+    {
+      break;
+    }
+    
+    unit_t* unit = batch->units + index;
+    
+    if ( L == NULL )
+    {
+      unit->status = 1;
+      snprintf( unit->error, sizeof( unit->error ), "%s", error );
+      continue;
+    }
+    
+    const char* args[] = { unit->input, unit->output, batch->datadir };
+    start = stats_now();
+    unit->status = translator_run( L, 3, args, unit->error, sizeof( unit->error ) );
+    unit->ms = stats_now() - start;
+    unit->stats = *translator_stats( L );
+  }
+  
+  if ( L != NULL )
+  {
+    translator_close( L );
+  }
+  
+  return NULL;
+}
+
+static int write_stats( const char* path, const batch_t* batch, double wall, int workers )
+{
+  FILE* file = stats_open( path );
+  
+  if ( file == NULL )
+  {
+    fprintf( stderr, "Error writing to %s\n", path );
+    return -1;
+  }
+  
+  fprintf( file, "{\"workers\":%d,\"wall_ms\":%.3f,\"units\":[", workers, wall );
+  int i;
+  
+  for ( i = 0; i < batch->count; i++ )
+  {
+    fprintf( file, i != 0 ? ",\n" : "\n" );
+    stats_write( file, &batch->units[ i ].stats, batch->units[ i ].input, batch->units[ i ].status );
+  }
+  
+  fprintf( file, "\n]}\n" );
+  stats_close( file );
+  return 0;
+}
+
+int batch_main( int argc, const char* argv[], const char* stats )
+{
+  /* argv[ 1 ] is --batch. */
+  int jobs = cpu_count();
+  int i = 2;
+  
+  if ( i < argc && !strcmp( argv[ i ], "-j" ) )
+  {
+    if ( i + 1 >= argc || ( jobs = atoi( argv[ i + 1 ] ) ) <= 0 )
+    {
+      return usage();
+    }
+    
+    i += 2;
+  }
+  
+  if ( argc - i < 3 )
+  {
+    return usage();
+  }
+  
+  const char* outdir = argv[ i++ ];
+  
+  batch_t batch;
+  memset( &batch, 0, sizeof( batch ) );
+  batch.datadir = argv[ i++ ];
+  int reserved = 0;
+  
+  for ( ; i < argc; i++ )
+  {
+    int res = argv[ i ][ 0 ] == '@' ? add_manifest( &batch, &reserved, argv[ i ] + 1 ) : add_input( &batch, &reserved, argv[ i ] );
+    
+    if ( res != 0 )
+    {
+      fprintf( stderr, "Error reading the list of units\n" );
+      return 1;
+    }
+  }
+  
+  for ( i = 0; i < batch.count; i++ )
+  {
+    if ( ( batch.units[ i ].output = batch_output_path( outdir, batch.units[ i ].input ) ) == NULL )
+    {
+      fprintf( stderr, "Out of memory\n" );
+      return 1;
+    }
+  }
+  
+  if ( check_outputs( &batch ) != 0 )
+  {
+    return 1;
+  }
+  
+  if ( jobs > batch.count )
+  {
+    jobs = batch.count;
+  }
+  
+  if ( jobs > MAX_JOBS )
+  {
+    jobs = MAX_JOBS;
+  }
+  
+  /* Spread the units across the workers, the calling thread is the first one. */
+  pthread_t threads[ MAX_JOBS ];
+  int started = 0;
+  pthread_mutex_init( &batch.lock, NULL );
+  double start = stats_now();
+  
+  for ( i = 1; i < jobs; i++ )
+  {
+    if ( pthread_create( threads + started, NULL, worker, &batch ) == 0 )
+    {
+      started++;
+    }
+  }
+  
+  worker( &batch );
+  
+  for ( i = 0; i < started; i++ )
+  {
+    pthread_join( threads[ i ], NULL );
+  }
+  
+  double wall = stats_now() - start;
+  pthread_mutex_destroy( &batch.lock );
+  
+  /* Report in the order the units were given, whatever order they finished. */
+  double total = 0.0;
+  int failed = 0;
+  
+  for ( i = 0; i < batch.count; i++ )
+  {
+    unit_t* unit = batch.units + i;
+    total += unit->ms;
+    
+    if ( unit->status != 0 )
+    {
+      failed++;
+      fprintf( stderr, "%s: %s\n", unit->input, unit->error );
+    }
+    
+    printf( "%10.3f ms  %s%s\n", unit->ms, unit->input, unit->status != 0 ? " (failed)" : "" );
+  }
+  
+  printf( "%d units, %d failed, %.3f ms translating, %.3f ms wall time with %d worker(s)\n", batch.count, failed, total, wall, started + 1 );
+  printf( "%.3f ms creating the states, %.3f ms per worker\n", batch.startup, batch.startup / ( started + 1 ) );
+  cache_report( stdout );
+  
+  if ( stats != NULL && write_stats( stats, &batch, wall, started + 1 ) != 0 )
+  {
+    failed++;
+  }
+  
+  for ( i = 0; i < batch.count; i++ )
+  {
+    free( batch.units[ i ].input );
+    free( batch.units[ i ].output );
+  }
+  
+  free( batch.units );
+  return failed != 0;
+}
@@ -0,0 +1,12 @@
+#ifndef PAS2LUA_BATCH_H
+#define PAS2LUA_BATCH_H
+
+/* Translates many units with a pool of worker threads, each one with its own
+   Lua state. Writes the stats of each unit to the stats file if not NULL. */
+int batch_main( int argc, const char* argv[], const char* stats );
+
+/* <outdir>/<name of input without the .pas extension>.lua, allocated with malloc.
+   Inputs with the same name in different directories get the same path. */
+char* batch_output_path( const char* outdir, const char* input );
+
+#endif /* PAS2LUA_BATCH_H */
@@ -0,0 +1,72 @@
+-- Microbenchmarks for the syntax trees built by the parser: nodes kept in the
+-- flat arrays of lua/ast.lua, and the same nodes as a table each. Measures the
+-- time to build and walk a tree shaped like the body of a procedure and the
+-- memory it takes per node.
+--
+-- Usage: lua bench/ast.lua
+--
+-- Run it from the repository root.
+
+class = dofile( 'lua/class.lua' )
+local Ast = dofile( 'lua/ast.lua' )
+
+local measure = dofile( 'bench/bench.lua' ).measure
+
+local function bench( name, count, build, walk )
+  local built, memory, tree, root = measure( function() return build( count ) end )
+  local walked, _, nodes = measure( function() return walk( tree, root ) end )
+  io.write( string.format( '%-24s %8.3f ms build %8.3f ms walk %8.1f bytes/node\n', name, built * 1e3, walked * 1e3, memory / nodes ) )
+end
+
+-- for i := 1 to 10 do if Score > i then Inc(Score) else Score := Score + i;
+-- repeated count times in a begin ... end block
+bench( 'flat arrays', 20000, function( count )
+  local tree = Ast()
+  local stmts = {}
+  
+  for i = 1, count do
+    local inc = tree:node( 'inc', 'self.score', '+', '1' )
+    local assign = tree:node( 'assign', 'self.score', '( ( self.score ) + ( i ) )' )
+    local cond = tree:node( 'if', '( ( self.score ) > ( i ) )', inc, assign )
+    stmts[ i ] = tree:node( 'for', 'i', '1', '10', 2, cond )
+  end
+  
+  return tree, tree:node( 'block', tree:list( stmts ) )
+end, function( tree, root )
+  local nodes = 0
+  tree:walk( root, function() nodes = nodes + 1 end )
+  return nodes
+end )
+
+bench( 'table per node', 20000, function( count )
+  local stmts = {}
+  
+  for i = 1, count do
+    local inc = { kind = 'inc', target = 'self.score', op = '+', count = '1' }
+    local assign = { kind = 'assign', target = 'self.score', value = '( ( self.score ) + ( i ) )' }
+    local cond = { kind = 'if', cond = '( ( self.score ) > ( i ) )', body = inc, otherwise = assign }
+    stmts[ i ] = { kind = 'for', var = 'i', start = '1', finish = '10', flags = 2, body = cond }
+  end
+  
+  return nil, { kind = 'block', stmts = stmts }
+end, function( _, root )
+  local nodes = 0
+  
+  local function walk( n )
+    nodes = nodes + 1
+    
+    if n.kind == 'block' then
+      for _, stmt in ipairs( n.stmts ) do
+        walk( stmt )
+      end
+    elseif n.kind == 'if' then
+      walk( n.body )
+      walk( n.otherwise )
+    elseif n.kind == 'for' then
+      walk( n.body )
+    end
+  end
+  
+  walk( root )
+  return nodes
+end )
@@ -0,0 +1,43 @@
+-- Helpers shared by the benchmarks in bench/, loaded with
+-- dofile( 'bench/bench.lua' ) from the repository root, by a Lua 5.3
+-- interpreter or by pas2lua --run.
+
+local M = {}
+
+-- Runs func( count ) with a tenth of count to warm up, then a few times with
+-- count, and writes the best time per iteration, or per unit if given.
+function M.time( name, count, func, unit )
+  func( count // 10 )
+  local best = math.huge
+  
+  for run = 1, 5 do
+    local start = os.clock()
+    func( count )
+    best = math.min( best, os.clock() - start )
+  end
+  
+  io.write( string.format( '%-40s %8.2f ns/%s\n', name, best * 1e9 / count, unit or 'iteration' ) )
+end
+
+-- Runs func once to warm up, then a few times with the collector stopped, and
+-- returns the best time in seconds, the bytes allocated by the last run, and
+-- the first two values it returned.
+function M.measure( func )
+  func()
+  local best, memory, first, second = math.huge
+  
+  for run = 1, 5 do
+    collectgarbage()
+    collectgarbage( 'stop' )
+    local before = collectgarbage( 'count' )
+    local start = os.clock()
+    first, second = func()
+    best = math.min( best, os.clock() - start )
+    memory = ( collectgarbage( 'count' ) - before ) * 1024
+    collectgarbage( 'restart' )
+  end
+  
+  return best, memory, first, second
+end
+
+return M
@@ -0,0 +1,70 @@
+-- Microbenchmarks for the code generated for Pascal case statements: the chain
+-- of comparisons that reads the selector from its field in every test, and
+-- the binary search over the labels used for integer constants.
+--
+-- Usage: lua bench/case.lua
+--
+-- Run it from the repository root.
+
+local bench = dofile( 'bench/bench.lua' ).time
+
+-- The generated code for a case with labels 0 to labels - 1, each setting
+-- self.state to the label, written the way the parser writes it.
+local function chain( labels )
+  local lines = { 'local self = ...', 'return function()' }
+  
+  for i = 0, labels - 1 do
+    lines[ #lines + 1 ] = string.format( '%s ( self.key == %d ) then self.state = %d', i == 0 and 'if' or 'elseif', i, i )
+  end
+  
+  lines[ #lines + 1 ] = 'end end'
+  return table.concat( lines, '\n' )
+end
+
+local function search( labels )
+  local lines = { 'local self = ...', 'return function()', 'local __sel = self.key' }
+  
+  local function tree( first, last )
+    if last - first < 3 then
+      for i = first, last do
+        lines[ #lines + 1 ] = string.format( '%s ( __sel == %d ) then self.state = %d', i == first and 'if' or 'elseif', i, i )
+      end
+      
+      lines[ #lines + 1 ] = 'end'
+    else
+      local middle = ( first + last + 1 ) // 2
+      lines[ #lines + 1 ] = string.format( 'if __sel < %d then', middle )
+      tree( first, middle - 1 )
+      lines[ #lines + 1 ] = 'else'
+      tree( middle, last )
+      lines[ #lines + 1 ] = 'end'
+    end
+  end
+  
+  tree( 0, labels - 1 )
+  lines[ #lines + 1 ] = 'end'
+  return table.concat( lines, '\n' )
+end
+
+local count = 10000000
+
+for _, labels in ipairs{ 8, 32, 128 } do
+  local self = { key = 0, state = 0 }
+  local linear = load( chain( labels ) )( self )
+  local binary = load( search( labels ) )( self )
+  
+  -- spread the selector over all the labels
+  bench( string.format( '%d labels, chain', labels ), count, function( count )
+    for i = 1, count do
+      self.key = i % labels
+      linear()
+    end
+  end )
+  
+  bench( string.format( '%d labels, search', labels ), count, function( count )
+    for i = 1, count do
+      self.key = i % labels
+      binary()
+    end
+  end )
+end
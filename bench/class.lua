@@ -0,0 +1,89 @@
+-- Microbenchmarks for the class runtime in lua/class.lua: object
+-- construction, method dispatch through the class hierarchy, and type tests.
+--
+-- Usage: lua bench/class.lua [class.lua]
+--
+-- Run it from the repository root. Pass the path to another class.lua (e.g.
+-- one extracted with git show) to compare the two.
+
+local class = dofile( arg[ 1 ] or 'lua/class.lua' )
+
+local bench = dofile( 'bench/bench.lua' ).time
+
+-- a hierarchy ten classes deep, like a form descending from TForm
+local classes = { class.new() }
+
+classes[ 1 ].new = function( self, left, top )
+  self.left = left
+  self.top = top
+end
+
+classes[ 1 ].move = function( self, dx, dy )
+  self.left = self.left + dx
+  self.top = self.top + dy
+end
+
+for depth = 2, 10 do
+  local super = classes[ depth - 1 ]
+  local klass = class.new( super )
+  
+  klass.new = function( self, left, top )
+    super.new( self, left, top )
+  end
+  
+  classes[ depth ] = klass
+end
+
+local count = 1000000
+
+for _, depth in ipairs{ 1, 5, 10 } do
+  local klass = classes[ depth ]
+  
+  bench( string.format( 'construction, depth %d', depth ), count, function( count )
+    for i = 1, count do
+      local obj = klass( i, i )
+    end
+  end, 'op' )
+end
+
+for _, depth in ipairs{ 1, 5, 10 } do
+  local obj = classes[ depth ]( 0, 0 )
+  
+  bench( string.format( 'dispatch, depth %d', depth ), count, function( count )
+    for i = 1, count do
+      obj:move( 1, 1 )
+    end
+  end, 'op' )
+end
+
+local obj = classes[ 10 ]( 0, 0 )
+local other = class.new()
+
+bench( 'instanceOf, self', count, function( count )
+  for i = 1, count do
+    obj:instanceOf( classes[ 10 ] )
+  end
+end, 'op' )
+
+bench( 'instanceOf, root', count, function( count )
+  for i = 1, count do
+    obj:instanceOf( classes[ 1 ] )
+  end
+end, 'op' )
+
+bench( 'instanceOf, unrelated', count, function( count )
+  for i = 1, count do
+    obj:instanceOf( other )
+  end
+end, 'op' )
+
+-- getClassName looks in the global space unless the class was named
+BenchClasses = classes
+
+bench( 'getClassName', 1000, function( count )
+  for i = 1, count do
+    obj:getClassName()
+  end
+end, 'op' )
+
+BenchClasses = nil
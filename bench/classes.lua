@@ -0,0 +1,99 @@
+-- Stress test for the class layouts built by the parser: units with a chain of
+-- N classes, each one adding ten TImage fields and a method that uses the
+-- fields it inherits. Translates each unit and prints the best CPU time of a
+-- few runs, which should grow about linearly with N.
+--
+-- Usage: pas2lua --run bench/classes.lua <dir> [<parser.lua>] [<N>...]
+--
+-- Writes the units and their translations to <dir>. Pass the path to another
+-- parser.lua (e.g. one extracted with git show) to translate with it instead,
+-- and compare the two.
+
+local dir = arg[ 1 ]
+local parser = Parser
+local sizes = {}
+
+if not dir then
+  io.stderr:write( 'Usage: pas2lua --run bench/classes.lua <dir> [<parser.lua>] [<N>...]\n' )
+  return 1
+end
+
+for i = 2, #arg do
+  if arg[ i ]:match( '%.lua$' ) then
+    parser = assert( loadfile( arg[ i ] ) )()
+  elseif tonumber( arg[ i ] ) then
+    sizes[ #sizes + 1 ] = tonumber( arg[ i ] )
+  else
+    io.stderr:write( 'Invalid argument: ', arg[ i ], '\n' )
+    return 1
+  end
+end
+
+if not sizes[ 1 ] then
+  sizes = { 50, 100, 200, 400 }
+end
+
+local function write( path, text )
+  local file, err = io.open( path, 'wb' )
+  
+  if not file then
+    error( err, 0 )
+  end
+  
+  file:write( text )
+  file:close()
+end
+
+local function unit( name, count )
+  local out = {}
+  
+  out[ #out + 1 ] = string.format( 'unit %s;\n\ninterface\n\nuses\n  Classes, Controls, ExtCtrls;\n\ntype\n', name )
+  
+  for i = 1, count do
+    out[ #out + 1 ] = i == 1 and '  TLevel1 = class\n' or string.format( '  TLevel%d = class(TLevel%d)\n', i, i - 1 )
+    
+    for j = 1, 10 do
+      out[ #out + 1 ] = string.format( '    Image%d_%d: TImage;\n', i, j )
+    end
+    
+    out[ #out + 1 ] = string.format( '    procedure Step%d;\n  end;\n', i )
+  end
+  
+  out[ #out + 1 ] = '\nimplementation\n\n'
+  
+  for i = 1, count do
+    -- the fields of the class itself and of the first and the previous classes
+    local first, previous = 1, math.max( i - 1, 1 )
+    out[ #out + 1 ] = string.format( 'procedure TLevel%d.Step%d;\nbegin\n', i, i )
+    out[ #out + 1 ] = string.format( '  Image%d_1.Left := Image%d_2.Left;\n', i, first )
+    out[ #out + 1 ] = string.format( '  Image%d_3.Top := Image%d_4.Top;\n', i, previous )
+    out[ #out + 1 ] = 'end;\n\n'
+  end
+  
+  out[ #out + 1 ] = 'initialization\nend.\n'
+  return table.concat( out )
+end
+
+os.execute( string.format( 'mkdir -p "%s/data"', dir ) )
+
+for _, count in ipairs( sizes ) do
+  local name = 'Classes' .. count
+  local path = string.format( '%s/%s.pas', dir, name )
+  write( path, unit( name, count ) )
+  
+  local best = math.huge
+  
+  for run = 1, 3 do
+    -- each translation starts with fresh copies of the units it uses, as in translator_run
+    debug.getregistry().pas2lua_units = {}
+    collectgarbage()
+    
+    local start = os.clock()
+    parser( path, string.format( '%s/%s.lua', dir, name ), dir .. '/data', options ):parse()
+    best = math.min( best, os.clock() - start )
+  end
+  
+  io.write( string.format( '%5d classes %9.1f ms\n', count, best * 1000 ) )
+end
+
+return 0
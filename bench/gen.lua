@@ -0,0 +1,261 @@
+-- Generates Delphi units and their forms for bench/translator.lua. The units
+-- only use what the translator supports: classes with fields and records, a
+-- form with components and methods, nested arrays, case statements with many
+-- labels, loops, and pictures in the forms. The same arguments always generate
+-- the same files.
+--
+-- Usage: pas2lua --run bench/gen.lua <dir> [<key>=<value>...]
+--
+--   units=8       units, each one with its .dfm
+--   classes=8     classes besides the form
+--   methods=12    methods of the form, each one with a case statement
+--   depth=3       dimensions of the nested arrays
+--   labels=32     labels in each case statement
+--   components=12 components in the form
+--   images=2      components that are pictures, the rest are labels
+--   bitmap=64     KiB of data in each picture
+--
+-- Writes <dir>/manifest.txt with the .pas files generated. Also runs with a
+-- Lua 5.3 interpreter.
+
+local dir = arg[ 1 ]
+
+local config = {
+  units = 8,
+  classes = 8,
+  methods = 12,
+  depth = 3,
+  labels = 32,
+  components = 12,
+  images = 2,
+  bitmap = 64
+}
+
+if not dir then
+  io.stderr:write( 'Usage: pas2lua --run bench/gen.lua <dir> [<key>=<value>...]\n' )
+  return 1
+end
+
+for i = 2, #arg do
+  local key, value = arg[ i ]:match( '^(%w+)=(%d+)$' )
+  
+  if not key or not config[ key ] then
+    io.stderr:write( 'Invalid argument: ', arg[ i ], '\n' )
+    return 1
+  end
+  
+  config[ key ] = tonumber( value )
+end
+
+-- a linear congruential generator, math.random differs between Lua versions
+local seed = 12345
+
+local function random( n )
+  seed = ( seed * 1103515245 + 12345 ) % 2147483648
+  return seed % n
+end
+
+local function write( path, text )
+  local file, err = io.open( path, 'wb' )
+  
+  if not file then
+    error( err, 0 )
+  end
+  
+  file:write( text )
+  file:close()
+end
+
+local function components()
+  local list = {}
+  
+  for i = 1, config.components do
+    if i <= config.images then
+      list[ i ] = { name = 'Image' .. i, type = 'TImage' }
+    else
+      list[ i ] = { name = 'Label' .. i, type = 'TLabel' }
+    end
+  end
+  
+  return list
+end
+
+local function dimensions()
+  local dims = {}
+  
+  for i = 1, config.depth do
+    dims[ i ] = '0..7'
+  end
+  
+  return table.concat( dims, ', ' )
+end
+
+local function indices( first, second )
+  local list = { first, second }
+  
+  for i = 3, config.depth do
+    list[ i ] = tostring( i )
+  end
+  
+  return table.concat( list, ', ', 1, config.depth )
+end
+
+local function caseStatement( out, method )
+  out[ #out + 1 ] = '  case x of\n'
+  local value = 0
+  
+  for i = 1, config.labels do
+    local kind = random( 8 )
+    local label
+    
+    if kind == 0 then
+      label = string.format( '%d..%d', value, value + 3 )
+      value = value + 4
+    elseif kind == 1 then
+      label = string.format( '%d, %d', value, value + 2 )
+      value = value + 3
+    else
+      label = tostring( value )
+      value = value + 1 + random( 2 )
+    end
+    
+    if i % 5 == 0 then
+      out[ #out + 1 ] = string.format( '    %s: begin\n      State := State + %d;\n      Inc(Counter);\n    end;\n', label, i )
+    else
+      out[ #out + 1 ] = string.format( '    %s: State := %d;\n', label, i * method )
+    end
+  end
+  
+  out[ #out + 1 ] = '  else\n    State := 0;\n  end;\n'
+end
+
+local function unit( index )
+  local name = 'Bench' .. index
+  local form = 'T' .. name .. 'Form'
+  local list = components()
+  local out = {}
+  
+  out[ #out + 1 ] = string.format( 'unit %s;\n\ninterface\n\nuses\n  Windows, SysUtils, Classes, Graphics, Controls, Forms, ExtCtrls, StdCtrls;\n\ntype\n', name )
+  
+  for i = 1, config.classes do
+    if i == 1 then
+      out[ #out + 1 ] = '  TItem1 = class\n'
+    else
+      out[ #out + 1 ] = string.format( '  TItem%d = class(TItem%d)\n', i, i - 1 )
+    end
+    
+    out[ #out + 1 ] = string.format( '    X%d: Integer;\n    Y%d: Integer;\n    Visible%d: Boolean;\n', i, i, i )
+    out[ #out + 1 ] = string.format( '    Pos%d: record\n      A: Integer;\n      B: Integer;\n    end;\n  end;\n', i )
+  end
+  
+  out[ #out + 1 ] = string.format( '  %s = class(TForm)\n', form )
+  
+  for _, component in ipairs( list ) do
+    out[ #out + 1 ] = string.format( '    %s: %s;\n', component.name, component.type )
+  end
+  
+  out[ #out + 1 ] = '    Item: TItem1;\n'
+  
+  for i = 1, config.methods do
+    out[ #out + 1 ] = string.format( '    procedure Step%d(x: Integer);\n', i )
+  end
+  
+  out[ #out + 1 ] = '    function Calc(a, b: Integer): Integer;\n  end;\n\n'
+  out[ #out + 1 ] = string.format( 'var\n  %s: %s;\n\nimplementation\n\n{$R *.dfm}\n\n', name .. 'Form', form )
+  out[ #out + 1 ] = 'const\n  SIZE = 8;\n  HALF = SIZE div 2;\n\n'
+  out[ #out + 1 ] = string.format( 'var\n  Grid: array [%s] of Integer;\n  Flags: array [1..16] of Boolean;\n', dimensions() )
+  out[ #out + 1 ] = string.format( '  Items: array [1..4] of TItem%d;\n  Counter: Integer;\n  State: Integer;\n\n', config.classes )
+  
+  for i = 1, config.methods do
+    local image = config.images > 0 and list[ 1 ]
+    local label = list[ config.images + 1 ]
+    
+    out[ #out + 1 ] = string.format( 'procedure %s.Step%d(x: Integer);\nvar\n  i: Integer;\n  j: Integer;\nbegin\n', form, i )
+    out[ #out + 1 ] = string.format( '  // step %d\n  for i := 0 to SIZE - 1 do\n    for j := HALF downto 0 do\n      Grid[%s] := i * j + %d;\n', i, indices( 'i', 'j' ), i )
+    caseStatement( out, i )
+    out[ #out + 1 ] = '  i := 0;\n  while i < 16 do\n  begin\n'
+    out[ #out + 1 ] = '    if Flags[i + 1] and not (Counter > 3) then\n      Flags[i + 1] := False\n    else\n      Flags[i + 1] := True;\n    i := i + 1;\n  end;\n'
+    out[ #out + 1 ] = string.format( '  repeat\n    dec(Counter, 2);\n  until Counter < %d;\n', i )
+    out[ #out + 1 ] = string.format( '  Items[%d].X%d := Calc(x, %d);\n  Items[%d].Pos%d.A := State;\n', i % 4 + 1, config.classes, i, i % 4 + 1, i % config.classes + 1 )
+    
+    if image then
+      out[ #out + 1 ] = string.format( '  %s.Left := Calc(Counter, 1 + 2) mod 7;\n', image.name )
+    end
+    
+    if label then
+      out[ #out + 1 ] = string.format( '  %s.Caption := IntToStr(Counter);\n', label.name )
+    end
+    
+    out[ #out + 1 ] = 'end;\n\n'
+  end
+  
+  out[ #out + 1 ] = string.format( 'function %s.Calc(a, b: Integer): Integer;\nbegin\n  Calc := a + b;\nend;\n\n', form )
+  out[ #out + 1 ] = 'initialization\n  Counter := 0;\n  State := 0;\nend.\n'
+  
+  return table.concat( out ), list
+end
+
+local function picture( out )
+  -- the class name and then rows of runs and noise, for the encoder to work on
+  local size = config.bitmap * 1024
+  local bytes = { 7, 0x54, 0x42, 0x69, 0x74, 0x6d, 0x61, 0x70 }
+  
+  while #bytes < size do
+    local value, length = random( 256 ), random( 64 ) + 1
+    local run = random( 4 ) ~= 0
+    
+    for i = 1, length do
+      bytes[ #bytes + 1 ] = run and value or random( 256 )
+    end
+  end
+  
+  out[ #out + 1 ] = '    Picture.Data = {'
+  
+  for i = 1, size, 32 do
+    local row = {}
+    
+    for j = i, math.min( i + 31, size ) do
+      row[ #row + 1 ] = string.format( '%02X', bytes[ j ] )
+    end
+    
+    out[ #out + 1 ] = '\n      ' .. table.concat( row )
+  end
+  
+  out[ #out + 1 ] = '}\n'
+end
+
+local function dfm( index, list )
+  local name = 'Bench' .. index
+  local out = {}
+  
+  out[ #out + 1 ] = string.format( 'object %sForm: T%sForm\n  Left = 192\n  Top = 107\n  ClientWidth = 400\n  ClientHeight = 300\n  Color = clWhite\n', name, name )
+  
+  for i, component in ipairs( list ) do
+    out[ #out + 1 ] = string.format( '  object %s: %s\n    Left = %d\n    Top = %d\n', component.name, component.type, random( 400 ) - 8, random( 300 ) )
+    
+    if component.type == 'TImage' then
+      out[ #out + 1 ] = '    Width = 400\n    Height = 300\n'
+      picture( out )
+    else
+      out[ #out + 1 ] = string.format( "    Caption = 'Label %d'\n    Font.Color = clWhite\n", i )
+    end
+    
+    out[ #out + 1 ] = '  end\n'
+  end
+  
+  out[ #out + 1 ] = 'end\n'
+  return table.concat( out )
+end
+
+local manifest = {}
+
+for i = 1, config.units do
+  local pas, list = unit( i )
+  local path = string.format( '%s/Bench%d.pas', dir, i )
+  write( path, pas )
+  write( string.format( '%s/Bench%d.dfm', dir, i ), dfm( i, list ) )
+  manifest[ i ] = path
+end
+
+write( dir .. '/manifest.txt', table.concat( manifest, '\n' ) .. '\n' )
+return 0
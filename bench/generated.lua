@@ -0,0 +1,102 @@
+-- Benchmarks the code the parser generates, translating the first unit made by
+-- bench/gen.lua with and without the options that change it:
+--
+--   default   numeric fors, case statements dispatched with a search, and
+--             hoisting
+--   no-hoist  with --no-hoist
+--   lazy      with --lazy
+--   other     with the parser.lua given, i.e. one extracted with git show from
+--             another revision, and no options; parsers from before the
+--             ranges and the else of case statements can't read the units
+--
+-- For each one, prints the time and the memory it takes to load the unit, which
+-- creates its arrays and its form, and the time per call of the methods of the
+-- form, with x going over all the labels of their case statements.
+--
+-- Usage: pas2lua --run bench/generated.lua <dir> [<parser.lua>]
+--
+-- Run it from the repository root, <dir> is where bench/gen.lua wrote the
+-- units. The translations go to <dir>/generated.
+
+local bench = dofile( 'bench/bench.lua' )
+local dir, other = arg[ 1 ], arg[ 2 ]
+
+if not dir then
+  io.stderr:write( 'Usage: pas2lua --run bench/generated.lua <dir> [<parser.lua>]\n' )
+  return 1
+end
+
+local variants = {
+  { name = 'default', parser = Parser, options = {} },
+  { name = 'no-hoist', parser = Parser, options = { hoist = false } },
+  { name = 'lazy', parser = Parser, options = { lazy = true } }
+}
+
+if other then
+  variants[ #variants + 1 ] = { name = 'other', parser = assert( loadfile( other ) )(), options = {} }
+end
+
+local file = assert( io.open( dir .. '/manifest.txt', 'rb' ) )
+local path = file:read( 'l' )
+file:close()
+
+local out = dir .. '/generated'
+os.execute( string.format( 'mkdir -p "%s/data"', out ) )
+
+-- The units the translation loads: the class runtime, and classes for all the
+-- members of the others, whose instances only have the tables the properties
+-- of the components in the form are set in.
+local function loadunit( name )
+  if name == 'class' then
+    return class
+  end
+  
+  return setmetatable( {}, { __index = function( self, key )
+    local value = class.new()
+    
+    value.new = function( self )
+      self.picture, self.font = {}, {}
+    end
+    
+    self[ key ] = value
+    return value
+  end } )
+end
+
+local system = { loadunit = loadunit, loadbin = function() end }
+local env = setmetatable( { system = system }, { __index = _G } )
+
+for _, variant in ipairs( variants ) do
+  local outpath = string.format( '%s/%s.lua', out, variant.name )
+  debug.getregistry().pas2lua_units = {}
+  variant.parser( path, outpath, out .. '/data', variant.options ):parse()
+  
+  file = assert( io.open( outpath, 'rb' ) )
+  local code = file:read( 'a' )
+  file:close()
+  
+  -- the parser calls methods with a dot, without self, and the methods need it
+  code = code:gsub( '%.calc%( ', ':calc( ' ):gsub( '%.__initdfm%(%)', ':__initdfm()' )
+  local chunk = assert( load( code, '=' .. outpath, 't', env ) )
+  
+  local time, memory, unit = bench.measure( chunk )
+  io.write( string.format( '%-40s %8.3f ms %8.1f KiB\n', variant.name .. ', load', time * 1e3, memory / 1024 ) )
+  
+  -- the methods of the form are called with x below 128, which covers the
+  -- labels of their case statements with the default arguments of gen.lua
+  local form, methods = unit[ path:match( '([^/\\]*)%.pas$' ):lower() .. 'form' ], {}
+  
+  for key, value in pairs( form:getClass() ) do
+    if key:match( '^step%d+$' ) then
+      methods[ #methods + 1 ] = value
+    end
+  end
+  
+  bench.time( variant.name .. ', methods', 100000, function( count )
+    for i = 1, count do
+      methods[ i % #methods + 1 ]( form, i % 128 )
+    end
+  end, 'call' )
+end
+
+return 0
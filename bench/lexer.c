@@ -0,0 +1,61 @@
+/* A Lua 5.3 interpreter with the lexer, for bench/lexer.lua. It's built with
+   the lexer.c given to make, so the lexer of other revisions can be measured
+   with the same script:
+
+   bench/lexer.exe <script.lua> [<args>...] */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+LUALIB_API int luaopen_lexer( lua_State* L );
+
+int main( int argc, const char* argv[] )
+{
+  if ( argc < 2 )
+  {
+    fprintf( stderr, "Usage: %s <script.lua> [<args>...]\n", argv[ 0 ] );
+    return 1;
+  }
+  
+  lua_State* L = luaL_newstate();
+  
+  if ( L == NULL )
+  {
+    fprintf( stderr, "Could not create the Lua state\n" );
+    return 1;
+  }
+  
+  luaL_openlibs( L );
+  luaopen_lexer( L );
+  lua_setglobal( L, "lexer" );
+  
+  /* The arguments after the script go in arg. */
+  lua_createtable( L, argc - 2, 0 );
+  int i;
+  
+  for ( i = 2; i < argc; i++ )
+  {
+    lua_pushstring( L, argv[ i ] );
+    lua_rawseti( L, -2, i - 1 );
+  }
+  
+  lua_setglobal( L, "arg" );
+  
+  int res = luaL_dofile( L, argv[ 1 ] );
+  
+  if ( res != LUA_OK )
+  {
+    fprintf( stderr, "%s\n", lua_tostring( L, -1 ) );
+  }
+  else if ( lua_isinteger( L, -1 ) )
+  {
+    res = (int)lua_tointeger( L, -1 );
+  }
+  
+  lua_close( L );
+  return res;
+}
@@ -0,0 +1,136 @@
+-- Benchmarks the lexer alone on the units generated by bench/gen.lua, with the
+-- Pascal tokens the parser uses:
+--
+--   next      a table per token with lex:next, the only way before the token
+--             streams
+--   tokenize  all the tokens into a stream with lex:tokenize, when the lexer
+--             has it
+--
+-- Prints the best time of a few runs and the tokens and megabytes per second,
+-- for the .pas files and the .dfm files apart since the pictures in the forms
+-- are mostly long runs of hexadecimal digits. Only uses what the lexer had
+-- from the start, so it runs with bench/lexer.exe built with the lexer.c of
+-- any revision, see make bench-lexer.
+--
+-- Usage: bench/lexer.exe bench/lexer.lua <dir> [<runs>]
+
+local dir, runs = arg[ 1 ], tonumber( arg[ 2 ] or 5 )
+
+if not dir or not runs then
+  io.stderr:write( 'Usage: bench/lexer.exe bench/lexer.lua <dir> [<runs>]\n' )
+  return 1
+end
+
+local function read( path )
+  local file, err = io.open( path, 'rb' )
+  
+  if not file then
+    error( err, 0 )
+  end
+  
+  local contents = file:read( 'a' )
+  file:close()
+  return contents
+end
+
+-- The symbols and keywords of the parser and of dfm2pas, copied since older
+-- revisions don't have Parser.lexerTokens.
+local reserved = {
+  '(', ')', '*', '+', ',', '-', '.', '..', '/', ':', ':=', ';', '<', '<=', '<>', '=', '>', '>=', '[', ']',
+  'abs', 'and', 'array', 'begin', 'case', 'chr', 'class', 'const', 'dec', 'decodedate', 'decodetime', 'div',
+  'do', 'downto', 'else', 'end', 'false', 'for', 'function', 'if', 'implementation', 'in', 'inc',
+  'initialization', 'interface', 'mod', 'nil', 'not', 'object', 'odd', 'of', 'or', 'ord', 'power', 'procedure',
+  'record', 'repeat', 'self', 'then', 'to', 'true', 'trunc', 'type', 'unit', 'until', 'uses', 'var', 'while',
+  'xor', 'boolean', 'integer', 'word', 'tdatetime'
+}
+
+local tokens = {}
+
+for _, token in ipairs( reserved ) do
+  tokens[ token ] = lexer.token
+end
+
+tokens[ '//' ] = lexer.lineCommentStart
+tokens[ '{' ] = lexer.blockCommentStart
+tokens[ '}' ] = lexer.blockCommentEnd
+
+local files = { pas = {}, dfm = {} }
+
+for path in read( dir .. '/manifest.txt' ):gmatch( '[^\n]+' ) do
+  local dfm = path:gsub( '%.pas$', '.dfm' )
+  files.pas[ #files.pas + 1 ] = { path = path, source = read( path ) }
+  files.dfm[ #files.dfm + 1 ] = { path = dfm, source = read( dfm ) }
+end
+
+-- Each function scans the files once and returns the number of tokens.
+local modes = {}
+
+function modes.next( list )
+  local count = 0
+  
+  for _, file in ipairs( list ) do
+    local lex = lexer.new( file.source, file.path, tokens, "'", false, false )
+    
+    repeat
+      local la, err = lex:next()
+      
+      if not la then
+        error( err, 0 )
+      end
+      
+      count = count + 1
+    until la.token == 'eof'
+  end
+  
+  return count
+end
+
+function modes.tokenize( list )
+  for _, file in ipairs( list ) do
+    local lex = lexer.new( file.source, file.path, tokens, "'", false, false )
+    local token, err = lex:tokenize( lexer.stream() )
+    
+    if not token then
+      error( err, 0 )
+    end
+  end
+end
+
+local function measure( mode, kind )
+  local list = files[ kind ]
+  local bytes = 0
+  
+  for _, file in ipairs( list ) do
+    bytes = bytes + #file.source
+  end
+  
+  -- the first run warms up, the tokens are always counted with lex:next
+  local count = modes.next( list )
+  modes[ mode ]( list )
+  local best = math.huge
+  
+  for i = 1, runs do
+    collectgarbage()
+    local start = os.clock()
+    modes[ mode ]( list )
+    best = math.min( best, os.clock() - start )
+  end
+  
+  local mb = bytes / ( 1024 * 1024 )
+  
+  io.write( string.format( '%-8s %s %4d files %8.2f MB %9d tokens %9.1f ms %7.2f Mtokens/s %8.2f MB/s\n',
+    mode, kind, #list, mb, count, best * 1000, count / best / 1e6, mb / best ) )
+end
+
+-- lexer.stream only exists since the token streams
+local streams = lexer.stream ~= nil
+
+for _, kind in ipairs{ 'pas', 'dfm' } do
+  measure( 'next', kind )
+  
+  if streams then
+    measure( 'tokenize', kind )
+  end
+end
+
+return 0
@@ -0,0 +1,76 @@
+-- Microbenchmarks for the loops generated for Pascal for statements: the
+-- while loop used when the control variable is a field, a unit variable or is
+-- assigned in the body, and the numeric for used for local variables.
+--
+-- Usage: lua bench/loops.lua
+--
+-- Run it from the repository root.
+
+local bench = dofile( 'bench/bench.lua' ).time
+
+local count = 10000000
+local maxsprites = 10
+local sprites = {}
+local grid = { [ 0 ] = {}, {}, {}, {} }
+
+-- for i := 1 to MAXSPRITES do Sprites[i] := False;
+bench( 'sprites, while', count, function( count )
+  for frame = 1, count // maxsprites do
+    local i = 0
+    i = 1
+    while i <= ( maxsprites ) do
+      sprites[ ( i ) ] = false
+      i = i + 1
+    end
+  end
+end )
+
+bench( 'sprites, for', count, function( count )
+  for frame = 1, count // maxsprites do
+    local i = 0
+    for i = 1, ( maxsprites ) do
+      sprites[ ( i ) ] = false
+    end
+  end
+end )
+
+-- for i := 0 to 3 do for j := 4 downto 0 do Grid[i, j] := i * j;
+bench( 'grid, while', count, function( count )
+  for frame = 1, count // 20 do
+    local i, j = 0, 0
+    i = 0
+    while i <= 3 do
+      j = 4
+      while j >= 0 do
+        grid[ ( i ) ][ ( j ) ] = ( ( i ) * ( j ) )
+        j = j - 1
+      end
+      
+      i = i + 1
+    end
+  end
+end )
+
+bench( 'grid, for', count, function( count )
+  for frame = 1, count // 20 do
+    local i, j = 0, 0
+    for i = 0, 3 do
+      for j = 4, 0, -1 do
+        grid[ ( i ) ][ ( j ) ] = ( ( i ) * ( j ) )
+      end
+    end
+  end
+end )
+
+-- the control variable is a field, which stays a while loop
+local self = { index = 0 }
+
+bench( 'sprites, while over self.index', count, function( count )
+  for frame = 1, count // maxsprites do
+    self.index = 1
+    while self.index <= ( maxsprites ) do
+      sprites[ ( self.index ) ] = false
+      self.index = self.index + 1
+    end
+  end
+end )
@@ -0,0 +1,57 @@
+/* Times creating and closing translator states with translator_new, which
+   loads the embedded scripts and stubs as bytecode, or compiles their sources
+   when the bytecode is empty, see make bench-startup.
+
+   bench/startup.exe [<iterations>] */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <lua.h>
+
+#include "translator.h"
+#include "stats.h"
+
+int main( int argc, const char* argv[] )
+{
+  int iterations = argc > 1 ? atoi( argv[ 1 ] ) : 100;
+  
+  if ( iterations <= 0 )
+  {
+    fprintf( stderr, "Usage: %s [<iterations>]\n", argv[ 0 ] );
+    return 1;
+  }
+  
+  /* Best of 5 runs, after one to warm up the caches. */
+  double best = 0.0;
+  int run, i;
+  
+  for ( run = 0; run <= 5; run++ )
+  {
+    double start = stats_now();
+    
+    for ( i = 0; i < iterations; i++ )
+    {
+      char error[ 2048 ];
+      lua_State* L = translator_new( error, sizeof( error ) );
+      
+      if ( L == NULL )
+      {
+        fprintf( stderr, "%s", error );
+        return 1;
+      }
+      
+      translator_close( L );
+    }
+    
+    double ms = ( stats_now() - start ) / iterations;
+    
+    if ( run == 1 || ( run > 1 && ms < best ) )
+    {
+      best = ms;
+    }
+  }
+  
+  printf( "translator_new and translator_close: %.3f ms, best of 5 x %d iterations\n", best, iterations );
+  return 0;
+}
@@ -0,0 +1,141 @@
+-- Benchmarks the translator on the units generated by bench/gen.lua, with the
+-- lexer, the scripts and the stubs embedded in pas2lua:
+--
+--   lexer  tokenizes the .pas files with lexer.new and lex:next
+--   dfm    translates the .dfm files with dfm2pas, pictures included
+--   full   translates the units with Parser, as pas2lua does
+--
+-- Prints the best time of a few runs, the tokens and megabytes per second,
+-- and the peak resident memory of the process (Linux only), so run each mode
+-- in its own process. Timings are wall clock, which needs --stats.
+--
+-- Usage: pas2lua --stats /dev/null --run bench/translator.lua <mode> <dir> [<runs>]
+
+local mode, dir, runs = arg[ 1 ], arg[ 2 ], tonumber( arg[ 3 ] or 5 )
+
+if not ( mode == 'lexer' or mode == 'dfm' or mode == 'full' ) or not dir or not runs then
+  io.stderr:write( 'Usage: pas2lua --stats /dev/null --run bench/translator.lua lexer|dfm|full <dir> [<runs>]\n' )
+  return 1
+end
+
+local clock = stats and stats.clock or function() return os.clock() * 1000 end
+
+local function read( path )
+  local file, err = io.open( path, 'rb' )
+  
+  if not file then
+    error( err, 0 )
+  end
+  
+  local contents = file:read( 'a' )
+  file:close()
+  return contents
+end
+
+local function peakRss()
+  local file = io.open( '/proc/self/status', 'r' )
+  
+  if file then
+    local status = file:read( 'a' )
+    file:close()
+    local kb = status:match( 'VmHWM:%s*(%d+)' )
+    
+    if kb then
+      return string.format( '%.1f MiB', tonumber( kb ) / 1024 )
+    end
+  end
+  
+  return 'n/a'
+end
+
+local units = {}
+
+for line in read( dir .. '/manifest.txt' ):gmatch( '[^\n]+' ) do
+  units[ #units + 1 ] = line
+end
+
+-- Each function runs the mode once over all the units and returns the tokens and bytes processed.
+local modes = {}
+
+function modes.lexer()
+  local tokens, bytes = 0, 0
+  local reserved = Parser.lexerTokens()
+  local t = {}
+  
+  for _, path in ipairs( units ) do
+    local source = read( path )
+    local lex = lexer.new( source, path, reserved, "'", false, false )
+    
+    repeat
+      local ok, err = lex:next( t )
+      
+      if not ok then
+        error( err, 0 )
+      end
+      
+      tokens = tokens + 1
+    until t.token == 'eof'
+    
+    bytes = bytes + #source
+  end
+  
+  return tokens, bytes
+end
+
+function modes.dfm()
+  local tokens, bytes = 0, 0
+  local resources = rle.group()
+  
+  for _, path in ipairs( units ) do
+    local dfm = path:gsub( '%.pas$', '.dfm' )
+    local d2p = dfm2pas( dfm, dir .. '/data', resources )
+    d2p:parse()
+    tokens = tokens + #d2p.tokens
+    bytes = bytes + #read( dfm )
+  end
+  
+  local ok, err = resources:wait()
+  
+  if not ok then
+    error( err, 0 )
+  end
+  
+  return tokens, bytes
+end
+
+function modes.full()
+  local tokens, bytes = 0, 0
+  
+  for _, path in ipairs( units ) do
+    -- each translation starts with fresh copies of the units it uses, as in translator_run
+    debug.getregistry().pas2lua_units = {}
+    
+    local name = path:match( '([^/\\]+)%.pas$' )
+    local parser = Parser( path, dir .. '/out/' .. name .. '.lua', dir .. '/data', options )
+    parser:parse()
+    tokens = tokens + #parser.tokens
+    bytes = bytes + #read( path ) + #read( path:gsub( '%.pas$', '.dfm' ) )
+  end
+  
+  return tokens, bytes
+end
+
+os.execute( string.format( 'mkdir -p "%s/data" "%s/out"', dir, dir ) )
+
+-- the first run warms up the caches and compiles the stubs
+local tokens, bytes = modes[ mode ]()
+local best = math.huge
+
+for i = 1, runs do
+  collectgarbage()
+  local start = clock()
+  modes[ mode ]()
+  best = math.min( best, clock() - start )
+end
+
+local mb = bytes / ( 1024 * 1024 )
+
+io.write( string.format( '%-6s %4d files %8.2f MB %9d tokens %9.1f ms %7.2f Mtokens/s %8.2f MB/s  peak RSS %s\n',
+  mode, #units, mb, tokens, best, tokens / best / 1000, mb / best * 1000, peakRss() ) )
+
+return 0
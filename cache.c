@@ -0,0 +1,599 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#include "cache.h"
+
+/* An entry is a text file named after the key of the unit:
+
+     output <hash>
+     data <hash> <name>
+     ...
+
+   where each hash names a file in the cache directory with that content, so
+   units that extract the same data share it. */
+
+#define FORMAT "pas2lua cache 2"
+
+static struct
+{
+  char*           dir;
+  unsigned char   identity[ CACHE_KEY_SIZE ];
+  pthread_mutex_t lock;
+  unsigned        serial;
+  int             hits;
+  int             misses;
+  int             stored;
+}
+cache =
+{
+  NULL, { 0 }, PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0
+};
+
+static const uint32_t k[ 64 ] =
+{
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR( x, n ) ( ( ( x ) >> ( n ) ) | ( ( x ) << ( 32 - ( n ) ) ) )
+
+static void compress( cache_hash_t* hash, const unsigned char* block )
+{
+  uint32_t w[ 64 ];
+  int i;
+  
+  for ( i = 0; i < 16; i++ )
+  {
+    w[ i ] = (uint32_t)block[ i * 4 ] << 24 | (uint32_t)block[ i * 4 + 1 ] << 16 | (uint32_t)block[ i * 4 + 2 ] << 8 | block[ i * 4 + 3 ];
+  }
+  
+  for ( i = 16; i < 64; i++ )
+  {
+    uint32_t s0 = ROR( w[ i - 15 ], 7 ) ^ ROR( w[ i - 15 ], 18 ) ^ ( w[ i - 15 ] >> 3 );
+    uint32_t s1 = ROR( w[ i - 2 ], 17 ) ^ ROR( w[ i - 2 ], 19 ) ^ ( w[ i - 2 ] >> 10 );
+    w[ i ] = w[ i - 16 ] + s0 + w[ i - 7 ] + s1;
+  }
+  
+  uint32_t a = hash->state[ 0 ], b = hash->state[ 1 ], c = hash->state[ 2 ], d = hash->state[ 3 ];
+  uint32_t e = hash->state[ 4 ], f = hash->state[ 5 ], g = hash->state[ 6 ], h = hash->state[ 7 ];
+  
+  for ( i = 0; i < 64; i++ )
+  {
+    uint32_t t1 = h + ( ROR( e, 6 ) ^ ROR( e, 11 ) ^ ROR( e, 25 ) ) + ( ( e & f ) ^ ( ~e & g ) ) + k[ i ] + w[ i ];
+    uint32_t t2 = ( ROR( a, 2 ) ^ ROR( a, 13 ) ^ ROR( a, 22 ) ) + ( ( a & b ) ^ ( a & c ) ^ ( b & c ) );
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  
+  hash->state[ 0 ] += a;
+  hash->state[ 1 ] += b;
+  hash->state[ 2 ] += c;
+  hash->state[ 3 ] += d;
+  hash->state[ 4 ] += e;
+  hash->state[ 5 ] += f;
+  hash->state[ 6 ] += g;
+  hash->state[ 7 ] += h;
+}
+
+void cache_hash_init( cache_hash_t* hash )
+{
+  static const uint32_t initial[ 8 ] =
+  {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  
+  memcpy( hash->state, initial, sizeof( initial ) );
+  hash->length = 0;
+  hash->used = 0;
+}
+
+void cache_hash_update( cache_hash_t* hash, const void* data, size_t size )
+{
+  const unsigned char* aux = (const unsigned char*)data;
+  hash->length += size;
+  
+  while ( size != 0 )
+  {
+    if ( hash->used == 0 && size >= 64 )
+    {
+      compress( hash, aux );
+      aux += 64;
+      size -= 64;
+      continue;
+    }
+    
+    size_t count = 64 - hash->used;
+    
+    if ( count > size )
+    {
+      count = size;
+    }
+    
+    memcpy( hash->block + hash->used, aux, count );
+    hash->used += count;
+    aux += count;
+    size -= count;
+    
+    if ( hash->used == 64 )
+    {
+      compress( hash, hash->block );
+      hash->used = 0;
+    }
+  }
+}
+
+void cache_hash_final( cache_hash_t* hash, unsigned char digest[ CACHE_KEY_SIZE ] )
+{
+  uint64_t bits = hash->length * 8;
+  unsigned char pad = 0x80;
+  int i;
+  
+  cache_hash_update( hash, &pad, 1 );
+  pad = 0;
+  
+  while ( hash->used != 56 )
+  {
+    cache_hash_update( hash, &pad, 1 );
+  }
+  
+  for ( i = 7; i >= 0; i-- )
+  {
+    unsigned char byte = (unsigned char)( bits >> ( i * 8 ) );
+    cache_hash_update( hash, &byte, 1 );
+  }
+  
+  for ( i = 0; i < 8; i++ )
+  {
+    digest[ i * 4 ] = (unsigned char)( hash->state[ i ] >> 24 );
+    digest[ i * 4 + 1 ] = (unsigned char)( hash->state[ i ] >> 16 );
+    digest[ i * 4 + 2 ] = (unsigned char)( hash->state[ i ] >> 8 );
+    digest[ i * 4 + 3 ] = (unsigned char)hash->state[ i ];
+  }
+}
+
+static void to_hex( const unsigned char digest[ CACHE_KEY_SIZE ], char hex[ CACHE_KEY_SIZE * 2 + 1 ] )
+{
+  int i;
+  
+  for ( i = 0; i < CACHE_KEY_SIZE; i++ )
+  {
+    snprintf( hex + i * 2, 3, "%02x", digest[ i ] );
+  }
+}
+
+/* Adds a file to the hash, tagged and with its size so that the boundaries
+   between files are part of the key. Missing files are hashed as such. */
+static int hash_file( cache_hash_t* hash, const char* tag, const char* path )
+{
+  FILE* file = fopen( path, "rb" );
+  unsigned char buffer[ 65536 ];
+  uint64_t size = 0;
+  size_t count;
+  
+  cache_hash_update( hash, tag, strlen( tag ) + 1 );
+  
+  if ( file == NULL )
+  {
+    cache_hash_update( hash, "-", 1 );
+    return errno == ENOENT ? 0 : -1;
+  }
+  
+  cache_hash_update( hash, "+", 1 );
+  
+  while ( ( count = fread( buffer, 1, sizeof( buffer ), file ) ) != 0 )
+  {
+    cache_hash_update( hash, buffer, count );
+    size += count;
+  }
+  
+  int error = ferror( file );
+  fclose( file );
+  cache_hash_update( hash, &size, sizeof( size ) );
+  return error ? -1 : 0;
+}
+
+/* The base name of the unit without its extension, lower-cased as dfm2pas
+   does when it names the pictures. */
+static void hash_name( cache_hash_t* hash, const char* path )
+{
+  const char* name = path;
+  const char* ext = NULL;
+  const char* aux;
+  
+  for ( aux = path; *aux != 0; aux++ )
+  {
+    if ( *aux == '/' || *aux == '\\' )
+    {
+      name = aux + 1;
+      ext = NULL;
+    }
+    else if ( *aux == '.' )
+    {
+      ext = aux;
+    }
+  }
+  
+  cache_hash_update( hash, "name", 5 );
+  
+  for ( aux = name; aux != ( ext != NULL ? ext : name + strlen( name ) ); aux++ )
+  {
+    unsigned char k = (unsigned char)tolower( (unsigned char)*aux );
+    cache_hash_update( hash, &k, 1 );
+  }
+  
+  cache_hash_update( hash, "", 1 );
+}
+
+static char* join( const char* dir, const char* name )
+{
+  size_t size = strlen( dir ) + strlen( name ) + 2;
+  char* path = (char*)malloc( size );
+  
+  if ( path != NULL )
+  {
+    snprintf( path, size, "%s/%s", dir, name );
+  }
+  
+  return path;
+}
+
+/* A name next to path that no other thread or process will use. */
+static char* temp_name( const char* path )
+{
+  pthread_mutex_lock( &cache.lock );
+  unsigned serial = cache.serial++;
+  pthread_mutex_unlock( &cache.lock );
+  
+  size_t size = strlen( path ) + 48;
+  char* temp = (char*)malloc( size );
+  
+  if ( temp != NULL )
+  {
+    snprintf( temp, size, "%s.%ld.%u.tmp", path, (long)getpid(), serial );
+  }
+  
+  return temp;
+}
+
+/* Renames temp to path, or removes it if ok is false or renaming fails. */
+static int commit( const char* temp, const char* path, int ok )
+{
+#ifdef _WIN32
+  /* rename doesn't replace existing files on Windows. */
+  if ( ok )
+  {
+    remove( path );
+  }
+#endif
+  
+  if ( ok && rename( temp, path ) == 0 )
+  {
+    return 0;
+  }
+  
+  remove( temp );
+  return -1;
+}
+
+/* Copies a file through a temporary file so that readers never see a
+   partial one. If digest isn't NULL, it gets the hash of the contents. */
+static int copy_file( const char* from, const char* to, unsigned char* digest )
+{
+  FILE* in = fopen( from, "rb" );
+  char* temp = temp_name( to );
+  FILE* out = in != NULL && temp != NULL ? fopen( temp, "wb" ) : NULL;
+  int ok = out != NULL;
+  
+  cache_hash_t hash;
+  cache_hash_init( &hash );
+  unsigned char buffer[ 65536 ];
+  size_t count;
+  
+  while ( ok && ( count = fread( buffer, 1, sizeof( buffer ), in ) ) != 0 )
+  {
+    ok = fwrite( buffer, 1, count, out ) == count;
+    cache_hash_update( &hash, buffer, count );
+  }
+  
+  if ( in != NULL )
+  {
+    ok = ok && !ferror( in );
+    fclose( in );
+  }
+  
+  if ( out != NULL )
+  {
+    ok = fclose( out ) == 0 && ok;
+    ok = commit( temp, to, ok ) == 0;
+  }
+  
+  free( temp );
+  
+  if ( ok && digest != NULL )
+  {
+    cache_hash_final( &hash, digest );
+  }
+  
+  return ok ? 0 : -1;
+}
+
+static int write_file( const char* path, const char* data, size_t size )
+{
+  char* temp = temp_name( path );
+  FILE* file = temp != NULL ? fopen( temp, "wb" ) : NULL;
+  int ok = 0;
+  
+  if ( file != NULL )
+  {
+    ok = fwrite( data, 1, size, file ) == size;
+    ok = fclose( file ) == 0 && ok;
+    ok = commit( temp, path, ok ) == 0;
+  }
+  
+  free( temp );
+  return ok ? 0 : -1;
+}
+
+/* Copies a file to the cache directory under the name of its hash, which
+   goes to hex. The hash is only known after copying, so the copy is made to
+   a temporary name first. */
+static int store_object( const char* path, char hex[ CACHE_KEY_SIZE * 2 + 1 ] )
+{
+  char* staging = join( cache.dir, "object" );
+  char* temp = staging != NULL ? temp_name( staging ) : NULL;
+  unsigned char digest[ CACHE_KEY_SIZE ];
+  int res = -1;
+  
+  if ( temp != NULL && copy_file( path, temp, digest ) == 0 )
+  {
+    to_hex( digest, hex );
+    char* object = join( cache.dir, hex );
+    res = object != NULL ? commit( temp, object, 1 ) : commit( temp, temp, 0 );
+    free( object );
+  }
+  
+  free( staging );
+  free( temp );
+  return res;
+}
+
+int cache_open( const char* dir, const unsigned char identity[ CACHE_KEY_SIZE ] )
+{
+#ifdef _WIN32
+  if ( _mkdir( dir ) != 0 && errno != EEXIST )
+#else
+  if ( mkdir( dir, 0777 ) != 0 && errno != EEXIST )
+#endif
+  {
+    return -1;
+  }
+  
+  free( cache.dir );
+  
+  if ( ( cache.dir = strdup( dir ) ) == NULL )
+  {
+    return -1;
+  }
+  
+  memcpy( cache.identity, identity, CACHE_KEY_SIZE );
+  return 0;
+}
+
+int cache_enabled( void )
+{
+  return cache.dir != NULL;
+}
+
+static int compute_key( const char* input, unsigned char key[ CACHE_KEY_SIZE ] )
+{
+  cache_hash_t hash;
+  cache_hash_init( &hash );
+  cache_hash_update( &hash, FORMAT, sizeof( FORMAT ) );
+  cache_hash_update( &hash, cache.identity, CACHE_KEY_SIZE );
+  hash_name( &hash, input );
+  
+  if ( hash_file( &hash, "pas", input ) != 0 )
+  {
+    return -1;
+  }
+  
+  /* The form of the unit, found the same way the parser does: the last .pas
+     in the path replaced by .dfm. Hashed even if the unit doesn't use it. */
+  const char* ext = NULL;
+  const char* aux;
+  
+  for ( aux = strstr( input, ".pas" ); aux != NULL; aux = strstr( aux + 1, ".pas" ) )
+  {
+    ext = aux;
+  }
+  
+  if ( ext != NULL )
+  {
+    size_t length = strlen( input );
+    char* dfm = (char*)malloc( length + 1 );
+    
+    if ( dfm == NULL )
+    {
+      return -1;
+    }
+    
+    memcpy( dfm, input, length + 1 );
+    memcpy( dfm + ( ext - input ), ".dfm", 4 );
+    int res = hash_file( &hash, "dfm", dfm );
+    free( dfm );
+    
+    if ( res != 0 )
+    {
+      return -1;
+    }
+  }
+  
+  cache_hash_final( &hash, key );
+  return 0;
+}
+
+static int restore( const unsigned char key[ CACHE_KEY_SIZE ], const char* output, const char* datadir )
+{
+  char hex[ CACHE_KEY_SIZE * 2 + 8 ];
+  to_hex( key, hex );
+  strcat( hex, ".entry" );
+  
+  char* path = join( cache.dir, hex );
+  FILE* entry = path != NULL ? fopen( path, "r" ) : NULL;
+  free( path );
+  
+  if ( entry == NULL )
+  {
+    return -1;
+  }
+  
+  char line[ 4096 ];
+  int res = 0, outputs = 0;
+  
+  while ( res == 0 && fgets( line, sizeof( line ), entry ) != NULL )
+  {
+    char object[ CACHE_KEY_SIZE * 2 + 1 ];
+    char name[ 4096 ];
+    char* to = NULL;
+    
+    line[ strcspn( line, "\r\n" ) ] = 0;
+    
+    if ( sscanf( line, "output %64s", object ) == 1 && strlen( line ) == 7 + CACHE_KEY_SIZE * 2 )
+    {
+      to = strdup( output );
+      outputs++;
+    }
+    else if ( sscanf( line, "data %64s %4095[^\n]", object, name ) == 2 )
+    {
+      to = join( datadir, name );
+    }
+    else
+    {
+      res = -1;
+      break;
+    }
+    
+    char* from = join( cache.dir, object );
+    res = from != NULL && to != NULL ? copy_file( from, to, NULL ) : -1;
+    free( from );
+    free( to );
+  }
+  
+  fclose( entry );
+  return res == 0 && outputs == 1 ? 0 : -1;
+}
+
+int cache_lookup( const char* input, const char* output, const char* datadir, unsigned char key[ CACHE_KEY_SIZE ] )
+{
+  int hit = compute_key( input, key ) == 0 && restore( key, output, datadir ) == 0;
+  
+  pthread_mutex_lock( &cache.lock );
+  
+  if ( hit )
+  {
+    cache.hits++;
+  }
+  else
+  {
+    cache.misses++;
+  }
+  
+  pthread_mutex_unlock( &cache.lock );
+  return hit;
+}
+
+void cache_store( const unsigned char key[ CACHE_KEY_SIZE ], const char* output, const char* datadir, const char* const* files, int count )
+{
+  /* Failing to store is not an error, the unit will be translated again. */
+  char hex[ CACHE_KEY_SIZE * 2 + 1 ];
+  size_t size = 256, used = 0;
+  char* text = (char*)malloc( size );
+  int res = text != NULL ? store_object( output, hex ) : -1;
+  int i;
+  
+  if ( res == 0 )
+  {
+    used = snprintf( text, size, "output %s\n", hex );
+  }
+  
+  for ( i = 0; res == 0 && i < count; i++ )
+  {
+    char* path = join( datadir, files[ i ] );
+    res = path != NULL && strchr( files[ i ], '\n' ) == NULL ? store_object( path, hex ) : -1;
+    free( path );
+    
+    size_t needed = used + strlen( files[ i ] ) + CACHE_KEY_SIZE * 2 + 8;
+    
+    if ( res == 0 && needed > size )
+    {
+      char* aux = (char*)realloc( text, size = needed * 2 );
+      
+      if ( aux == NULL )
+      {
+        res = -1;
+        break;
+      }
+      
+      text = aux;
+    }
+    
+    if ( res == 0 )
+    {
+      used += snprintf( text + used, size - used, "data %s %s\n", hex, files[ i ] );
+    }
+  }
+  
+  /* The entry is written last so it's only found when everything it names is there. */
+  if ( res == 0 )
+  {
+    char name[ CACHE_KEY_SIZE * 2 + 8 ];
+    to_hex( key, name );
+    strcat( name, ".entry" );
+    char* path = join( cache.dir, name );
+    
+    if ( path != NULL && write_file( path, text, used ) == 0 )
+    {
+      pthread_mutex_lock( &cache.lock );
+      cache.stored++;
+      pthread_mutex_unlock( &cache.lock );
+    }
+    
+    free( path );
+  }
+  
+  free( text );
+}
+
+void cache_report( FILE* file )
+{
+  if ( cache_enabled() )
+  {
+    fprintf( file, "cache: %d hit(s), %d miss(es), %d stored\n", cache.hits, cache.misses, cache.stored );
+  }
+}
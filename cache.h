@@ -0,0 +1,40 @@
+#ifndef PAS2LUA_CACHE_H
+#define PAS2LUA_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CACHE_KEY_SIZE 32
+
+/* SHA-256, used for the cache keys and to name the cached files. */
+typedef struct
+{
+  uint32_t      state[ 8 ];
+  uint64_t      length;
+  unsigned char block[ 64 ];
+  size_t        used;
+}
+cache_hash_t;
+
+void cache_hash_init( cache_hash_t* hash );
+void cache_hash_update( cache_hash_t* hash, const void* data, size_t size );
+void cache_hash_final( cache_hash_t* hash, unsigned char digest[ CACHE_KEY_SIZE ] );
+
+/* Enables the cache in dir, which is created if needed. identity is the hash
+   of everything in the translator that affects its output. */
+int cache_open( const char* dir, const unsigned char identity[ CACHE_KEY_SIZE ] );
+int cache_enabled( void );
+
+/* Looks up the translation of input. On a hit, the cached output and data
+   files are written to output and datadir and 1 is returned. On a miss, key
+   is set to the key that cache_store expects and 0 is returned. */
+int cache_lookup( const char* input, const char* output, const char* datadir, unsigned char key[ CACHE_KEY_SIZE ] );
+
+/* Stores output and the files named in files, relative to datadir. */
+void cache_store( const unsigned char key[ CACHE_KEY_SIZE ], const char* output, const char* datadir, const char* const* files, int count );
+
+/* Prints the hit and miss counts. */
+void cache_report( FILE* file );
+
+#endif /* PAS2LUA_CACHE_H */
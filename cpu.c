@@ -0,0 +1,19 @@
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "cpu.h"
+
+int cpu_count( void )
+{
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo( &info );
+  return (int)info.dwNumberOfProcessors;
+#else
+  long count = sysconf( _SC_NPROCESSORS_ONLN );
+  return count > 0 ? (int)count : 1;
+#endif
+}
@@ -0,0 +1,7 @@
+#ifndef PAS2LUA_CPU_H
+#define PAS2LUA_CPU_H
+
+/* Number of processors available, at least 1. */
+int cpu_count( void );
+
+#endif /* PAS2LUA_CPU_H */
@@ -1,12 +1,29 @@
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 
+#include "lexer.h"
+
 #define MY_NAME "lexer_t"
+#define STREAM_NAME "stream_t"
+#define KINDS_NAME "lexer_kinds"
+#define SOURCES_NAME "lexer_sources"
 
 #define TOOBIG            -2
 #define INVALIDCHAR       -1
@@ -15,6 +32,18 @@
 #define BLOCKCOMMENTSTART  3
 #define BLOCKCOMMENTEND    4
 
+/* Ids of the builtin token kinds, keywords and symbols get theirs when the lexer is created. */
+#define KIND_EOF           1
+#define KIND_ID            2
+#define KIND_INTEGER       3
+#define KIND_FP            4
+#define KIND_STRING        5
+#define KIND_CHARACTER     6
+#define KIND_DIRECTIVE     7
+#define KIND_COMMENT       8
+
+#define MAX_KINDS       4096
+
 #if 0
 static void dump_stack( lua_State* L )
 {
@@ -64,23 +93,98 @@ static void dump_stack( lua_State* L )
 }
 #endif
 
+#define MAX_SYMBOL         7
+
+typedef struct
+{
+  char*  key;
+  size_t length;
+  int    kind;
+}
+keyword_t;
+
+typedef struct
+{
+  char ch;
+  int  type;    /* TOKEN, LINECOMMENTSTART etc., 0 if the prefix isn't a symbol */
+  int  kind;
+  int  child;   /* first child, 0 if none */
+  int  sibling; /* next child of the same parent, 0 if none */
+}
+node_t;
+
 typedef struct
 {
   int  source_ref;
   int  source_name_ref;
   int  line_number;
-  int  keywords_ref;
   char quote;
   int  case_sensitive;
   int  octals;
+  int  source_id;
   
   const char* begin;
   const char* start;
   const char* current;
   const char* end;
+  
+  char*  scratch;
+  size_t scratch_size;
+  
+  /* keywords in a perfect hash table, symbols in a trie rooted at node 0 */
+  keyword_t* keywords;
+  uint32_t   keywords_mask;
+  uint32_t   keywords_seed;
+  size_t     keywords_max;
+  node_t*    nodes;
+  int        node_count;
+  
+  /* the block comment terminator when it's a single character that no other symbol uses, 0 otherwise */
+  char comment_end;
+  
+  /* the source when it was opened from a file, either mapped or read into a buffer */
+  const char* map;
+  size_t      map_size;
+  char*       buffer;
 }
 lexer_t;
 
+typedef struct
+{
+  int         kind;
+  const char* lexeme;
+  size_t      length;
+  const char* error;
+  char        extra[ 2 ];
+}
+scan_t;
+
+typedef struct
+{
+  uint32_t kind;
+  uint32_t source;
+  uint32_t line;
+  uint32_t pos;
+  uint32_t offset;
+  uint32_t length;
+  uint32_t atom;    /* id of the lowercased lexeme, 0 if not interned yet */
+}
+token_t;
+
+typedef struct
+{
+  token_t* tokens;
+  size_t   count;
+  size_t   reserved;
+  
+  char*    text;
+  size_t   text_size;
+  size_t   text_reserved;
+  
+  uint32_t atoms;
+}
+stream_t;
+
 static const uint8_t char_classes[ 256 ] =
 {
   0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x41, 0x00, 0x00, 0x01, 0x00, 0x00,
@@ -153,6 +257,182 @@ static char is_eos( char k )
   return char_classes[ (unsigned char)k ] & CC_EOS;
 }
 
+/* Vectorized scanners for the runs that dominate the input: blanks,
+   identifiers, and the bodies of comments and strings. Each one scans whole
+   vectors while at least one fits before the end of the input and finishes
+   with the scalar loop. Most blanks and identifiers are short, so the first
+   few bytes are always looked at one by one. Build with -mavx2 to get the
+   32-byte versions. */
+#if defined( __AVX2__ )
+#include <immintrin.h>
+
+typedef __m256i vec_t;
+
+#define VEC_SIZE         32
+#define VEC_FULL         0xffffffffU
+#define vec_load( p )    _mm256_loadu_si256( (const __m256i*)( p ) )
+#define vec_set( k )     _mm256_set1_epi8( (char)( k ) )
+#define vec_eq( a, b )   _mm256_cmpeq_epi8( a, b )
+#define vec_lt( a, b )   _mm256_cmpgt_epi8( b, a )
+#define vec_or( a, b )   _mm256_or_si256( a, b )
+#define vec_add( a, b )  _mm256_add_epi8( a, b )
+#define vec_mask( a )    ( (uint32_t)_mm256_movemask_epi8( a ) )
+#elif defined( __SSE2__ )
+#include <emmintrin.h>
+
+typedef __m128i vec_t;
+
+#define VEC_SIZE         16
+#define VEC_FULL         0xffffU
+#define vec_load( p )    _mm_loadu_si128( (const __m128i*)( p ) )
+#define vec_set( k )     _mm_set1_epi8( (char)( k ) )
+#define vec_eq( a, b )   _mm_cmpeq_epi8( a, b )
+#define vec_lt( a, b )   _mm_cmplt_epi8( a, b )
+#define vec_or( a, b )   _mm_or_si128( a, b )
+#define vec_add( a, b )  _mm_add_epi8( a, b )
+#define vec_mask( a )    ( (uint32_t)_mm_movemask_epi8( a ) )
+#endif
+
+#define SCALAR_PREFIX 8
+
+#ifdef VEC_SIZE
+/* Bytes in [ first, first + count ), shifted so the range becomes the lowest
+   signed bytes and a single signed compare does it. */
+static vec_t vec_range( vec_t v, int first, int count )
+{
+  return vec_lt( vec_add( v, vec_set( 0x80 - first ) ), vec_set( 0x80 + count ) );
+}
+
+static int count_newlines( uint32_t newlines, uint32_t before )
+{
+  return __builtin_popcount( newlines & ( ( 1U << before ) - 1 ) );
+}
+#endif
+
+/* Skips blanks, adding the new lines found to *newlines. */
+static const char* span_spaces( const char* p, const char* end, int* newlines )
+{
+  const char* prefix = p + SCALAR_PREFIX;
+  
+  for ( ; p < prefix; p++ )
+  {
+    if ( !is_space( *p ) )
+    {
+      return p;
+    }
+    
+    *newlines += *p == '\n';
+  }
+  
+#ifdef VEC_SIZE
+  while ( end - p >= VEC_SIZE )
+  {
+    vec_t v = vec_load( p );
+    vec_t lf = vec_eq( v, vec_set( '\n' ) );
+    vec_t blank = vec_or( vec_or( vec_eq( v, vec_set( ' ' ) ), vec_eq( v, vec_set( '\t' ) ) ), vec_or( lf, vec_eq( v, vec_set( '\r' ) ) ) );
+    uint32_t other = ~vec_mask( blank ) & VEC_FULL;
+    
+    if ( other != 0 )
+    {
+      int n = __builtin_ctz( other );
+      *newlines += count_newlines( vec_mask( lf ), n );
+      return p + n;
+    }
+    
+    *newlines += __builtin_popcount( vec_mask( lf ) );
+    p += VEC_SIZE;
+  }
+#endif
+
+  while ( is_space( *p ) )
+  {
+    *newlines += *p++ == '\n';
+  }
+  
+  return p;
+}
+
+/* Skips letters, digits and '_'. */
+static const char* span_alnum( const char* p, const char* end )
+{
+  const char* prefix = p + SCALAR_PREFIX;
+  
+  for ( ; p < prefix; p++ )
+  {
+    if ( !is_alnum( *p ) )
+    {
+      return p;
+    }
+  }
+  
+#ifdef VEC_SIZE
+  while ( end - p >= VEC_SIZE )
+  {
+    vec_t v = vec_load( p );
+    vec_t alpha = vec_range( vec_or( v, vec_set( 0x20 ) ), 'a', 26 );
+    vec_t alnum = vec_or( vec_or( alpha, vec_range( v, '0', 10 ) ), vec_eq( v, vec_set( '_' ) ) );
+    uint32_t other = ~vec_mask( alnum ) & VEC_FULL;
+    
+    if ( other != 0 )
+    {
+      return p + __builtin_ctz( other );
+    }
+    
+    p += VEC_SIZE;
+  }
+#endif
+
+  while ( is_alnum( *p ) )
+  {
+    p++;
+  }
+  
+  return p;
+}
+
+/* Finds the first a or b, or end if there's none. When newlines isn't NULL,
+   the new lines before the character found are added to it. */
+static const char* find_either( const char* p, const char* end, char a, char b, int* newlines )
+{
+#ifdef VEC_SIZE
+  while ( end - p >= VEC_SIZE )
+  {
+    vec_t v = vec_load( p );
+    uint32_t found = vec_mask( vec_or( vec_eq( v, vec_set( a ) ), vec_eq( v, vec_set( b ) ) ) );
+    uint32_t lf = newlines != NULL ? vec_mask( vec_eq( v, vec_set( '\n' ) ) ) : 0;
+    
+    if ( found != 0 )
+    {
+      int n = __builtin_ctz( found );
+      
+      if ( newlines != NULL )
+      {
+        *newlines += count_newlines( lf, n );
+      }
+      
+      return p + n;
+    }
+    
+    if ( newlines != NULL )
+    {
+      *newlines += __builtin_popcount( lf );
+    }
+    
+    p += VEC_SIZE;
+  }
+#endif
+
+  for ( ; p < end && *p != a && *p != b; p++ )
+  {
+    if ( newlines != NULL && *p == '\n' )
+    {
+      ( *newlines )++;
+    }
+  }
+  
+  return p;
+}
+
 static lexer_t* check_lexer( lua_State* L, int index )
 {
   return (lexer_t*)luaL_checkudata( L, index, MY_NAME );
@@ -265,7 +545,7 @@ static int raise_error( lua_State* L, lexer_t* lexer, const char* format, const
   
   lua_rawgeti( L, LUA_REGISTRYINDEX, lexer->source_name_ref );
   lua_pushliteral( L, ":" );
-  lua_pushnumber( L, lexer->line_number );
+  lua_pushinteger( L, lexer->line_number );
   lua_pushliteral( L, ": " );
   lua_pushfstring( L, format, extra );
   lua_concat( L, 5 );
@@ -273,193 +553,481 @@ static int raise_error( lua_State* L, lexer_t* lexer, const char* format, const
   return 2;
 }
 
-static int parse_symbol( lua_State* L, lexer_t* lexer, size_t* length )
+static int intern( lua_State* L, int table )
 {
-  char symbol[ 8 ];
-  size_t len = 0;
-  int type = 0;
-  int top = lua_gettop( L );
+  /* Returns the id of the string at the top of the stack in the table, adding it if needed. */
+  lua_pushvalue( L, -1 );
+  lua_rawget( L, table );
+  int id = (int)lua_tointeger( L, -1 );
+  lua_pop( L, 1 );
+  
+  if ( id == 0 )
+  {
+    id = (int)lua_rawlen( L, table ) + 1;
+    lua_pushvalue( L, -1 );
+    lua_rawseti( L, table, id );
+    lua_pushinteger( L, id );
+    lua_rawset( L, table );
+  }
+  else
+  {
+    lua_pop( L, 1 );
+  }
   
-  lua_rawgeti( L, LUA_REGISTRYINDEX, lexer->keywords_ref );
+  return id;
+}
+
+static int parse_symbol( lexer_t* lexer, size_t* length, int* kind )
+{
+  /* Walk the trie while the characters read so far form a valid symbol. */
+  const node_t* nodes = lexer->nodes;
+  int node = 0;
+  size_t len = 0;
+  int type = INVALIDCHAR;
   
   for ( ;; )
   {
-    if ( len == sizeof( symbol ) - 1 )
+    if ( len == MAX_SYMBOL )
     {
-      type = TOOBIG;
-      break;
+      return TOOBIG;
     }
     
-    symbol[ len++ ] = *lexer->current;
-    
-    lua_pushlstring( L, symbol, len );
-    lua_gettable( L, -2 );
-    int typ = lua_tointeger( L, -1 );
-    lua_pop( L, 1 );
+    char k = *lexer->current;
+    int child = nodes[ node ].child;
     
-    if ( typ != 0 ) // valid symbol
+    while ( child != 0 && nodes[ child ].ch != k )
     {
-      type = typ;
-      skip( lexer );
+      child = nodes[ child ].sibling;
     }
-    else // invalid symbol
+    
+    if ( child == 0 || nodes[ child ].type == 0 || k == 0 )
     {
-      if ( --len == 0 )
-      {
-        type = INVALIDCHAR;
-        break;
-      }
-      
       *length = len;
-      break;
+      return type;
     }
+    
+    node = child;
+    type = nodes[ node ].type;
+    *kind = nodes[ node ].kind;
+    len++;
+    skip( lexer );
   }
-  
-  lua_settop( L, top );
-  return type;
 }
 
-int next_token( lua_State* L )
+static char to_lower( char k )
 {
-  lexer_t* self = check_lexer( L, 1 );
+  return k >= 'A' && k <= 'Z' ? k - 'A' + 'a' : k;
+}
+
+static uint32_t hash_keyword( uint32_t seed, const char* key, size_t length, int case_sensitive )
+{
+  /* FNV-1a with the seed as the offset basis. */
+  uint32_t hash = seed;
+  size_t i;
   
-  if ( lua_isnoneornil( L, 2 ) )
+  if ( case_sensitive )
   {
-    lua_settop( L, 1 );
-    lua_newtable( L );
+    for ( i = 0; i < length; i++ )
+    {
+      hash = ( hash ^ (uint8_t)key[ i ] ) * 16777619U;
+    }
   }
   else
   {
-    luaL_checktype( L, 2, LUA_TTABLE );
-    lua_settop( L, 2 );
+    for ( i = 0; i < length; i++ )
+    {
+      hash = ( hash ^ (uint8_t)to_lower( key[ i ] ) ) * 16777619U;
+    }
   }
   
-  // skip spaces.
-  for ( ;; )
+  return hash;
+}
+
+static int find_keyword( const lexer_t* lexer, const char* lexeme, size_t length )
+{
+  if ( length > lexer->keywords_max )
   {
-    if ( is_space( *self->current ) )
-    {
-      if ( *self->current == '\n' )
-      {
-        self->line_number++;
-      }
-      
-      skip( self );
-    }
-    else if ( *self->current != 0 )
-    {
-      break;
-    }
-    else
-    {
-      // Return EOF if we've reached the end of the input.
-      
-      lua_pushliteral( L, "<eof>" );
-      lua_pushliteral( L, "eof" );
-      return push_result( L, self, -2, -1 );
-    }
+    return KIND_ID;
   }
   
-  const char* start = self->start = self->current;
+  uint32_t hash = hash_keyword( lexer->keywords_seed, lexeme, length, lexer->case_sensitive );
+  const keyword_t* keyword = lexer->keywords + ( hash & lexer->keywords_mask );
   
-  // If the character is alphabetic or '_', the token is an identifier.
-  if ( is_alpha( *self->current ) )
+  if ( keyword->length != length )
   {
-    // Get all alphanumeric and '_' and '.' characters.
-    do
+    return KIND_ID;
+  }
+  
+  size_t i;
+  
+  if ( lexer->case_sensitive )
+  {
+    return memcmp( keyword->key, lexeme, length ) == 0 ? keyword->kind : KIND_ID;
+  }
+  
+  for ( i = 0; i < length; i++ )
+  {
+    if ( keyword->key[ i ] != to_lower( lexeme[ i ] ) )
     {
-      skip( self );
+      return KIND_ID;
     }
-    while ( is_alnum( *self->current ) );
-    
-    size_t length = self->current - start;
-    lua_rawgeti( L, LUA_REGISTRYINDEX, self->keywords_ref );
-    lua_pushlstring( L, start, length );
+  }
+  
+  return keyword->kind;
+}
 
-    if ( self->case_sensitive )
+static int build_hash( lexer_t* lexer, const keyword_t* keys, size_t count )
+{
+  /* Search for a table size and seed without collisions so lookups are a single probe. */
+  uint32_t size = 16;
+  
+  while ( size < count * 2 )
+  {
+    size *= 2;
+  }
+  
+  for ( ;; size *= 2 )
+  {
+    keyword_t* table = (keyword_t*)calloc( size, sizeof( keyword_t ) );
+    uint32_t seed;
+    
+    if ( table == NULL )
     {
-      lua_pushvalue( L, -1 );
+      return -1;
     }
-    else
+    
+    for ( seed = 2166136261U; seed < 2166136261U + 1024; seed++ )
     {
-      luaL_Buffer lower;
-      /*luaL_buffinitsize( L, &lower, length );*/
-      luaL_buffinit( L, &lower );
+      size_t i;
       
-      while ( start < self->current )
+      for ( i = 0; i < count; i++ )
       {
-        luaL_addchar( &lower, tolower( *start++ ) );
+        keyword_t* slot = table + ( hash_keyword( seed, keys[ i ].key, keys[ i ].length, lexer->case_sensitive ) & ( size - 1 ) );
+        
+        if ( slot->key != NULL )
+        {
+          break;
+        }
+        
+        *slot = keys[ i ];
       }
-
-      luaL_pushresult( &lower );
+      
+      if ( i == count )
+      {
+        lexer->keywords = table;
+        lexer->keywords_mask = size - 1;
+        lexer->keywords_seed = seed;
+        return 0;
+      }
+      
+      memset( table, 0, size * sizeof( keyword_t ) );
     }
-  
-    lua_pushvalue( L, -1 );
-    lua_gettable( L, -4 );
     
-    if ( lua_toboolean( L, -1 ) )
-    {
-      return push_result( L, self, -3, -2 );
-    }
-
-    lua_pushliteral( L, "id" );
-    return push_result( L, self, -4, -1 );
+    free( table );
   }
+}
 
-  // If the character is a digit, the token is a number.
-  if ( is_decimal( *self->current ) )
+static int add_symbol( lexer_t* lexer, const char* symbol, size_t length, int type, int kind )
+{
+  int node = 0;
+  size_t i;
+  
+  for ( i = 0; i < length; i++ )
   {
-    int real = *self->current == '.' && self->current[ 1 ] != '.';
-
-    do
-    {
-      skip( self );
-    }
-    while ( is_decimal( *self->current ) );
+    int child = lexer->nodes[ node ].child;
     
-    if ( !real && *self->current == '.' && self->current[ 1 ] != '.' )
+    while ( child != 0 && lexer->nodes[ child ].ch != symbol[ i ] )
     {
-      real = 1;
-      
-      do
-      {
-        skip( self );
-      }
-      while ( is_decimal( *self->current ) );
+      child = lexer->nodes[ child ].sibling;
     }
     
-    if ( tolower( *self->current ) == 'e' )
+    if ( child == 0 )
     {
-      real = 1;
-      skip( self );
+      node_t* nodes = (node_t*)realloc( lexer->nodes, ( lexer->node_count + 1 ) * sizeof( node_t ) );
       
-      if ( *self->current == '-' || *self->current == '+' )
+      if ( nodes == NULL )
       {
-        skip( self );
+        return -1;
       }
       
-      if ( !is_decimal( *self->current ) )
-      {
-        char string[ 2 ] = { *self->current, 0 };
-        return raise_error( L, self, "Invalid digit in exponent: %c", string );
-      }
+      lexer->nodes = nodes;
+      child = lexer->node_count++;
+      
+      memset( nodes + child, 0, sizeof( node_t ) );
+      nodes[ child ].ch = symbol[ i ];
+      nodes[ child ].sibling = nodes[ node ].child;
+      nodes[ node ].child = child;
     }
     
-    lua_pushlstring( L, start, self->current - start );
-    
-    if ( real )
+    node = child;
+  }
+  
+  lexer->nodes[ node ].type = type;
+  lexer->nodes[ node ].kind = kind;
+  return 0;
+}
+
+static char find_comment_end( const lexer_t* lexer )
+{
+  /* Inside block comments symbols are skipped as a whole, so searching for the
+     terminator is only the same when it's a single character that doesn't
+     appear in any other symbol. */
+  int end = 0, node;
+  
+  for ( node = lexer->nodes[ 0 ].child; node != 0; node = lexer->nodes[ node ].sibling )
+  {
+    if ( lexer->nodes[ node ].type == BLOCKCOMMENTEND )
     {
-      lua_pushliteral( L, "fp" );
+      end = node;
     }
-    else
+  }
+  
+  if ( end == 0 || lexer->nodes[ end ].child != 0 || lexer->nodes[ end ].ch == '\n' )
+  {
+    return 0;
+  }
+  
+  for ( node = 1; node < lexer->node_count; node++ )
+  {
+    if ( node != end && ( lexer->nodes[ node ].ch == lexer->nodes[ end ].ch || lexer->nodes[ node ].type == BLOCKCOMMENTEND ) )
     {
-      lua_pushliteral( L, "integer" );
+      return 0;
     }
-    
-    return push_result( L, self, -2, -1 );
   }
   
-  // Hexadecimal constants.
+  return lexer->nodes[ end ].ch;
+}
+
+static int compile_keywords( lua_State* L, lexer_t* lexer, int keywords, int kinds )
+{
+  /* Keywords go into a perfect hash table, symbols into a trie, and both
+     get their kind ids now so the scanner never touches the Lua tables. */
+  size_t count = 0, reserved = 0;
+  keyword_t* keys = NULL;
+  int res = 0;
+  
+  lexer->nodes = (node_t*)calloc( 1, sizeof( node_t ) );
+  lexer->node_count = 1;
+  
+  if ( lexer->nodes == NULL )
+  {
+    return -1;
+  }
+  
+  lua_pushnil( L );
+  
+  while ( res == 0 && lua_next( L, keywords ) != 0 )
+  {
+    int type = (int)lua_tointeger( L, -1 );
+    int truthy = lua_toboolean( L, -1 );
+    lua_pop( L, 1 );
+    
+    if ( lua_type( L, -1 ) != LUA_TSTRING )
+    {
+      continue;
+    }
+    
+    size_t length;
+    const char* key = lua_tolstring( L, -1, &length );
+    
+    if ( length == 0 )
+    {
+      continue;
+    }
+    
+    if ( is_alpha( key[ 0 ] ) )
+    {
+      size_t i;
+      
+      /* Identifiers are looked up lowercased when not case sensitive, keys with
+         uppercase letters could never match. */
+      for ( i = 0; i < length && ( lexer->case_sensitive || to_lower( key[ i ] ) == key[ i ] ); i++ )
+        /* nothing */;
+      
+      if ( !truthy || i < length )
+      {
+        continue;
+      }
+      
+      if ( count == reserved )
+      {
+        reserved = reserved ? reserved * 2 : 64;
+        keyword_t* aux = (keyword_t*)realloc( keys, reserved * sizeof( keyword_t ) );
+        
+        if ( aux == NULL )
+        {
+          res = -1;
+          break;
+        }
+        
+        keys = aux;
+      }
+      
+      keys[ count ].key = (char*)malloc( length );
+      
+      if ( keys[ count ].key == NULL )
+      {
+        res = -1;
+        break;
+      }
+      
+      memcpy( keys[ count ].key, key, length );
+      keys[ count ].length = length;
+      
+      lua_pushvalue( L, -1 );
+      keys[ count ].kind = intern( L, kinds );
+      
+      if ( length > lexer->keywords_max )
+      {
+        lexer->keywords_max = length;
+      }
+      
+      count++;
+    }
+    else if ( type != 0 )
+    {
+      int kind = 0;
+      
+      if ( type == TOKEN )
+      {
+        lua_pushvalue( L, -1 );
+        kind = intern( L, kinds );
+      }
+      
+      res = add_symbol( lexer, key, length, type, kind );
+    }
+  }
+  
+  if ( res == 0 )
+  {
+    res = build_hash( lexer, keys, count );
+    lexer->comment_end = find_comment_end( lexer );
+  }
+  
+  if ( res != 0 )
+  {
+    size_t i;
+    
+    for ( i = 0; i < count; i++ )
+    {
+      free( keys[ i ].key );
+    }
+  }
+  
+  free( keys );
+  return res;
+}
+
+static char* reserve( lexer_t* lexer, size_t size )
+{
+  if ( size > lexer->scratch_size )
+  {
+    size_t new_size = lexer->scratch_size ? lexer->scratch_size : 256;
+    
+    while ( new_size < size )
+    {
+      new_size *= 2;
+    }
+    
+    char* scratch = (char*)realloc( lexer->scratch, new_size );
+    
+    if ( scratch == NULL )
+    {
+      return NULL;
+    }
+    
+    lexer->scratch = scratch;
+    lexer->scratch_size = new_size;
+  }
+  
+  return lexer->scratch;
+}
+
+static int scan_error( scan_t* scan, const char* format, char extra )
+{
+  scan->error = format;
+  scan->extra[ 0 ] = extra;
+  scan->extra[ 1 ] = 0;
+  return -1;
+}
+
+/* Scans the next token. Lexemes that are not verbatim copies of the source
+   (strings, hexadecimal constants, characters) and lowercased keywords are
+   built in the lexer's scratch buffer, valid until the next call. */
+static int scan_token( lua_State* L, lexer_t* self, scan_t* scan )
+{
+  // skip spaces.
+  self->current = span_spaces( self->current, self->end, &self->line_number );
+  
+  if ( *self->current == 0 )
+  {
+    // Return EOF if we've reached the end of the input.
+    self->start = self->current;
+    scan->kind = KIND_EOF;
+    scan->lexeme = "<eof>";
+    scan->length = 5;
+    return 0;
+  }
+  
+  const char* start = self->start = self->current;
+  
+  // If the character is alphabetic or '_', the token is an identifier.
+  if ( is_alpha( *self->current ) )
+  {
+    // Get all alphanumeric and '_' characters.
+    self->current = span_alnum( self->current + 1, self->end );
+    
+    scan->kind = find_keyword( self, start, self->current - start );
+    scan->lexeme = start;
+    scan->length = self->current - start;
+    return 0;
+  }
+
+  // If the character is a digit, the token is a number.
+  if ( is_decimal( *self->current ) )
+  {
+    int real = *self->current == '.' && self->current[ 1 ] != '.';
+
+    do
+    {
+      skip( self );
+    }
+    while ( is_decimal( *self->current ) );
+    
+    if ( !real && *self->current == '.' && self->current[ 1 ] != '.' )
+    {
+      real = 1;
+      
+      do
+      {
+        skip( self );
+      }
+      while ( is_decimal( *self->current ) );
+    }
+    
+    if ( tolower( *self->current ) == 'e' )
+    {
+      real = 1;
+      skip( self );
+      
+      if ( *self->current == '-' || *self->current == '+' )
+      {
+        skip( self );
+      }
+      
+      if ( !is_decimal( *self->current ) )
+      {
+        return scan_error( scan, "Invalid digit in exponent: %s", *self->current );
+      }
+    }
+    
+    scan->kind = real ? KIND_FP : KIND_INTEGER;
+    scan->lexeme = start;
+    scan->length = self->current - start;
+    return 0;
+  }
+  
+  // Hexadecimal constants.
   if ( *self->current == '$' )
   {
     int x = 0;
@@ -483,127 +1051,84 @@ int next_token( lua_State* L )
     }
     else
     {
-      char string[ 2 ] = { *self->current, 0 };
-      return raise_error( L, self, "Invalid hexadecimal digit: '%c'", string );
+      return scan_error( scan, "Invalid hexadecimal digit: '%s'", *self->current );
+    }
+    
+    char* decimal = reserve( self, 16 );
+    
+    if ( decimal == NULL )
+    {
+      return scan_error( scan, "Out of memory", 0 );
     }
     
-    lua_pushfstring( L, "%d", x );
-    lua_pushliteral( L, "integer" );
-    return push_result( L, self, -2, -1 );
+    scan->kind = KIND_INTEGER;
+    scan->lexeme = decimal;
+    scan->length = snprintf( decimal, 16, "%d", x );
+    return 0;
   }
 
   // If the character is a quote, it's a string.
   if ( *self->current == self->quote )
   {
     skip( self );
-    
-    luaL_Buffer string;
-    luaL_buffinit( L, &string );
+    size_t length = 0;
 
-    // Get anything until another quote.
+    // Get anything until another quote, copying the runs between quotes at once.
     for ( ;; )
     {
-      if ( *self->current == self->quote )
-      {
-        if ( self->current[ 1 ] == self->quote )
-        {
-          luaL_addchar( &string, self->quote );
-          skip( self );
-        }
-        else
-        {
-          break;
-        }
-      }
-      else
+      const char* quote = find_either( self->current, self->end, self->quote, self->quote, NULL );
+      size_t run = quote - self->current;
+      
+      if ( reserve( self, length + run + 1 ) == NULL )
       {
-        luaL_addchar( &string, *self->current );
+        return scan_error( scan, "Out of memory", 0 );
       }
       
-      skip( self );
-    }
-    
-#if 0
-    if ( !is_eos( *self->current ) && *self->current != self->quote )
-    {
-      do
+      memcpy( self->scratch + length, self->current, run );
+      length += run;
+      self->current = quote;
+      
+      if ( quote == self->end || quote[ 1 ] != self->quote )
       {
-        /*
-        if ( *self->current == '\\' )
-        {
-          int k = get_escape_char( self );
-          
-          if ( k == -1 )
-          {
-            char string[ 3 ] = { '\\', *self->current, 0 };
-            return raise_error( L, self, "Invalid escape sequence: %s", string );
-          }
-          
-          luaL_addchar( &string, k );
-        }
-        else
-        {
-          if ( *self->current >= 0 && *self->current <= 31 )
-          {
-            const char hex[] = "0123456789abcdef";
-            char string[ 3 ] = { hex[ ( *self->current >> 4 ) & 15 ], hex[ *self->current & 15 ], 0 };
-            return raise_error( L, self, "Invalid character in string: 0x%s", string );
-          }
-          
-          luaL_addchar( &string, *self->current );
-          skip( self );
-        }
-        */
-        
-        if ( *self->current == '\'' && self->current[ 1 ] == '\'' )
-        {
-          luaL_addchar( &string, '\'' );
-          skip( self );
-        }
-        else
-        {
-          luaL_addchar( &string, *self->current );
-        }
-        
-        skip( self );
+        break;
       }
-      while ( !is_eos( *self->current ) && *self->current != self->quote );
+      
+      // Two quotes in a row are a quote inside the string.
+      self->scratch[ length++ ] = self->quote;
+      self->current += 2;
     }
-#endif
 
     if ( *self->current != self->quote )
     {
-      return raise_error( L, self, "Unterminated literal", NULL );
+      return scan_error( scan, "Unterminated literal", 0 );
     }
     
     skip( self );
 
-    luaL_pushresult( &string );
-    lua_pushliteral( L, "string" );
-    return push_result( L, self, -2, -1 );
+    scan->kind = KIND_STRING;
+    scan->lexeme = self->scratch;
+    scan->length = length;
+    return 0;
   }
   
   // If the character is #, it's a directive.
   if ( *self->current == '#' )
   {
-    luaL_Buffer directive;
-    luaL_buffinit( L, &directive );
-    
     // Directives end at the end of the line.
     while ( *self->current != '\n' && *self->current != 0 )
     {
-      luaL_addchar( &directive, *self->current );
       skip( self );
     }
     
-    luaL_pushresult( &directive );
-    const char* aux = lua_tostring( L, -1 );
+    scan->kind = KIND_DIRECTIVE;
+    scan->lexeme = start;
+    scan->length = self->current - start;
     
-    if ( !strncmp( aux, "#line ", 6 ) )
+    if ( scan->length > 6 && !strncmp( start, "#line ", 6 ) )
     {
       // Process a #line directive from the preprocessor so we keep track of
       // the current file name and line.
-      aux += 6;
+      const char* aux = start + 6;
       
       // skip spaces.
       while ( is_space( *aux ) )
@@ -633,7 +1158,7 @@ int next_token( lua_State* L )
       // Get the file name.
       const char* source_name = aux;
 
-      while ( *aux != '"' )
+      while ( aux < self->current && *aux != '"' )
       {
         aux++;
       }
@@ -641,11 +1166,11 @@ int next_token( lua_State* L )
       luaL_unref( L, LUA_REGISTRYINDEX, self->source_name_ref );
       lua_pushlstring( L, source_name, aux - source_name );
       self->source_name_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+      self->source_id = 0;
     }
 
     // Pass unprocessed directives to the parser.
-    lua_pushliteral( L, "directive" );
-    return push_result( L, self, -2, -1 );
+    return 0;
   }
   
   // If the character is a ', it's a character
@@ -657,58 +1182,82 @@ int next_token( lua_State* L )
     if ( k != -1 && *self->current == '\'' )
     {
       skip( self );
-      char string = k;
-      lua_pushlstring( L, &string, 1 );
-      lua_pushliteral( L, "character" );
-      return push_result( L, self, -2, -1 );
+      char* character = reserve( self, 1 );
+      
+      if ( character == NULL )
+      {
+        return scan_error( scan, "Out of memory", 0 );
+      }
+      
+      *character = k;
+      scan->kind = KIND_CHARACTER;
+      scan->lexeme = character;
+      scan->length = 1;
+      return 0;
     }
     
-    return raise_error( L, self, "Invalid character constant", NULL );
+    return scan_error( scan, "Invalid character constant", 0 );
   }
 
   // Otherwise the token is a symbol.
   {
     size_t length;
+    int kind;
     
-    switch ( parse_symbol( L, self, &length ) )
+    switch ( parse_symbol( self, &length, &kind ) )
     {
     case TOOBIG:
-      return raise_error( L, self, "Symbol too big", NULL );
+      return scan_error( scan, "Symbol too big", 0 );
       
     case INVALIDCHAR:
-      {
-        char string[ 2 ] = { *self->current, 0 };
-        return raise_error( L, self, "Invalid character in input: '%s'", string );
-      }
+      return scan_error( scan, "Invalid character in input: '%s'", *self->current );
       
     case TOKEN:
-      lua_pushlstring( L, start, length );
-      return push_result( L, self, -1, -1 );
+      scan->kind = kind;
+      scan->lexeme = start;
+      scan->length = length;
+      return 0;
       
     case LINECOMMENTSTART:
-      while ( *self->current != '\n' && *self->current != 0 )
-      {
-        skip( self );
-      }
+      self->current = find_either( self->current, self->end, '\n', 0, NULL );
       
-      lua_pushlstring( L, start, self->current - start );
-      lua_pushliteral( L, "comment" );
-      return push_result( L, self, -2, -1 );
+      scan->kind = KIND_COMMENT;
+      scan->lexeme = start;
+      scan->length = self->current - start;
+      return 0;
       
     case BLOCKCOMMENTSTART:
       {
         int linenumber = self->line_number;
         
+        if ( self->comment_end != 0 )
+        {
+          // No symbol can hide the terminator, just look for it.
+          self->current = find_either( self->current, self->end, self->comment_end, 0, &self->line_number );
+          
+          if ( *self->current == 0 )
+          {
+            self->line_number = linenumber;
+            return scan_error( scan, "Unterminated comment", 0 );
+          }
+          
+          self->current++;
+          scan->kind = KIND_COMMENT;
+          scan->lexeme = start;
+          scan->length = self->current - start;
+          return 0;
+        }
+        
         for ( ;; )
         {
-          int type = parse_symbol( L, self, &length );
+          int type = parse_symbol( self, &length, &kind );
           
           if ( type == INVALIDCHAR )
           {
             if ( *self->current == 0 )
             {
               self->line_number = linenumber;
-              return raise_error( L, self, "Unterminated comment", NULL );
+              return scan_error( scan, "Unterminated comment", 0 );
             }
             
             if ( *self->current == '\n' )
@@ -721,92 +1270,963 @@ int next_token( lua_State* L )
           
           if ( type == BLOCKCOMMENTEND )
           {
-            lua_pushlstring( L, start, self->current - start );
-            lua_pushliteral( L, "comment" );
-            return push_result( L, self, -2, -1 );
+            scan->kind = KIND_COMMENT;
+            scan->lexeme = start;
+            scan->length = self->current - start;
+            return 0;
           }
         }
       }
     }
   }
   
-  return 0; /* never reached */
+  return scan_error( scan, "Invalid character in input: '%s'", *self->current );
 }
 
-static int lexer_gc( lua_State* L )
+static int next_token( lua_State* L )
 {
-  lexer_t* self = (lexer_t*)lua_touserdata( L, 1 );
+  lexer_t* self = check_lexer( L, 1 );
   
-  luaL_unref( L, LUA_REGISTRYINDEX, self->source_ref );
-  luaL_unref( L, LUA_REGISTRYINDEX, self->source_name_ref );
-  luaL_unref( L, LUA_REGISTRYINDEX, self->keywords_ref );
+  if ( lua_isnoneornil( L, 2 ) )
+  {
+    lua_settop( L, 1 );
+    lua_newtable( L );
+  }
+  else
+  {
+    luaL_checktype( L, 2, LUA_TTABLE );
+    lua_settop( L, 2 );
+  }
   
-  return 0;
+  scan_t scan;
+  
+  if ( scan_token( L, self, &scan ) != 0 )
+  {
+    return raise_error( L, self, scan.error, scan.extra );
+  }
+  
+  lua_pushlstring( L, scan.lexeme, scan.length );
+  lua_rawgeti( L, lua_upvalueindex( 1 ), scan.kind );
+  return push_result( L, self, -2, -1 );
 }
 
-static int create_lexer( lua_State* L )
+/* Token streams: all the tokens of one or more sources in a flat array. */
+
+static stream_t* check_stream( lua_State* L, int index )
 {
-  static const luaL_Reg methods[] =
-  {
-    { "next", next_token },
-    { "__gc", lexer_gc },
-    { NULL, NULL }
-  };
-  
-  luaL_checktype( L, 1, LUA_TSTRING );  /* source code */
-  luaL_checktype( L, 2, LUA_TSTRING );  /* source file name */
-  luaL_checktype( L, 3, LUA_TTABLE );   /* keywords table */
-  luaL_checktype( L, 4, LUA_TSTRING );  /* string quote */
-  luaL_checktype( L, 5, LUA_TBOOLEAN ); /* case sensitive */
-  luaL_checktype( L, 6, LUA_TBOOLEAN ); /* octal constants */
+  return (stream_t*)luaL_checkudata( L, index, STREAM_NAME );
+}
 
-  lexer_t* self = (lexer_t*)lua_newuserdata( L, sizeof( lexer_t ) );
-  
-  if ( luaL_newmetatable( L, MY_NAME ) != 0 )
+static int push_token( stream_t* self, int kind, int source, int line, int pos, const char* lexeme, size_t length )
+{
+  if ( self->count == self->reserved )
   {
-    lua_pushvalue( L, -1 );
-    lua_setfield( L, -2, "__index" );
-    /*luaL_setfuncs( L, methods, 0 );*/
-    luaL_setfuncs( L, methods, 0 );
+    size_t reserved = self->reserved ? self->reserved * 2 : 1024;
+    token_t* tokens = (token_t*)realloc( self->tokens, reserved * sizeof( token_t ) );
+    
+    if ( tokens == NULL )
+    {
+      return -1;
+    }
+    
+    self->tokens = tokens;
+    self->reserved = reserved;
   }
   
-  lua_setmetatable( L, -2 );
+  if ( self->text_size + length > self->text_reserved )
+  {
+    size_t reserved = self->text_reserved ? self->text_reserved : 16384;
+    
+    while ( reserved < self->text_size + length )
+    {
+      reserved *= 2;
+    }
+    
+    char* text = (char*)realloc( self->text, reserved );
+    
+    if ( text == NULL )
+    {
+      return -1;
+    }
+    
+    self->text = text;
+    self->text_reserved = reserved;
+  }
   
-  size_t length;
-  lua_pushvalue( L, 1 );
-  self->begin = lua_tolstring( L, -1, &length );
-  self->source_ref = luaL_ref( L, LUA_REGISTRYINDEX );
-  self->current = self->begin;
-  self->end = self->begin + length;
+  token_t* token = self->tokens + self->count++;
+  token->kind = kind;
+  token->source = source;
+  token->line = line;
+  token->pos = pos;
+  token->offset = (uint32_t)self->text_size;
+  token->length = (uint32_t)length;
+  token->atom = 0;
+  
+  memcpy( self->text + self->text_size, lexeme, length );
+  self->text_size += length;
+  return 0;
+}
+
+static int source_id( lua_State* L, lexer_t* self )
+{
+  if ( self->source_id == 0 )
+  {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, self->source_name_ref );
+    self->source_id = intern( L, lua_upvalueindex( 2 ) );
+  }
+  
+  return self->source_id;
+}
+
+static int tokenize( lua_State* L )
+{
+  lexer_t* self = check_lexer( L, 1 );
+  stream_t* stream = check_stream( L, 2 );
+  uint8_t stops[ MAX_KINDS / 8 ];
+  
+  memset( stops, 0, sizeof( stops ) );
+  
+  if ( !lua_isnoneornil( L, 3 ) )
+  {
+    /* Tokens with these kinds are returned to the caller instead of being added to the stream. */
+    luaL_checktype( L, 3, LUA_TTABLE );
+    lua_pushnil( L );
+    
+    while ( lua_next( L, 3 ) != 0 )
+    {
+      lua_pop( L, 1 );
+      
+      if ( lua_type( L, -1 ) == LUA_TSTRING )
+      {
+        lua_pushvalue( L, -1 );
+        int kind = intern( L, lua_upvalueindex( 1 ) );
+        
+        if ( kind < MAX_KINDS )
+        {
+          stops[ kind / 8 ] |= 1 << ( kind % 8 );
+        }
+      }
+    }
+  }
+  
+  for ( ;; )
+  {
+    scan_t scan;
+    
+    if ( scan_token( L, self, &scan ) != 0 )
+    {
+      return raise_error( L, self, scan.error, scan.extra );
+    }
+    
+    int kind = scan.kind;
+    int pos = (int)( self->start - self->begin + 1 );
+    
+    if ( kind < MAX_KINDS && ( stops[ kind / 8 ] & ( 1 << ( kind % 8 ) ) ) != 0 )
+    {
+      lua_rawgeti( L, lua_upvalueindex( 1 ), kind );
+      lua_pushlstring( L, scan.lexeme, scan.length );
+      lua_rawgeti( L, LUA_REGISTRYINDEX, self->source_name_ref );
+      lua_pushinteger( L, self->line_number );
+      lua_pushinteger( L, pos );
+      return 5;
+    }
+    
+    if ( push_token( stream, kind, source_id( L, self ), self->line_number, pos, scan.lexeme, scan.length ) != 0 )
+    {
+      return luaL_error( L, "out of memory" );
+    }
+    
+    if ( kind == KIND_EOF )
+    {
+      lua_rawgeti( L, lua_upvalueindex( 1 ), kind );
+      return 1;
+    }
+  }
+}
+
+static token_t* get_token( lua_State* L, stream_t* self )
+{
+  lua_Integer index = luaL_checkinteger( L, 2 );
+  
+  if ( index < 1 || index > (lua_Integer)self->count )
+  {
+    return NULL;
+  }
+  
+  return self->tokens + index - 1;
+}
+
+const char* lexer_lexeme( lua_State* L, int arg, lua_Integer index, size_t* length )
+{
+  stream_t* self = check_stream( L, arg );
+  
+  if ( index < 1 || index > (lua_Integer)self->count )
+  {
+    return NULL;
+  }
+  
+  token_t* token = self->tokens + index - 1;
+  *length = token->length;
+  return self->text + token->offset;
+}
+
+static int stream_token( lua_State* L )
+{
+  token_t* token = get_token( L, check_stream( L, 1 ) );
+  
+  if ( token == NULL )
+  {
+    return 0;
+  }
+  
+  lua_rawgeti( L, lua_upvalueindex( 1 ), token->kind );
+  return 1;
+}
+
+static int stream_lexeme( lua_State* L )
+{
+  stream_t* self = check_stream( L, 1 );
+  token_t* token = get_token( L, self );
+  
+  if ( token == NULL )
+  {
+    return 0;
+  }
+  
+  lua_pushlstring( L, self->text + token->offset, token->length );
+  return 1;
+}
+
+static int hex_value( char k )
+{
+  if ( k >= '0' && k <= '9' )
+  {
+    return k - '0';
+  }
+  
+  k |= 0x20;
+  return k >= 'a' && k <= 'f' ? k - 'a' + 10 : -1;
+}
+
+long lexer_hex_decode( const char* hex, size_t length, unsigned char* out )
+{
+  const char* end = hex + length;
+  unsigned char* aux = out;
+  
+  for ( ;; )
+  {
+    while ( hex < end && is_space( *hex ) )
+    {
+      hex++;
+    }
+    
+    if ( hex == end )
+    {
+      break;
+    }
+    
+    int high = hex_value( *hex++ );
+    int low = hex < end ? hex_value( *hex++ ) : -1;
+    
+    if ( ( high | low ) < 0 )
+    {
+      return -1;
+    }
+    
+    *aux++ = high << 4 | low;
+  }
+  
+  return (long)( aux - out );
+}
+
+/* Binary properties in .dfm files start with the class name of the object
+   that wrote them as a short string, i.e. \x07TBitmap. */
+static void push_class_name( lua_State* L, const unsigned char* data, size_t size )
+{
+  size_t length = size != 0 ? data[ 0 ] : 0;
+  size_t i;
+  
+  for ( i = 1; i <= length && i < size && is_alnum( data[ i ] ); i++ )
+    /* nothing */;
+  
+  if ( length != 0 && i == length + 1 )
+  {
+    lua_pushlstring( L, (const char*)data + 1, length );
+  }
+  else
+  {
+    lua_pushnil( L );
+  }
+}
+
+/* Decodes the hexadecimal data in a { ... } token. Returns the data, or its
+   size after writing it to path when given, and the class name found in the
+   data or nil. */
+static int stream_hexdecode( lua_State* L )
+{
+  stream_t* self = check_stream( L, 1 );
+  token_t* token = get_token( L, self );
+  const char* path = luaL_optstring( L, 3, NULL );
+  
+  if ( token == NULL )
+  {
+    return 0;
+  }
+  
+  const char* hex = self->text + token->offset;
+  size_t length = token->length;
+  
+  if ( length != 0 && hex[ 0 ] == '{' )
+  {
+    hex++, length--;
+  }
+  
+  if ( length != 0 && hex[ length - 1 ] == '}' )
+  {
+    length--;
+  }
+  
+  unsigned char* data;
+  luaL_Buffer buffer;
+  
+  if ( path == NULL )
+  {
+    data = (unsigned char*)luaL_buffinitsize( L, &buffer, length / 2 + 1 );
+  }
+  else if ( ( data = (unsigned char*)malloc( length / 2 + 1 ) ) == NULL )
+  {
+    return luaL_error( L, "out of memory" );
+  }
+  
+  long size = lexer_hex_decode( hex, length, data );
+  
+  if ( size < 0 )
+  {
+    if ( path != NULL )
+    {
+      free( data );
+    }
+    
+    lua_pushnil( L );
+    lua_pushliteral( L, "invalid hexadecimal data" );
+    return 2;
+  }
+  
+  if ( path == NULL )
+  {
+    luaL_pushresultsize( &buffer, (size_t)size );
+    push_class_name( L, (const unsigned char*)lua_tostring( L, -1 ), (size_t)size );
+    return 2;
+  }
+  
+  FILE* file = fopen( path, "wb" );
+  int ok = file != NULL && fwrite( data, 1, (size_t)size, file ) == (size_t)size;
+  
+  if ( file != NULL && fclose( file ) != 0 )
+  {
+    ok = 0;
+  }
+  
+  if ( !ok )
+  {
+    free( data );
+    lua_pushnil( L );
+    lua_pushfstring( L, "Error writing to %s", path );
+    return 2;
+  }
+  
+  lua_pushinteger( L, size );
+  push_class_name( L, data, (size_t)size );
+  free( data );
+  return 2;
+}
+
+static int stream_lower( lua_State* L )
+{
+  stream_t* self = check_stream( L, 1 );
+  token_t* token = get_token( L, self );
+  
+  if ( token == NULL )
+  {
+    return 0;
+  }
+  
+  /* Lowercased lexemes are interned in the user value, which maps them to
+     their ids and back, so each token is lowercased only once. */
+  lua_getuservalue( L, 1 );
+  
+  if ( token->atom != 0 )
+  {
+    lua_rawgeti( L, -1, token->atom );
+    return 1;
+  }
+  
+  const char* lexeme = self->text + token->offset;
+  char buffer[ 256 ];
+  uint32_t i;
+  
+  if ( token->length <= sizeof( buffer ) )
+  {
+    for ( i = 0; i < token->length; i++ )
+    {
+      buffer[ i ] = tolower( lexeme[ i ] );
+    }
+    
+    lua_pushlstring( L, buffer, token->length );
+  }
+  else
+  {
+    luaL_Buffer lower;
+    luaL_buffinit( L, &lower );
+    
+    for ( i = 0; i < token->length; i++ )
+    {
+      luaL_addchar( &lower, tolower( lexeme[ i ] ) );
+    }
+    
+    luaL_pushresult( &lower );
+  }
+  
+  lua_pushvalue( L, -1 );
+  
+  if ( lua_rawget( L, -3 ) == LUA_TNUMBER )
+  {
+    token->atom = (uint32_t)lua_tointeger( L, -1 );
+    lua_pop( L, 1 );
+    return 1;
+  }
+  
+  lua_pop( L, 1 );
+  token->atom = ++self->atoms;
+  lua_pushvalue( L, -1 );
+  lua_pushinteger( L, token->atom );
+  lua_rawset( L, -4 );
+  lua_pushvalue( L, -1 );
+  lua_rawseti( L, -3, token->atom );
+  return 1;
+}
+
+static int stream_source( lua_State* L )
+{
+  token_t* token = get_token( L, check_stream( L, 1 ) );
+  
+  if ( token == NULL )
+  {
+    return 0;
+  }
+  
+  lua_rawgeti( L, lua_upvalueindex( 2 ), token->source );
+  return 1;
+}
+
+static int stream_line( lua_State* L )
+{
+  token_t* token = get_token( L, check_stream( L, 1 ) );
+  
+  if ( token == NULL )
+  {
+    return 0;
+  }
+  
+  lua_pushinteger( L, token->line );
+  return 1;
+}
+
+static int stream_pos( lua_State* L )
+{
+  token_t* token = get_token( L, check_stream( L, 1 ) );
+  
+  if ( token == NULL )
+  {
+    return 0;
+  }
+  
+  lua_pushinteger( L, token->pos );
+  return 1;
+}
+
+static int stream_push( lua_State* L )
+{
+  stream_t* self = check_stream( L, 1 );
+  
+  size_t length;
+  luaL_checktype( L, 2, LUA_TSTRING );                 /* token */
+  const char* lexeme = luaL_checklstring( L, 3, &length ); /* lexeme */
+  luaL_checktype( L, 4, LUA_TSTRING );                 /* source file name */
+  int line = (int)luaL_checkinteger( L, 5 );
+  int pos = (int)luaL_checkinteger( L, 6 );
+  
+  lua_pushvalue( L, 2 );
+  int kind = intern( L, lua_upvalueindex( 1 ) );
+  lua_pushvalue( L, 4 );
+  int source = intern( L, lua_upvalueindex( 2 ) );
+  
+  if ( push_token( self, kind, source, line, pos, lexeme, length ) != 0 )
+  {
+    return luaL_error( L, "out of memory" );
+  }
+  
+  return 0;
+}
+
+static int stream_append( lua_State* L )
+{
+  stream_t* self = check_stream( L, 1 );
+  stream_t* other = check_stream( L, 2 );
+  size_t i;
+  
+  for ( i = 0; i < other->count; i++ )
+  {
+    token_t* token = other->tokens + i;
+    
+    if ( push_token( self, token->kind, token->source, token->line, token->pos, other->text + token->offset, token->length ) != 0 )
+    {
+      return luaL_error( L, "out of memory" );
+    }
+  }
+  
+  return 0;
+}
+
+static int stream_len( lua_State* L )
+{
+  stream_t* self = check_stream( L, 1 );
+  lua_pushinteger( L, (lua_Integer)self->count );
+  return 1;
+}
+
+static int stream_gc( lua_State* L )
+{
+  stream_t* self = (stream_t*)lua_touserdata( L, 1 );
+  
+  free( self->tokens );
+  free( self->text );
+  
+  return 0;
+}
+
+static int create_stream( lua_State* L )
+{
+  stream_t* self = (stream_t*)lua_newuserdata( L, sizeof( stream_t ) );
+  memset( self, 0, sizeof( *self ) );
+  luaL_setmetatable( L, STREAM_NAME );
+  lua_newtable( L );
+  lua_setuservalue( L, -2 );
+  return 1;
+}
+
+static void push_names( lua_State* L )
+{
+  /* Pushes the kinds and then the source names, see luaopen_lexer. */
+  lua_getfield( L, LUA_REGISTRYINDEX, KINDS_NAME );
+  lua_getfield( L, LUA_REGISTRYINDEX, SOURCES_NAME );
+}
+
+static int map_name( lua_State* to, int to_table, lua_State* from, int from_table, uint32_t id )
+{
+  size_t length;
+  lua_rawgeti( from, from_table, id );
+  const char* name = lua_tolstring( from, -1, &length );
+  lua_pushlstring( to, name, length );
+  lua_pop( from, 1 );
+  return intern( to, to_table );
+}
+
+int lexer_copy_stream( lua_State* to, lua_State* from, int arg )
+{
+  stream_t* other = (stream_t*)luaL_testudata( from, arg, STREAM_NAME );
+  
+  if ( other == NULL )
+  {
+    return -1;
+  }
+  
+  push_names( from );
+  push_names( to );
+  create_stream( to );
+  stream_t* self = (stream_t*)lua_touserdata( to, -1 );
+  
+  int from_kinds = lua_absindex( from, -2 ), from_sources = lua_absindex( from, -1 );
+  int to_kinds = lua_absindex( to, -3 ), to_sources = lua_absindex( to, -2 );
+  
+  /* Kinds and sources have different ids in each state, a stream has few
+     distinct ones. */
+  int kinds[ MAX_KINDS ];
+  uint32_t source = 0;
+  int mapped = 0;
+  size_t i;
+  int res = 0;
+  
+  memset( kinds, 0, sizeof( kinds ) );
+  
+  for ( i = 0; res == 0 && i < other->count; i++ )
+  {
+    token_t* token = other->tokens + i;
+    int kind;
+    
+    if ( token->kind >= MAX_KINDS )
+    {
+      kind = map_name( to, to_kinds, from, from_kinds, token->kind );
+    }
+    else if ( ( kind = kinds[ token->kind ] ) == 0 )
+    {
+      kind = kinds[ token->kind ] = map_name( to, to_kinds, from, from_kinds, token->kind );
+    }
+    
+    if ( token->source != source )
+    {
+      source = token->source;
+      mapped = map_name( to, to_sources, from, from_sources, source );
+    }
+    
+    res = push_token( self, kind, mapped, token->line, token->pos, other->text + token->offset, token->length );
+  }
+  
+  lua_replace( to, -3 );
+  lua_pop( to, 1 );
+  lua_pop( from, 2 );
+  return res;
+}
+
+static int lexer_gc( lua_State* L )
+{
+  lexer_t* self = (lexer_t*)lua_touserdata( L, 1 );
+  
+  luaL_unref( L, LUA_REGISTRYINDEX, self->source_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, self->source_name_ref );
+  free( self->scratch );
+  
+  if ( self->keywords != NULL )
+  {
+    uint32_t i;
+    
+    for ( i = 0; i <= self->keywords_mask; i++ )
+    {
+      free( self->keywords[ i ].key );
+    }
+    
+    free( self->keywords );
+  }
+  
+  free( self->nodes );
+  
+  if ( self->map != NULL )
+  {
+#ifdef _WIN32
+    UnmapViewOfFile( (LPCVOID)self->map );
+#else
+    munmap( (void*)self->map, self->map_size );
+#endif
+  }
+  
+  free( self->buffer );
+  return 0;
+}
+
+static void check_options( lua_State* L )
+{
+  luaL_checktype( L, 2, LUA_TSTRING );  /* source file name */
+  luaL_checktype( L, 3, LUA_TTABLE );   /* keywords table */
+  luaL_checktype( L, 4, LUA_TSTRING );  /* string quote */
+  luaL_checktype( L, 5, LUA_TBOOLEAN ); /* case sensitive */
+  luaL_checktype( L, 6, LUA_TBOOLEAN ); /* octal constants */
+}
+
+static lexer_t* new_lexer( lua_State* L )
+{
+  lexer_t* self = (lexer_t*)lua_newuserdata( L, sizeof( lexer_t ) );
+  memset( self, 0, sizeof( *self ) );
+  self->source_ref = LUA_NOREF;
+  self->source_name_ref = LUA_NOREF;
+  luaL_setmetatable( L, MY_NAME );
+  return self;
+}
+
+static int init_lexer( lua_State* L, lexer_t* self, const char* source, size_t length )
+{
+  /* source must be followed by a NUL, the scanner stops there. */
+  self->begin = self->current = source;
+  self->end = source + length;
   
   lua_pushvalue( L, 2 );
   self->source_name_ref = luaL_ref( L, LUA_REGISTRYINDEX );
   
   self->line_number = 1;
   
-  lua_pushvalue( L, 3 );
-  self->keywords_ref = luaL_ref( L, LUA_REGISTRYINDEX );
-  
   const char* quote = lua_tostring( L, 4 );
   self->quote = quote[ 0 ];
   
   self->case_sensitive = lua_toboolean( L, 5 ) != 0;
   self->octals = lua_toboolean( L, 6 ) != 0;
   
+  if ( compile_keywords( L, self, 3, lua_upvalueindex( 1 ) ) != 0 )
+  {
+    return luaL_error( L, "out of memory" );
+  }
+  
   return 1;
 }
 
+static int create_lexer( lua_State* L )
+{
+  luaL_checktype( L, 1, LUA_TSTRING );  /* source code */
+  check_options( L );
+
+  lexer_t* self = new_lexer( L );
+  
+  size_t length;
+  lua_pushvalue( L, 1 );
+  const char* source = lua_tolstring( L, -1, &length );
+  self->source_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  
+  return init_lexer( L, self, source, length );
+}
+
+static size_t page_size( void )
+{
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo( &info );
+  return info.dwPageSize;
+#else
+  long size = sysconf( _SC_PAGESIZE );
+  return size > 0 ? (size_t)size : 4096;
+#endif
+}
+
+/* Whether lexer.open maps files, see lexer_map_files. */
+static int map_files = 1;
+
+void lexer_map_files( int map )
+{
+  map_files = map;
+}
+
+static const char* map_file( lexer_t* self, const char* path, size_t* length )
+{
+  /* The bytes past the end of a file in its last mapped page are zeros, so a
+     mapping comes with the terminating NUL for free, except when the size is
+     a multiple of the page size. Those files, empty ones and anything that
+     can't be mapped are read instead. */
+#ifdef _WIN32
+  HANDLE file = CreateFileA( path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+  
+  if ( file == INVALID_HANDLE_VALUE )
+  {
+    return NULL;
+  }
+  
+  LARGE_INTEGER size;
+  const char* view = NULL;
+  
+  if ( GetFileSizeEx( file, &size ) && size.QuadPart != 0 && (uint64_t)size.QuadPart <= SIZE_MAX && size.QuadPart % page_size() != 0 )
+  {
+    HANDLE mapping = CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL );
+    
+    if ( mapping != NULL )
+    {
+      view = (const char*)MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+      CloseHandle( mapping );
+    }
+  }
+  
+  CloseHandle( file );
+  
+  if ( view != NULL )
+  {
+    self->map = view;
+    self->map_size = *length = (size_t)size.QuadPart;
+  }
+  
+  return view;
+#else
+  int fd = open( path, O_RDONLY );
+  
+  if ( fd < 0 )
+  {
+    return NULL;
+  }
+  
+  struct stat st;
+  void* map = MAP_FAILED;
+  
+  if ( fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) && st.st_size != 0 && (uint64_t)st.st_size <= SIZE_MAX && st.st_size % page_size() != 0 )
+  {
+    map = mmap( NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  }
+  
+  close( fd );
+  
+  if ( map == MAP_FAILED )
+  {
+    return NULL;
+  }
+  
+#ifdef MADV_SEQUENTIAL
+  madvise( map, (size_t)st.st_size, MADV_SEQUENTIAL );
+#endif
+  
+  self->map = (const char*)map;
+  self->map_size = *length = (size_t)st.st_size;
+  return self->map;
+#endif
+}
+
+static const char* read_file( lexer_t* self, const char* path, size_t* length )
+{
+  FILE* file = fopen( path, "rb" );
+  
+  if ( file == NULL )
+  {
+    return NULL;
+  }
+  
+  size_t size = 0, reserved = 65536;
+  char* buffer = (char*)malloc( reserved );
+  
+  while ( buffer != NULL )
+  {
+    size += fread( buffer + size, 1, reserved - size - 1, file );
+    
+    if ( size < reserved - 1 )
+    {
+      break;
+    }
+    
+    char* aux = (char*)realloc( buffer, reserved * 2 );
+    
+    if ( aux == NULL )
+    {
+      free( buffer );
+      errno = ENOMEM;
+    }
+    
+    buffer = aux;
+    reserved *= 2;
+  }
+  
+  if ( buffer != NULL && ferror( file ) )
+  {
+    free( buffer );
+    buffer = NULL;
+    errno = EIO;
+  }
+  
+  fclose( file );
+  
+  if ( buffer != NULL )
+  {
+    buffer[ size ] = 0;
+    self->buffer = buffer;
+    *length = size;
+  }
+  
+  return buffer;
+}
+
+static int open_lexer( lua_State* L )
+{
+  const char* path = luaL_checkstring( L, 1 );
+  check_options( L );
+  
+  lexer_t* self = new_lexer( L );
+  
+  size_t length;
+  const char* source = map_files ? map_file( self, path, &length ) : NULL;
+  
+  if ( source == NULL && ( source = read_file( self, path, &length ) ) == NULL )
+  {
+    int error = errno;
+    lua_pushnil( L );
+    lua_pushfstring( L, "%s: %s", path, strerror( error ) );
+    return 2;
+  }
+  
+  return init_lexer( L, self, source, length );
+}
+
 LUALIB_API int luaopen_lexer( lua_State* L )
 {
   static const luaL_Reg statics[] =
   {
     { "new", create_lexer },
+    { "open", open_lexer },
+    { "stream", create_stream },
+    { NULL, NULL }
+  };
+  
+  static const luaL_Reg methods[] =
+  {
+    { "next", next_token },
+    { "tokenize", tokenize },
+    { "__gc", lexer_gc },
+    { NULL, NULL }
+  };
+  
+  static const luaL_Reg stream_methods[] =
+  {
+    { "token", stream_token },
+    { "lexeme", stream_lexeme },
+    { "lower", stream_lower },
+    { "hexdecode", stream_hexdecode },
+    { "source", stream_source },
+    { "line", stream_line },
+    { "pos", stream_pos },
+    { "push", stream_push },
+    { "append", stream_append },
+    { "__len", stream_len },
+    { "__gc", stream_gc },
     { NULL, NULL }
   };
+  
+  static const char* kinds[] =
+  {
+    "eof", "id", "integer", "fp", "string", "character", "directive", "comment", NULL
+  };
+  
+  /* Token kinds and source file names are shared by all lexers and streams,
+     tokens only store their ids. The builtin kinds come first so their ids
+     match the KIND_ constants. */
+  lua_newtable( L );
+  int i;
+  
+  for ( i = 0; kinds[ i ] != NULL; i++ )
+  {
+    lua_pushstring( L, kinds[ i ] );
+    intern( L, lua_absindex( L, -2 ) );
+  }
+  
+  lua_newtable( L );
+  int sources = lua_gettop( L );
+  
+  /* Also in the registry for lexer_copy_stream. */
+  lua_pushvalue( L, sources - 1 );
+  lua_setfield( L, LUA_REGISTRYINDEX, KINDS_NAME );
+  lua_pushvalue( L, sources );
+  lua_setfield( L, LUA_REGISTRYINDEX, SOURCES_NAME );
+  
+  luaL_newmetatable( L, MY_NAME );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -2, "__index" );
+  lua_pushvalue( L, sources - 1 );
+  lua_pushvalue( L, sources );
+  luaL_setfuncs( L, methods, 2 );
+  lua_pop( L, 1 );
+  
+  luaL_newmetatable( L, STREAM_NAME );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -2, "__index" );
+  lua_pushvalue( L, sources - 1 );
+  lua_pushvalue( L, sources );
+  luaL_setfuncs( L, stream_methods, 2 );
+  lua_pop( L, 1 );
 
-  /*luaL_newlib( L, statics );*/
-  lua_createtable( L, 0, sizeof( statics ) / sizeof( statics[ 0 ] ) - 1 );
-  luaL_newlib( L, statics );
+  luaL_newlibtable( L, statics );
+  lua_pushvalue( L, sources - 1 );
+  lua_pushvalue( L, sources );
+  luaL_setfuncs( L, statics, 2 );
+  lua_replace( L, sources - 1 );
+  lua_settop( L, sources - 1 );
   
   lua_pushinteger( L, 1 );
   lua_setfield( L, -2, "token" );
@@ -3,6 +3,29 @@
 
 #include <lua.h>
 
+#include <stddef.h>
+
 LUALIB_API int luaopen_lexer( lua_State* L );
 
+/* Returns the lexeme of the token at index in the stream at stack position
+   arg, or NULL if index is out of range. Valid while the stream is alive and
+   no tokens are added to it. */
+const char* lexer_lexeme( lua_State* L, int arg, lua_Integer index, size_t* length );
+
+/* Decodes hexadecimal digits, ignoring blanks, into out which must have room
+   for half of length bytes. Returns the number of bytes decoded, or -1 if
+   there's an invalid character or an odd number of digits. */
+long lexer_hex_decode( const char* hex, size_t length, unsigned char* out );
+
+/* Pushes onto to a copy of the stream at stack position arg in from, another
+   state. Returns -1 if arg isn't a stream or there's not enough memory, in
+   which case the copy has only part of the tokens. */
+int lexer_copy_stream( lua_State* to, lua_State* from, int arg );
+
+/* Whether lexer.open maps the files it scans, the default, or reads them into
+   memory. A mapped file that's truncated while it's scanned raises SIGBUS, so
+   processes that scan files other programs may be writing shouldn't map them.
+   Must be set before any states are running. */
+void lexer_map_files( int map );
+
 #endif /* NSPP_LEXER_H */
@@ -0,0 +1,147 @@
+-- Syntax trees for the statements of procedures, functions and initialization
+-- sections, built by the parser and then optimized and emitted as separate
+-- passes.
+--
+-- The nodes of a tree are kept in flat arrays instead of a table each: node n
+-- has the kind kind[ n ] and up to five operands a[ n ] to e[ n ], which are
+-- generated code, other nodes, numbers or false when absent. Lists of nodes
+-- are runs in the items array, given to the node that owns them by the index
+-- of the first item and the number of items.
+--
+-- Members of the used units and of self that may be hoisted are member nodes
+-- with their code in a. The code that uses them refers to the node as \1n\2,
+-- so hoisting only changes a and resolve writes it everywhere.
+
+local M = class.new()
+
+-- The size of an array slot, used to report the memory taken by the nodes.
+local slotSize = 16
+
+-- Lua keeps the array part of a table in a power of two slots.
+local function capacity( count )
+  local size = 1
+  
+  while size < count do
+    size = size * 2
+  end
+  
+  return count ~= 0 and size or 0
+end
+
+function M:new()
+  self.kind = {}
+  self.a = {}
+  self.b = {}
+  self.c = {}
+  self.d = {}
+  self.e = {}
+  self.items = {}
+  self.count = 0
+end
+
+function M:node( kind, a, b, c, d, e )
+  local n = self.count + 1
+  self.count = n
+  
+  self.kind[ n ] = kind
+  self.a[ n ] = a or false
+  self.b[ n ] = b or false
+  self.c[ n ] = c or false
+  self.d[ n ] = d or false
+  self.e[ n ] = e or false
+  return n
+end
+
+-- Appends values to the items, returns the index of the first one and how many
+-- there are.
+function M:list( values )
+  local items = self.items
+  local first = #items + 1
+  
+  for i = 1, #values do
+    items[ first + i - 1 ] = values[ i ]
+  end
+  
+  return first, #values
+end
+
+-- Calls func for each node in the subtree of n, parents before children.
+function M:walk( n, func )
+  func( n )
+  
+  local kind = self.kind[ n ]
+  local a, b, c, d, e = self.a[ n ], self.b[ n ], self.c[ n ], self.d[ n ], self.e[ n ]
+  
+  if kind == 'block' or kind == 'arm' then
+    for i = a, a + b - 1 do
+      self:walk( self.items[ i ], func )
+    end
+    
+    if kind == 'arm' then
+      self:walk( c, func )
+    end
+  elseif kind == 'if' then
+    self:walk( b, func )
+    
+    if c then
+      self:walk( c, func )
+    end
+  elseif kind == 'case' then
+    for i = b, b + c - 1 do
+      self:walk( self.items[ i ], func )
+    end
+    
+    if d then
+      self:walk( d, func )
+    end
+  elseif kind == 'for' then
+    self:walk( e, func )
+  elseif kind == 'while' or kind == 'repeat' then
+    self:walk( b, func )
+  end
+end
+
+-- The code assigned by node n, passed to func once per assigned variable.
+function M:assigned( n, func )
+  local kind = self.kind[ n ]
+  
+  if kind == 'assign' or kind == 'inc' or kind == 'for' then
+    func( self.a[ n ] )
+  elseif kind == 'decode' then
+    local first = self.c[ n ]
+    
+    for i = first, first + self.d[ n ] - 1 do
+      func( self.items[ i ] )
+    end
+  end
+end
+
+-- A new member node with the code path, returns the code that refers to it.
+function M:member( path )
+  return '\1' .. self:node( 'member', path ) .. '\2'
+end
+
+-- code with the members it refers to replaced by their code.
+function M:code( code )
+  return ( code:gsub( '\1(%d+)\2', function( n ) return self.a[ tonumber( n ) ] end ) )
+end
+
+-- Replaces the members referred to in the operands and items with their code.
+function M:resolve()
+  for _, operands in ipairs{ self.a, self.b, self.c, self.d, self.e, self.items } do
+    for i = 1, #operands do
+      local value = operands[ i ]
+      
+      if type( value ) == 'string' and value:find( '\1', 1, true ) then
+        operands[ i ] = self:code( value )
+      end
+    end
+  end
+end
+
+-- The memory taken by the node arrays, in bytes, and the number of nodes.
+function M:memory()
+  return ( capacity( self.count ) * 6 + capacity( #self.items ) ) * slotSize, self.count
+end
+
+return M
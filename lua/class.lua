@@ -25,37 +25,51 @@ local M = {}
 local pairs = pairs
 local type = type
 local sub = string.sub
-local unpack = table.unpack
 local setmetatable = setmetatable
 local _G = _G
 
+-- classes created by M.new, mapped to the set of classes they descend from
+local ancestors = setmetatable( {}, { __mode = 'k' } )
+
+-- class names, given to M.new or found in _G the first time they're asked for,
+-- false when they weren't found
+local names = setmetatable( {}, { __mode = 'k' } )
+
+-- the metatables of the instances of the classes created by M.new, and the
+-- functions that create the fields given to M.lazy
+local metas = setmetatable( {}, { __mode = 'k' } )
+local lazies = setmetatable( {}, { __mode = 'k' } )
+
 function M.new( ... )
-  local arg = { ... }
+  local supers = { ... }
+  
+  -- an optional name comes before the super classes
+  local name
+  
+  if type( supers[ 1 ] ) == 'string' then
+    name = table.remove( supers, 1 )
+  end
+  
   -- create an empty class
   local new_class = {}
+  names[ new_class ] = name
   
-  -- copy all methods from the super classes
-  for index = 1, #arg do
-    for name, method in pairs( arg[ index ] ) do
-      if not new_class[ name ] then
-        new_class[ name ] = method
-      end
+  -- the class and everything it descends from, so instanceOf is a lookup
+  local set = { [ new_class ] = true }
+  ancestors[ new_class ] = set
+  
+  for index = 1, #supers do
+    local super = supers[ index ]
+    set[ super ] = true
+    
+    for klass in pairs( ancestors[ super ] or {} ) do
+      set[ klass ] = true
     end
   end
   
   -- insert an additional method to check the class of the instance
   new_class.instanceOf = function( self, klass )
-    if klass == new_class then
-      return true
-    end
-    
-    for index = 1, #arg do
-      if arg[ index ].instanceOf( self, klass ) then
-        return true
-      end
-    end
-    
-    return false
+    return klass == new_class or set[ klass ] == true
   end
   
   -- insert an additional method to clone the instance
@@ -92,8 +106,14 @@ function M.new( ... )
     return new_class
   end
   
-  -- insert an additional method to return the class name of an instance (only works if the class is accessible from the global space)
+  -- insert an additional method to return the class name of an instance (only works if the class was named or is accessible from the global space)
   new_class.getClassName = function()
+    local found = names[ new_class ]
+    
+    if found ~= nil then
+      return found or nil
+    end
+    
     local function find( space, name, visited )
       if visited[ space ] then
         return nil
@@ -118,13 +138,15 @@ function M.new( ... )
       return nil
     end
     
-    local found = find( _G, '_G', {} )
+    found = find( _G, '_G', {} )
     
+    -- remember a failed search too, it's as slow as a successful one
     if found then
-      return sub( found, 4, -1 )
+      found = sub( found, 4, -1 )
     end
     
-    return nil
+    names[ new_class ] = found or false
+    return found
   end
   
   -- serialize the instance into a string which can be used to get the instance back
@@ -207,6 +229,16 @@ function M.new( ... )
 
   -- the metatable of the instances
   local self_meta = { __index = new_class }
+  metas[ new_class ] = self_meta
+  
+  -- fields created on first read are inherited
+  for index = 1, #supers do
+    local fields = lazies[ supers[ index ] ]
+    
+    if fields then
+      M.lazy( new_class, fields )
+    end
+  end
   
   -- turn the self table into an instance of the class
   new_class.makeInstance = function( self )
@@ -215,26 +247,33 @@ function M.new( ... )
     return self
   end
 
-  -- create a __call metamethod that creates a new instance of the class
+  -- methods not found in the class are looked up in the super classes, in
+  -- the order they were given, instead of being copied into it
   local class_meta = {}
   
-  class_meta.__call = function( ... )
-    local arg = { ... }
-    
-    -- create an empty instance
-    local self = {}
-    new_class.makeInstance( self )
-    
-    -- the first argument is the class, shift left all other arguments
-    for i = 2, #arg do
-      arg[ i - 1 ] = arg[ i ]
+  if #supers == 1 then
+    class_meta.__index = supers[ 1 ]
+  elseif #supers > 1 then
+    class_meta.__index = function( _, key )
+      for index = 1, #supers do
+        local value = supers[ index ][ key ]
+        
+        if value ~= nil then
+          return value
+        end
+      end
     end
-    
-    arg[ #arg ] = nil
+  end
+  
+  -- create a __call metamethod that creates a new instance of the class
+  class_meta.__call = function( _, ... )
+    local self = setmetatable( {}, self_meta )
     
     -- call the new method to initialize the instance
-    if new_class.new then
-      new_class.new( self, unpack( arg ) )
+    local new = new_class.new
+    
+    if new then
+      new( self, ... )
     end
     
     -- return the newly created instance
@@ -248,6 +287,70 @@ function M.new( ... )
   return new_class
 end
 
+-- fields maps field names to functions, or classes, that create them the first
+-- time they're read in an instance of klass; the instances of klass then look
+-- up everything else through a function instead of a table
+function M.lazy( klass, fields )
+  local makers = lazies[ klass ]
+  
+  if not makers then
+    makers = {}
+    lazies[ klass ] = makers
+    
+    metas[ klass ].__index = function( self, key )
+      local make = makers[ key ]
+      
+      if make then
+        local value = make()
+        self[ key ] = value
+        return value
+      end
+      
+      return klass[ key ]
+    end
+  end
+  
+  for name, make in pairs( fields ) do
+    makers[ name ] = make
+  end
+end
+
+-- arrays of depth dimensions whose elements are created the first time they're
+-- read: value is returned for the elements never assigned or, when it's a
+-- function or a class, called to create them
+function M.array( depth, value )
+  local meta
+  
+  if type( value ) == 'function' or type( value ) == 'table' then
+    meta = { __index = function( self, index )
+      local element = value()
+      self[ index ] = element
+      return element
+    end }
+  else
+    meta = { __index = function()
+      return value
+    end }
+  end
+  
+  for level = 2, depth do
+    local inner = meta
+    
+    meta = { __index = function( self, index )
+      local element = setmetatable( {}, inner )
+      self[ index ] = element
+      return element
+    end }
+  end
+  
+  return setmetatable( {}, meta )
+end
+
+-- creates an empty record, for M.lazy and M.array
+function M.record()
+  return {}
+end
+
 function M.instanceOf( instance, class )
   return type( instance ) == 'table' and instance.instanceOf and instance.instanceOf( class )
 end
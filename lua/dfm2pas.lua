@@ -18,16 +18,26 @@ end
 
 local M = class.new()
 
-function M:new( source, path, datadir )
-  self:tokenize( source, path )
+-- Classes of the binary properties that are extracted to the data directory.
+local pictures = {
+  TBitmap = true,
+  TJPEGImage = true
+}
+
+function M:new( path, datadir, resources )
+  self:tokenize( path )
   self.path = path
+  -- pictures are named after the unit, forms in different units can have components with the same names
+  self.unit = path:match( '([^/\\]*)%.[^./\\]*$' ):lower()
   self.datadir = datadir
+  self.resources = resources
+  self.extracted = {}
   self.pos = 1
-  self.pascal = {}
+  self.pascal = lexer.stream()
   self.cid = {}
 end
 
-function M:tokenize( source, path )
+function M:tokenize( path )
   local reserved = {
     -- symbols
     '(',
@@ -111,46 +121,34 @@ function M:tokenize( source, path )
   tokens[ '{' ] = lexer.blockCommentStart
   tokens[ '}' ] = lexer.blockCommentEnd
 
-  local lex = lexer.new( source, path, tokens, "'", false, false )
+  local lex, err = lexer.open( path, path, tokens, "'", false, false )
   
-  tokens = {}
-  local i = 1
+  if not lex then
+    error( err, 0 )
+  end
   
-  repeat
-    local la, err = lex:next()
-    
-    if not la then
-      errorout( err )
-    end
-    
-    --if la.token ~= 'comment' then
-      tokens[ i ] = la
-      i = i + 1
-    --end
-  until la.token == 'eof'
+  local stream = lexer.stream()
+  local token, err = lex:tokenize( stream )
   
-  self.tokens = tokens
+  if not token then
+    error( err, 0 )
+  end
+  
+  self.tokens = stream
 end
 
 function M:error( ... )
   local args = { ... }
   local format = args[ 1 ]
   table.remove( args, 1 )
-  io.stderr:write( string.format( '%s:%d: %s\n', self.tokens[ self.pos ].source, self.tokens[ self.pos ].line, string.format( format, table.unpack( args ) ) ) )
-  os.exit( 1 )
+  error( string.format( '%s:%d: %s\n', self.tokens:source( self.pos ), self.tokens:line( self.pos ), string.format( format, table.unpack( args ) ) ) )
 end
 
 function M:out( token, lexeme )
-  local la = self.tokens[ self.pos ]
-  local nla = {}
+  local tokens = self.tokens
+  local pos = self.pos
   
-  nla.source = la.source
-  nla.line = la.line
-  nla.pos = la.pos
-  nla.lexeme = lexeme or la.lexeme
-  nla.token = token or la.token
-  
-  self.pascal[ #self.pascal + 1 ] = nla
+  self.pascal:push( token or tokens:token( pos ), lexeme or tokens:lexeme( pos ), tokens:source( pos ), tokens:line( pos ), tokens:pos( pos ) )
 end
 
 function M:outId()
@@ -162,12 +160,12 @@ end
 
 function M:token( offset )
   offset = offset or 1
-  return self.tokens[ self.pos + offset - 1 ].token
+  return self.tokens:token( self.pos + offset - 1 )
 end
 
 function M:lexeme( offset )
   offset = offset or 1
-  return self.tokens[ self.pos + offset - 1 ].lexeme:lower()
+  return self.tokens:lower( self.pos + offset - 1 )
 end
 
 function M:match( token )
@@ -181,12 +179,12 @@ function M:match( token )
     io.write( ']]\n' )
   end
   
-  if token == nil or self.tokens[ self.pos ].token == token then
+  if token == nil or self.tokens:token( self.pos ) == token then
     self.pos = self.pos + 1
-    return self.tokens[ self.pos - 1 ].lexeme
+    return self.tokens:lexeme( self.pos - 1 )
   end
   
-  self:error( 'Expected: %s, found %s', token, self.tokens[ self.pos ].token )
+  self:error( 'Expected: %s, found %s', token, self.tokens:token( self.pos ) )
 end
 
 function M:pushId( id )
@@ -213,7 +211,7 @@ function M:parse()
   self:out( ';', ';' )
   
   local implementation = self.pascal
-  self.pascal = {}
+  self.pascal = lexer.stream()
   
   self:out( 'id', instance )
   self:out( '.', '.' )
@@ -221,9 +219,9 @@ function M:parse()
   self:out( ';', ';' )
   
   local initialization = self.pascal
-  self.pascal = {}
+  self.pascal = lexer.stream()
   
-  return { implementation = implementation, initialization = initialization }
+  return { implementation = implementation, initialization = initialization, extracted = self.extracted }
 end
 
 function M:parseObject( dontpush )
@@ -276,23 +274,18 @@ function M:parseExpr()
     self:match()
     return
   elseif token == 'comment' then
-    local value = self.tokens[ self.pos ].lexeme:sub( 2, -2 ):gsub( '%s+', '' )
-    local data = value:gsub( '%x%x', function( hex ) return string.char( tonumber( hex, 16 ) ) end )
-    local ext
+    local name = self.unit .. '_' .. table.concat( self.cid, '_' ) .. '.rle'
+    local ok, err = self.resources:save( self.tokens, self.pos, self.datadir .. '/' .. name, pictures )
     
-    if data:sub( 2, 11 ) == 'TJPEGImage' then
-      ext = '.rle'
-    elseif data:sub( 2, 8 ) == 'TBitmap' then
-      ext = '.rle'
-    else
-      errorout( 'unknown data type' )
+    if not ok then
+      self:error( '%s', err )
     end
     
-    local name = table.concat( self.cid, '_' )
+    self.extracted[ #self.extracted + 1 ] = name
     
     self:out( 'id', 'loadbin' )
     self:out( '(', '(' )
-    self:out( 'string', name .. ext )
+    self:out( 'string', name )
     self:out( ')', ')' )
     
     self:match()
@@ -16,35 +16,29 @@ end
 
 --table.insert( package.searchers, 2, entrySearcher )
 
-local function errorout( ... )
-  local args = { ... }
-  local format = args[ 1 ]
-  table.remove( args, 1 )
-  io.stderr:write( string.format( format, args ), '\n' )
-  os.exit( 1 )
-end
-
 return function( args )
-  if #args ~= 3 then
-    io.write( 'Usage: pas2lua <input.pas> <output.lua> <datadir>\n' )
-    return 0
-  end
-  
-  local file, err = io.open( args[ 1 ] )
-  
-  if not file then
-    errorout( 'Error reading from %s', args[ 1 ] )
+  -- --run runs a script with the same globals the translation has, for the benchmarks
+  if args[ 1 ] == '--run' and #args >= 2 then
+    local script, err = loadfile( args[ 2 ] )
+    
+    if not script then
+      error( err, 0 )
+    end
+    
+    arg = { [ 0 ] = args[ 2 ], table.unpack( args, 3 ) }
+    return script( table.unpack( arg ) ) or 0
   end
   
-  local source = file:read( '*a' )
-  file:close()
-  
-  if not source then
-    errorout( 'Could not read from %s', args[ 1 ] )
+  if #args ~= 3 then
+    io.write( 'Usage: pas2lua [--cache <dir>] [--units <path>] [--no-hoist] [--lazy] [--stats <file>] [--arena] <input.pas> <output.lua> <datadir>\n' )
+    io.write( '       pas2lua [--cache <dir>] [--units <path>] [--no-hoist] [--lazy] [--stats <file>] [--arena] --batch [-j <jobs>] <outdir> <datadir> <input.pas | @manifest>...\n' )
+    io.write( '       pas2lua [--units <path>] [--no-hoist] [--lazy] [--arena] --watch <outdir> <datadir> <srcdir>...\n' )
+    io.write( '       pas2lua [--units <path>] [--no-hoist] [--lazy] [--stats <file>] [--arena] --run <script.lua> [<args>...]\n' )
+    return 0
   end
   
-  local parser = Parser( source, args[ 1 ], args[ 2 ], args[ 3 ] )
-  parser:parse()
+  local parser = Parser( args[ 1 ], args[ 2 ], args[ 3 ], options )
+  local extracted = parser:parse()
   
-  os.exit( 0 )
+  return 0, extracted
 end
@@ -1,22 +1,46 @@
 local M = class.new()
 
-function M:new( source, path, outpath, datadir )
+-- Counters and timers reported with --stats, the stats global only exists
+-- then.
+local function count( key, amount )
+  if stats then
+    stats[ key ] = stats[ key ] + ( amount or 1 )
+  end
+end
+
+local function clock()
+  return stats and stats.clock() or 0
+end
+
+function M:new( path, outpath, datadir, options )
   self.path = path
   self.outpath = outpath
   self.datadir = datadir
+  self.hoist = not options or options.hoist ~= false
+  self.lazy = options and options.lazy
   self.pos = 1
   self.spaces = 0
+  self.loops = 0
+  self.library = {}
+  self.hoistable = { [ 'self.' ] = true }
   self.units = {}
-  self.filters = {}
-  self.tokens = self:tokenize( source, path )
+  self.symbols = {}
+  self.lowest = 0
+  self.resources = rle.group()
+  self.extracted = {}
+  
+  local start = clock()
+  self.tokens = self:tokenize( path )
+  count( 'tokenize', clock() - start )
+  count( 'tokens', #self.tokens )
   
-  local outfile, err = io.open( outpath, 'w' )
+  local out, err = writer.open( outpath )
   
-  if not outfile then
+  if not out then
     self:error( 'Error opening output file: %s', err )
   end
   
-  self.outfile = outfile
+  self.writer = out
   
   self.builtin = {
     boolean = 'false',
@@ -33,7 +57,8 @@ function M:new( source, path, outpath, datadir )
   }
 end
 
-function M:tokenize( source, path )
+-- The token table for lexer.new and lexer.open with the Pascal symbols and keywords.
+function M.lexerTokens()
   local reserved = {
     -- symbols
     '(',
@@ -104,6 +129,7 @@ function M:tokenize( source, path )
     'uses',
     'var',
     'while',
+    'xor',
     -- builtin types
     'boolean',
     'integer',
@@ -120,62 +146,78 @@ function M:tokenize( source, path )
   tokens[ '//' ] = lexer.lineCommentStart
   tokens[ '{' ] = lexer.blockCommentStart
   tokens[ '}' ] = lexer.blockCommentEnd
+  return tokens
+end
 
-  local lex = lexer.new( source, path, tokens, "'", false, false )
+function M:tokenize( path )
+  local lex, err = lexer.open( path, path, M.lexerTokens(), "'", false, false )
   
-  tokens = {}
-  local i = 1
-  local dfms = {}
+  if not lex then
+    error( err, 0 )
+  end
   
-  repeat
-    local la, err = lex:next()
+  local stream = lexer.stream()
+  local stops = { comment = true, initialization = true }
+  local forms = {}
+  
+  -- comments and initialization are returned to us instead of being added to the stream
+  while true do
+    local token, lexeme, name, line, pos = lex:tokenize( stream, stops )
     
-    if not la then
-      errorout( err )
+    if not token then
+      -- errors in the forms came first
+      self:waitForms( forms )
+      error( lexeme, 0 )
     end
     
-    if la.token ~= 'comment' then
-      if la.token == 'initialization' then
-        for _, dfm in ipairs( dfms ) do
-          for _, la in ipairs( dfm.implementation ) do
-            tokens[ i ] = la
-            i = i + 1
-          end
-        end
-        
-        tokens[ i ] = la
-        i = i + 1
-        
-        for _, dfm in ipairs( dfms ) do
-          for _, la in ipairs( dfm.initialization ) do
-            tokens[ i ] = la
-            i = i + 1
-          end
-        end
-      else
-        tokens[ i ] = la
-        i = i + 1
-      end
-    elseif la.lexeme:lower() == '{$r *.dfm}' then
-      tokens[ i ] = la
-      i = i + 1
+    if token == 'eof' then
+      self:waitForms( forms )
+      break
+    elseif token == 'initialization' then
+      local dfms = self:waitForms( forms )
       
-      local dfm = path:gsub( '(.*)%.pas', '%1.dfm' )
+      for _, dfm in ipairs( dfms ) do
+        stream:append( dfm.implementation )
+      end
       
-      local file, err = io.open( dfm )
+      stream:push( token, lexeme, name, line, pos )
       
-      if not file then
-        self:error( '%s not found', dfm )
+      for _, dfm in ipairs( dfms ) do
+        stream:append( dfm.initialization )
       end
+    elseif lexeme:lower() == '{$r *.dfm}' then
+      stream:push( token, lexeme, name, line, pos )
+      
+      -- big forms are translated on another thread while the rest of the unit is read
+      local dfm = path:gsub( '(.*)%.pas', '%1.dfm' )
       
-      local d2p = dfm2pas( file:read( '*a' ), dfm, self.datadir )
-      file:close()
-      local pas = d2p:parse()
-      dfms[ #dfms + 1 ] =  pas
+      local start = clock()
+      forms[ #forms + 1 ] = startform( dfm, self.datadir, self.resources )
+      count( 'dfm', clock() - start )
     end
-  until la.token == 'eof'
+  end
   
-  return tokens
+  return stream
+end
+
+-- Returns what dfm2pas returned for the forms started, and empties the list.
+function M:waitForms( forms )
+  local start = clock()
+  local dfms = {}
+  
+  for i, form in ipairs( forms ) do
+    local pas = form:wait()
+    
+    for _, file in ipairs( pas.extracted ) do
+      self.extracted[ #self.extracted + 1 ] = file
+    end
+    
+    dfms[ i ] = pas
+    forms[ i ] = nil
+  end
+  
+  count( 'dfm', clock() - start )
+  return dfms
 end
 
 function M:error( ... )
@@ -184,53 +226,37 @@ function M:error( ... )
   table.remove( args, 1 )
   --io.stderr:write( string.format( '%s:%d: %s\n', self.tokens[ self.pos ].source, self.tokens[ self.pos ].line, string.format( format, table.unpack( args ) ) ) )
   --os.exit( 1 )
-  error( string.format( '%s:%d: %s\n', self.tokens[ self.pos ].source, self.tokens[ self.pos ].line, string.format( format, table.unpack( args ) ) ) )
-end
-
-function M:pushFilter( pattern, sub )
-  self.filters[ #self.filters + 1 ] = { pattern = pattern, sub = sub }
+  error( string.format( '%s:%d: %s\n', self.tokens:source( self.pos ), self.tokens:line( self.pos ), string.format( format, table.unpack( args ) ) ) )
 end
 
-function M:popFilter()
-  self.filters[ #self.filters ] = nil
-end
-
-function M:format( format, args )
-  local str = string.format( format, table.unpack( args ) )
-  
-  for i = #self.filters, 1, -1 do
-    str = str:gsub( self.filters[ i ].pattern, self.filters[ i ].sub )
+-- Indentation strings, built once per level.
+local indents = setmetatable( {}, {
+  __index = function( self, level )
+    local str = string.rep( '  ', level )
+    self[ level ] = str
+    return str
   end
-  
-  return str
+} )
+
+function M:emit( ... )
+  self.writer:write( ... )
 end
 
-function M:out( ... )
-  local args = { ... }
-  local format = args[ 1 ]
-  table.remove( args, 1 )
-  self.outfile:write( self:format( format, args ) )
+function M:out( format, ... )
+  self:emit( string.format( format, ... ) )
 end
 
-function M:outln( ... )
-  local args = { ... }
-  local format = args[ 1 ]
-  
+function M:outln( format, ... )
   if format then
-    table.remove( args, 1 )
-    self.outfile:write( string.rep( ' ', self.spaces * 2 ), self:format( format, args ), '\n' )
+    self:emit( indents[ self.spaces ], string.format( format, ... ), '\n' )
   else
-    self.outfile:write( '\n' )
+    self:emit( '\n' )
   end
 end
 
-function M:outindent( ... )
-  local args = { ... }
-  local format = args[ 1 ]
-  
+function M:outindent( format, ... )
   if format then
-    table.remove( args, 1 )
-    self.outfile:write( string.rep( ' ', self.spaces * 2 ), self:format( format, args ) )
+    self:emit( indents[ self.spaces ], string.format( format, ... ) )
   end
 end
 
@@ -242,9 +268,30 @@ function M:unindent()
   self.spaces = self.spaces - 1
 end
 
+-- Runs parse with the output held instead of written, and returns it. Used
+-- when what comes before depends on what's parsed after it.
+function M:capture( parse, ... )
+  local writer = self.writer
+  local held = {}
+  
+  self.writer = {
+    write = function( _, ... )
+      for i = 1, select( '#', ... ) do
+        held[ #held + 1 ] = select( i, ... )
+      end
+    end
+  }
+  
+  parse( self, ... )
+  self.writer = writer
+  return table.concat( held )
+end
+
 function M:skipComments()
-  while self.tokens[ self.pos ].token == 'comment' do
-    local lexeme = self.tokens[ self.pos ].lexeme
+  local tokens = self.tokens
+  
+  while tokens:token( self.pos ) == 'comment' do
+    local lexeme = tokens:lexeme( self.pos )
     
     if lexeme:sub( 1, 2 ) == '//' then
       self:out( '--%s\n', lexeme:sub( 3, -1 ) )
@@ -259,13 +306,13 @@ end
 function M:token( offset )
   offset = offset or 1
   self:skipComments()
-  return self.tokens[ self.pos + offset - 1 ].token
+  return self.tokens:token( self.pos + offset - 1 )
 end
 
 function M:lexeme( offset )
   offset = offset or 1
   self:skipComments()
-  return self.tokens[ self.pos + offset - 1 ].lexeme:lower()
+  return self.tokens:lower( self.pos + offset - 1 )
 end
 
 function M:match( token )
@@ -281,63 +328,173 @@ function M:match( token )
   
   self:skipComments()
   
-  if token == nil or self.tokens[ self.pos ].token == token then
+  if token == nil or self.tokens:token( self.pos ) == token then
     self.pos = self.pos + 1
-    return self.tokens[ self.pos - 1 ].lexeme
+    return self.tokens:lexeme( self.pos - 1 )
   end
   
-  self:error( 'Expected: %s, found %s', token, self.tokens[ self.pos ].token )
+  self:error( 'Expected: %s, found %s', token, self.tokens:token( self.pos ) )
 end
 
--- scopes
--- [ '@' ] = previous scope
--- [ '#' ] = how to access identifiers declared in this scope
--- [ '!' ] = how to declare identifiers belonging to this scope
+-- symbols
+-- self.symbols[ id ] = innermost binding of id, { def = ..., frame = ..., next = ... }
+--   where next is the binding it shadows
+-- self.scope = current frame, frames have
+--   declare = how to declare identifiers belonging to this frame
+--   access = how to access identifiers declared in this frame
+--   below = the frame under it
+--   depth = position in the stack, frames inserted under all the others have
+--     negative depths
+--   ids = identifiers bound in this frame, unbound when the frame is popped
+--   routine = true for the parameters and variables of a procedure or function
+-- self.fields = innermost frame with the fields of a class, which are looked
+--   up directly in the class definition instead of being bound one by one
 
 function M:newScope( declare, access )
-  local scope = { [ '@' ] = self.scope, [ '!' ] = declare, [ '#' ] = access }
-  self.scope = scope
+  count( 'scopes' )
+  local below = self.scope
+  self.scope = { declare = declare, access = access, below = below, depth = below and below.depth + 1 or 1, ids = {} }
+end
+
+function M:newFieldsScope( fields )
+  self:newScope( '', 'self.' )
+  self.scope.fields = fields
+  self.scope.outer = self.fields
+  self.fields = self.scope
 end
 
-function M:pushScope( scope )
-  scope[ '@' ] = self.scope
-  self.scope = scope
+function M:newBottomScope( access )
+  -- Goes under all the other frames, for the units in uses clauses.
+  self.lowest = self.lowest - 1
+  return { declare = '', access = access, depth = self.lowest, ids = {} }
 end
 
 function M:popScope()
-  local scope = self.scope[ '@' ]
-  self.scope = scope
-  return scope
+  local scope = self.scope
+  local symbols = self.symbols
+  
+  for _, id in ipairs( scope.ids ) do
+    symbols[ id ] = symbols[ id ].next
+  end
+  
+  if scope.fields then
+    self.fields = scope.outer
+  end
+  
+  self.scope = scope.below
 end
 
-function M:declare( id, def )
-  if self.scope[ id ] then
+function M:declare( id, def, scope )
+  count( 'declarations' )
+  scope = scope or self.scope
+  local symbols = self.symbols
+  local binding = symbols[ id ]
+  
+  if binding and binding.frame == scope or scope.fields and scope.fields[ id ] then
     self:error( 'Duplicate identifier: %s', id )
   end
   
-  self.scope[ id ] = def
+  local ids = scope.ids
+  ids[ #ids + 1 ] = id
+  
+  if scope.depth > 0 then
+    symbols[ id ] = { def = def, frame = scope, next = binding }
+  elseif binding then
+    -- Bottom frames are never popped, so their bindings go to the end of the chain.
+    while binding.next do
+      binding = binding.next
+    end
+    
+    binding.next = { def = def, frame = scope }
+  else
+    symbols[ id ] = { def = def, frame = scope }
+  end
 end
 
 function M:declared( id )
-  local scope = self.scope
+  local binding = self.symbols[ id ]
+  local fields = self.fields
   
-  while scope do
-    if scope[ id ] then
-      return scope[ '#' ], scope[ id ]
+  while fields and not ( binding and binding.frame.depth > fields.depth ) do
+    local def = fields.fields[ id ]
+    
+    if def then
+      return fields.access, def
     end
     
-    scope = scope[ '@' ]
+    fields = fields.outer
+  end
+  
+  if binding then
+    return binding.frame.access, binding.def
   end
   
   return false
 end
 
 function M:declaration()
-  return self.scope[ '!' ]
+  return self.scope.declare
 end
 
 function M:access()
-  return self.scope[ '#' ]
+  return self.scope.access
+end
+
+function M:isLocal( id )
+  -- true if id is a parameter or variable of the procedure or function being parsed
+  local binding = self.symbols[ id ]
+  
+  if not binding or not binding.frame.routine then
+    return false
+  end
+  
+  local _, def = self:declared( id )
+  return def == binding.def
+end
+
+function M:addLibrary( name, unit )
+  -- the routines of the used units can't change the fields of the classes
+  -- being translated nor be assigned to, so they can always be hoisted
+  self.hoistable[ name .. '.' ] = true
+  
+  for _, def in pairs( unit ) do
+    if def.type == 'procedure' or def.type == 'function' then
+      self.library[ def ] = true
+    end
+  end
+end
+
+function M:call( def )
+  -- anything else may run code that changes what's been hoisted
+  if self.refs and not ( def and self.library[ def ] ) then
+    self.calls = true
+  end
+end
+
+function M:reference( access, id, def )
+  -- counts the uses of the members of the used units and of the objects and
+  -- arrays in fields of self, uses inside loops count twice, returns true if
+  -- it was counted
+  local refs = self.refs
+  
+  if not refs or not self.hoistable[ access ] then
+    return
+  end
+  
+  if access == 'self.' and not ( def.fields or def.subtype ) then
+    return
+  end
+  
+  local key = access .. id
+  local ref = refs[ key ]
+  
+  if not ref then
+    ref = { key = key, id = id, count = 0, routine = self.library[ def ] or false }
+    refs[ key ] = ref
+  end
+  
+  ref.count = ref.count + ( self.loops ~= 0 and 2 or 1 )
+  return true
 end
 
 function M:parse()
@@ -346,16 +503,38 @@ function M:parse()
   
   self:newScope( '', 'system.' )
   local unit = loadunit( 'system' )
+  self:addLibrary( 'system', unit )
   
   for id, def in pairs( unit ) do
     self:declare( id, def )
   end
   
+  local start = clock()
   self:parseUnit()
+  count( 'parse', clock() - start )
+  
+  start = clock()
+  local ok, err = self.resources:wait()
+  
+  if not ok then
+    error( err, 0 )
+  end
+  
+  count( 'outputBytes', self.writer:size() )
+  ok, err = self.writer:close()
+  
+  if not ok then
+    self:error( 'Error writing output file: %s', err )
+  end
+  
+  count( 'flush', clock() - start )
+  
+  return self.extracted
 end
 
 function M:parseUnit()
   self:match( 'unit' )
+  self.unitName = self:lexeme():lower()
   self:match( 'id' )
   self:match( ';' )
   
@@ -395,12 +574,10 @@ end
 function M:parseUsesSection()
   self:match( 'uses' )
   
-  local scopes = {}
-  
-  repeat
-    local scope = self:popScope()
-    scopes[ #scopes + 1 ] = scope
-  until scope == nil
+  -- The current frame is dropped, and the units go under all the other
+  -- frames, the last one in the clause on top.
+  self:popScope()
+  local names = {}
   
   while true do
     local name = self:lexeme()
@@ -408,13 +585,9 @@ function M:parseUsesSection()
     
     self:outln( 'local %s = system.loadunit \'%s\'', name, name )
     
-    self:newScope( '', name .. '.' )
-    local unit = loadunit( name )
-    self.units[ name ] = unit
-    
-    for id, def in pairs( unit ) do
-      self:declare( id, def )
-    end
+    self.units[ name ] = loadunit( name )
+    self:addLibrary( name, self.units[ name ] )
+    names[ #names + 1 ] = name
     
     if self:token() ~= ',' then
       break
@@ -426,8 +599,13 @@ function M:parseUsesSection()
   self:match( ';' )
   self:outln()
   
-  for i = #scopes, 1, -1 do
-    self:pushScope( scopes[ i ] )
+  for i = #names, 1, -1 do
+    local name = names[ i ]
+    local scope = self:newBottomScope( name .. '.' )
+    
+    for id, def in pairs( self.units[ name ] ) do
+      self:declare( id, def, scope )
+    end
   end
 end
 
@@ -454,6 +632,10 @@ function M:parseTypeSection()
   end
 end
 
+-- Layouts are shared instead of copied: the fields of a class inherit the
+-- fields of its super class through __index, and a definition of a type
+-- declared in a unit, with no fields of its own, uses the fields of the
+-- unit's definition.
 function M:consolidate( def )
   if def.consolidated then
     return
@@ -461,31 +643,44 @@ function M:consolidate( def )
   
   def.consolidated = true
   
-  if not def.fields then
-    def.fields = {}
-  end
-  
+  local fields = def.fields
   local super = def.super
   
-  while super do
-    for id2, def2 in pairs( super.fields ) do
-      def.fields[ id2 ] = def2
+  if super then
+    self:consolidate( super )
+    
+    if not super.layout then
+      super.layout = { __index = super.fields }
     end
     
-    super = super.super
+    fields = setmetatable( fields or {}, super.layout )
   end
   
   for name, unit in pairs( self.units ) do
-    if unit[ def.type ] then
-      for id2, def2 in pairs( unit[ def.type ].fields ) do
-        def.fields[ id2 ] = def2
+    local stub = unit[ def.type ]
+    
+    if stub then
+      if stub ~= def then
+        self:consolidate( stub )
+        
+        if not super and ( not fields or next( fields ) == nil ) then
+          def.fields = stub.fields
+          return
+        end
+        
+        for id2, def2 in pairs( stub.fields ) do
+          fields[ id2 ] = def2
+        end
       end
       
       break
     end
   end
   
-  for _, def2 in pairs( def.fields ) do
+  fields = fields or {}
+  def.fields = fields
+  
+  for _, def2 in pairs( fields ) do
     self:consolidate( def2 )
   end
 end
@@ -495,18 +690,20 @@ function M:parseClass( id )
   local def = { type = id, fields = { __initdfm = { type = 'procedure' } } }
   local super
   
-  self:outindent( '%s%s = class.new', self:declaration(), id )
-
+  -- named after the unit so getClassName doesn't search _G, which can't
+  -- reach the unit's local table
+  self:outindent( '%s%s = class.new( \'%s.%s\'', self:declaration(), id, self.unitName, id )
+  
   if self:token() == '(' then
     self:match()
     super = self:lexeme()
     def.super = self:parseType()
     self:match( ')' )
     
-    self:out( '( %s%s )', self:declared( super ), super )
+    self:out( ', %s%s )', self:declared( super ), super )
     self:consolidate( def )
   else
-    self:out( '()' )
+    self:out( ' )' )
   end
   
   self:outln()
@@ -518,6 +715,9 @@ function M:parseClass( id )
     self:outln( '%s%s.new( self )', self:declared( super ), super )
   end
   
+  local pure = true
+  local lazy = {}
+  
   while self:token() ~= 'end' do
     local ids, def2 = self:parseDecl()
     self:consolidate( def2 )
@@ -529,12 +729,20 @@ function M:parseClass( id )
         self:outln( '-- self.%s -- %s', prop, def2.type )
       else
         local value = self.builtin[ def2.type ]
+        local maker = self:maker( def2 )
         
         if value then
           self:outln( 'self.%s = %s -- %s', prop, value, def2.type )
+        elseif self.lazy and maker then
+          self:outln( '-- self.%s -- created on first read', prop )
+          lazy[ #lazy + 1 ] = string.format( '%s = %s', prop, maker )
+        elseif def2.type == 'record' then
+          self:outln( 'self.%s = {} -- record', prop )
         else
           self:outln( 'self.%s = %s%s()', prop, self:declared( def2.type ), def2.type )
         end
+        
+        pure = pure and ( value or maker ) ~= nil
       end
     end
   end
@@ -543,10 +751,46 @@ function M:parseClass( id )
   self:outln( 'end' )
   self:outln()
   
+  if lazy[ 1 ] then
+    self:outln( 'class.lazy( %s%s, { %s } )', self:access(), id, table.concat( lazy, ', ' ) )
+    self:outln()
+  end
+  
+  -- constructing a pure class only creates tables, nothing outside of its
+  -- instances can tell whether that happened early or late
+  def.pure = pure and ( not def.super or def.super.pure == true )
+  
   self:match( 'end' )
   return def
 end
 
+function M:maker( def )
+  -- what creates the values of def when they're read for the first time, nil
+  -- if their construction can't be deferred
+  if def.type == 'record' then
+    return 'class.record'
+  elseif def.pure then
+    return self:declared( def.type ) .. def.type
+  end
+end
+
+function M:lazyArray( def )
+  -- the dimensions and the value or maker of the elements of an array that
+  -- can be created on first read
+  local depth = 0
+  
+  while def.type == 'array' do
+    depth = depth + 1
+    def = def.subtype
+  end
+  
+  local value = def.value or self:maker( def )
+  
+  if value then
+    return string.format( '%d, %s', depth, value ), def.type
+  end
+end
+
 function M:parseIdList()
   local list = {}
   
@@ -671,10 +915,11 @@ function M:parseConstSection()
     local id = self:lexeme()
     self:match()
     self:match( '=' )
-    local value = self:parseExpr()
+    local value, def = self:parseExpr()
     self:match( ';' )
     
-    self:declare( id, { type = 'const', value = value } )
+    -- constants known at compile time are inlined where they're used
+    self:declare( id, { type = def.type, const = def.const } )
     self:outln( '%s%s = %s', self:declaration(), id, value )
   end
 end
@@ -690,9 +935,17 @@ function M:parseVarSection()
     
     for _, id in ipairs( ids ) do
       self:declare( id, def )
-    
+      
+      local lazy, element
+      
+      if self.lazy and def.type == 'array' then
+        lazy, element = self:lazyArray( def )
+      end
+      
       if def.value then
         self:outln( '%s%s = %s -- %s', self:declaration(), id, def.value, def.type )
+      elseif lazy then
+        self:outln( '%s%s = class.array( %s ) -- %s', self:declaration(), id, lazy, element )
       elseif def.type == 'array' then
         self:outln()
         self:outln( '%s%s = {}', self:declaration(), id )
@@ -857,12 +1110,8 @@ function M:parseProcedure()
     local def
     access, def = self:declared( id )
     
-    self:newScope( '', 'self.' )
+    self:newFieldsScope( def.fields )
     scopes = 2
-    
-    for id2, def2 in pairs( def.fields ) do
-      self:declare( id2, def2 )
-    end
       
     id = id .. '.' .. self:lexeme()
     self:match( 'id' )
@@ -871,6 +1120,7 @@ function M:parseProcedure()
   self:outindent( '%s%s = function( self', access, id )
   self:indent()
   self:newScope( 'local ', '' )
+  self.scope.routine = true
   
   if self:token() == '(' then
     self:match()
@@ -912,11 +1162,7 @@ function M:parseProcedure()
   self:outln()
   self:match( ';' )
   
-  if self:token() == 'var' then
-    self:parseVarSection()
-  end
-  
-  self:parseCompoundStmt()
+  self:parseBody()
   
   self:match( ';' )
   
@@ -944,12 +1190,8 @@ function M:parseFunction()
     local def
     access, def = self:declared( id )
     
-    self:newScope( '', 'self.' )
+    self:newFieldsScope( def.fields )
     scopes = 2
-    
-    for id2, def2 in pairs( def.fields ) do
-      self:declare( id2, def2 )
-    end
       
     funcname = self:lexeme()
     id = id .. '.' .. funcname
@@ -959,6 +1201,7 @@ function M:parseFunction()
   self:outindent( '%s%s = function( self', access, id )
   self:indent()
   self:newScope( 'local ', '' )
+  self.scope.routine = true
   
   if self:token() == '(' then
     self:match()
@@ -999,21 +1242,19 @@ function M:parseFunction()
   self:out( ' )' )
   self:outln()
   self:outln( 'local __ret' )
-  self:pushFilter( string.format( 'self%%.%s', funcname ), '__ret' )
   
   self:match( ':' )
-  self:parseType()
+  local result = self:parseType()
   self:match( ';' )
   
-  if self:token() == 'var' then
-    self:parseVarSection()
-  end
+  -- inside the function its name is its result
+  local outer, def = self:declared( funcname )
+  self:declare( funcname, { type = 'result', result = result, access = outer, def = def } )
   
-  self:parseCompoundStmt()
+  self:parseBody()
   
   self:match( ';' )
   
-  self:popFilter()
   self:outln( 'return __ret' )
   self:unindent()
   self:outln( 'end' )
@@ -1024,17 +1265,152 @@ function M:parseFunction()
   end
 end
 
+-- Hoisted locals are limited so they don't run into Lua's limit on locals.
+local hoistMax = 32
+
+-- Parses the variables and the statements of a procedure or function into a
+-- tree, then optimizes it and emits it.
+function M:parseBody()
+  local tree, refs, calls = self.tree, self.refs, self.calls
+  self.tree, self.refs, self.calls = Ast(), self.hoist and {} or nil, false
+  
+  -- the variables are emitted after the hoisted locals
+  local vars = self:token() == 'var' and self.tree:node( 'raw', self:capture( self.parseVarSection ) )
+  local body = self:parseCompoundStmt()
+  
+  self:optimize( self.tree, body )
+  
+  if self.refs then
+    self:hoistMembers( self.tree, body )
+    self.tree:resolve()
+  end
+  
+  if vars then
+    self:emit( self.tree.a[ vars ] )
+  end
+  
+  self:emitList( self.tree, body )
+  self:countTree()
+  self.tree, self.refs, self.calls = tree, refs, calls
+end
+
+function M:countTree()
+  local bytes, nodes = self.tree:memory()
+  count( 'nodes', nodes )
+  count( 'nodeBytes', bytes )
+end
+
+-- Flags of for nodes.
+local forDown, forLocal, forNative = 1, 2, 4
+
+-- Loops over a local variable that their bodies don't assign become numeric
+-- fors.
+function M:optimize( tree, root )
+  tree:walk( root, function( n )
+    if tree.kind[ n ] == 'for' and ( tree.d[ n ] & forLocal ) ~= 0 then
+      local cid = tree.a[ n ]
+      local native = true
+      
+      tree:walk( tree.e[ n ], function( n2 )
+        tree:assigned( n2, function( cid2 )
+          native = native and cid2 ~= cid
+        end )
+      end )
+      
+      if native then
+        tree.d[ n ] = tree.d[ n ] | forNative
+      end
+    end
+  end )
+end
+
+-- The members of the used units and the objects in fields of self that are
+-- used more than once are read into locals at the top of the body. Routines of
+-- the used units are always hoisted, everything else only when the body
+-- doesn't assign it or anything with the same name, and doesn't call code
+-- that could.
+function M:hoistMembers( tree, root )
+  local assigned = {}
+  
+  tree:walk( root, function( n )
+    tree:assigned( n, function( cid )
+      assigned[ tree:code( cid ) ] = true
+    end )
+  end )
+  
+  local list = {}
+  
+  for key, ref in pairs( self.refs ) do
+    local keep = ref.count >= 2 and ( ref.routine or not self.calls )
+    
+    if keep and not ref.routine then
+      local suffix = '.' .. ref.id
+      
+      for cid in pairs( assigned ) do
+        if cid == ref.id or cid:sub( -#suffix ) == suffix then
+          keep = false
+          break
+        end
+      end
+    end
+    
+    if keep then
+      list[ #list + 1 ] = ref
+    end
+  end
+  
+  table.sort( list, function( a, b )
+    if a.count ~= b.count then
+      return a.count > b.count
+    end
+    
+    return a.key < b.key
+  end )
+  
+  local hoisted = {}
+  
+  for i = 1, math.min( #list, hoistMax ) do
+    local key = list[ i ].key
+    hoisted[ key ] = '__' .. key:gsub( '%.', '_' )
+    self:outln( 'local %s = %s', hoisted[ key ], key )
+  end
+  
+  -- the members parseCid found are renamed, the code using them follows
+  if list[ 1 ] then
+    local kind, a = tree.kind, tree.a
+    
+    for n = 1, tree.count do
+      if kind[ n ] == 'member' and hoisted[ a[ n ] ] then
+        a[ n ] = hoisted[ a[ n ] ]
+      end
+    end
+  end
+end
+
 function M:parseCid()
   local id = self:lexeme()
   self:match( 'id' )
   local access, def = self:declared( id )
   
+  if access and def.type == 'result' then
+    -- in a function its name is its result, unless it's called
+    if self:token() == '(' then
+      access, def = def.access, def.def
+    else
+      access, id, def = '', '__ret', def.result
+    end
+  end
+  
   if not access then
     self:error( 'Unknown identifier: %s', id )
   end
   
   local cid = { access, id }
   
+  if self:reference( access, id, def ) then
+    cid = { self.tree:member( access .. id ) }
+  end
+  
   while true do
     if self:token() == '.' then
       self:match()
@@ -1043,7 +1419,7 @@ function M:parseCid()
       def = def.fields[ id ]
       
       if not def then
-        self:error( 'Unknown field: %s.%s', table.concat( cid ), id )
+        self:error( 'Unknown field: %s.%s', self.tree:code( table.concat( cid ) ), id )
       end
       
       cid[ #cid + 1 ] = '.'
@@ -1074,39 +1450,41 @@ end
 
 function M:parseStatement()
   local token = self:token()
+  local n
   
   if token == 'id' then
     local cid, def = self:parseCid()
     
     if self:token() == '(' or self:token() == ';' then
-      self:parseCallStmt( cid )
+      self:call( def )
+      n = self:parseCallStmt( cid )
     else
-      self:parseAssignmentStmt( cid )
+      n = self:parseAssignmentStmt( cid )
     end
   elseif token == 'begin' then
-    self:parseCompoundStmt()
+    n = self:parseCompoundStmt()
   elseif token == 'if' then
-    self:parseIfStmt()
+    n = self:parseIfStmt()
   elseif token == 'case' then
-    self:parseCaseStmt()
+    n = self:parseCaseStmt()
   elseif token == 'for' then
-    self:parseForStmt()
+    n = self:parseForStmt()
   elseif token == 'while' then
-    self:parseWhileStmt()
+    n = self:parseWhileStmt()
   elseif token == 'repeat' then
-    self:parseRepeatStmt()
+    n = self:parseRepeatStmt()
   elseif token == 'inc' then
-    self:parseIncStmt()
+    n = self:parseIncStmt()
   elseif token == 'dec' then
-    self:parseDecStmt()
+    n = self:parseDecStmt()
   elseif token == 'decodedate' then
     -- must be a statement because passes parameters by reference
-    self:parseDecodeDateStmt()
+    n = self:parseDecodeDateStmt()
   elseif token == 'decodetime' then
     -- must be a statement because passes parameters by reference
-    self:parseDecodeTimeStmt()
+    n = self:parseDecodeTimeStmt()
   elseif token == 'with' then
-    self:parseWithStmt()
+    n = self:parseWithStmt()
   else
     self:error( 'Statement expected' )
   end
@@ -1115,11 +1493,11 @@ function M:parseStatement()
     self:match()
   end
   
-  self:outln()
+  return n
 end
 
 function M:parseCallStmt( cid )
-  self:outindent( '%s(', cid )
+  local code = { cid, '(' }
   
   if self:token() == '(' then
     self:match()
@@ -1128,108 +1506,118 @@ function M:parseCallStmt( cid )
       local expr = self:parseExpr()
       
       if expr then
-        self:out( ' %s', expr )
+        code[ #code + 1 ] = ' ' .. expr
       end
       
       while self:token() == ',' do
         self:match()
-        self:out( ', %s', self:parseExpr() )
+        code[ #code + 1 ] = string.format( ', %s', self:parseExpr() )
       end
       
-      self:out( ' ' )
+      code[ #code + 1 ] = ' '
     end
     
     self:match( ')' )
   end
   
-  self:out( ')' )
+  code[ #code + 1 ] = ')'
+  return self.tree:node( 'call', table.concat( code ) )
 end
 
-function M:parseAssignmentStmt( cid, def )
+function M:parseAssignmentStmt( cid )
   self:match( ':=' )
-  self:outindent( '%s = %s', cid, self:parseExpr() )
+  return self.tree:node( 'assign', cid, tostring( ( self:parseExpr() ) ) )
 end
 
-function M:parseCompoundStmt()
-  self:match( 'begin' )
+function M:parseStatementList()
+  local nodes = {}
   
   while self:token() ~= 'end' do
-    self:parseStatement()
+    nodes[ #nodes + 1 ] = self:parseStatement()
   end
   
+  return self.tree:node( 'block', self.tree:list( nodes ) )
+end
+
+function M:parseCompoundStmt()
+  self:match( 'begin' )
+  local n = self:parseStatementList()
   self:match( 'end' )
+  return n
 end
 
 function M:parseIfStmt()
   self:match( 'if' )
   local cond = self:parseExpr()
   self:match( 'then' )
-  
-  self:outln( 'if %s then', cond )
-  self:indent()
-  self:parseStatement()
-  self:unindent()
+  local body = self:parseStatement()
+  local otherwise
   
   if self:token() == 'else' then
     self:match()
-    self:outln( 'else' )
-    self:indent()
-    self:parseStatement()
-    self:unindent()
+    otherwise = self:parseStatement()
   end
   
-  self:outln( 'end' )
+  return self.tree:node( 'if', cond, body, otherwise )
 end
 
 function M:parseCaseStmt()
   self:match( 'case' )
-  local cid, def = self:parseCid()
+  local cid = self:parseCid()
   self:match( 'of' )
   
-  local stmt = 'if'
+  local tree = self.tree
+  local arms = {}
+  local otherwise
   
   while self:token() ~= 'end' do
-    local values = { ( self:parseExpr() ) }
-    
-    while self:token() == ',' do
+    if self:token() == 'else' then
       self:match()
-      values[ #values + 1 ] = self:parseExpr()
+      otherwise = self:parseStatementList()
+      break
     end
     
-    self:match( ':' )
-    self:outindent( stmt )
-    self:indent()
-    local sep = ' '
+    local labels = {}
     
-    for _, value in ipairs( values ) do
-      self:out( '%s( %s == %s )', sep, cid, value )
-      sep = ' or '
-    end
-    
-    self:out( ' then' )
-    self:outln()
-    stmt = 'elseif'
-    
-    self:parseStatement()
+    repeat
+      if labels[ 1 ] then
+        self:match( ',' )
+      end
+      
+      local lo = self:parseExpr()
+      local hi
+      
+      if self:token() == '..' then
+        self:match()
+        hi = self:parseExpr()
+      end
+      
+      labels[ #labels + 1 ] = tree:node( 'label', lo, hi )
+    until self:token() ~= ','
     
-    self:unindent()
-    self:outln()
+    self:match( ':' )
+    local first, count = tree:list( labels )
+    arms[ #arms + 1 ] = tree:node( 'arm', first, count, self:parseStatement() )
   end
   
-  self:outln( 'end' )
   self:match( 'end' )
+  
+  local first, count = tree:list( arms )
+  return tree:node( 'case', cid, first, count, otherwise )
 end
 
 function M:parseForStmt()
   self:match( 'for' )
-  local cid, def = self:parseCid()
+  local id = self:lexeme()
+  local cid = self:parseCid()
   self:match( ':=' )
   
   local start = self:parseExpr()
-  local step = self:token()
+  local flags = 0
   
-  if step == 'downto' then
+  if self:token() == 'downto' then
     self:match()
+    flags = forDown
   else
     self:match( 'to' )
   end
@@ -1237,43 +1625,41 @@ function M:parseForStmt()
   local finish = self:parseExpr()
   self:match( 'do' )
   
-  self:outln( '%s = %s', cid, start )
-  self:outln( 'while %s %s %s do', cid, ( step == 'to' and '<=' or '>=' ), finish )
-  self:indent()
+  -- whether it becomes a numeric for is decided once its body is known
+  if cid == id and self:isLocal( id ) then
+    flags = flags | forLocal
+  end
   
-  self:parseStatement()
+  self.loops = self.loops + 1
+  local body = self:parseStatement()
+  self.loops = self.loops - 1
   
-  self:outln( '%s = %s %s 1', cid, cid, ( step == 'to' and '+' or '-' ) )
-  self:unindent()
-  self:outln( 'end' )
+  return self.tree:node( 'for', cid, start, finish, flags, body )
 end
 
 function M:parseWhileStmt()
   self:match( 'while' )
+  self.loops = self.loops + 1
   local cond = self:parseExpr()
   self:match( 'do' )
-  
-  self:outln( 'while %s do', cond )
-  self:indent()
-  self:parseStatement()
-  self:unindent()
-  self:outln( 'end' )
+  local body = self:parseStatement()
+  self.loops = self.loops - 1
+  return self.tree:node( 'while', cond, body )
 end
 
 function M:parseRepeatStmt()
   self:match( 'repeat' )
-  self:outln( 'repeat' )
-  self:indent()
+  self.loops = self.loops + 1
+  local nodes = {}
   
   while self:token() ~= 'until' do
-    self:parseStatement()
+    nodes[ #nodes + 1 ] = self:parseStatement()
   end
   
-  self:unindent()
   self:match( 'until' )
-  
   local cond = self:parseExpr()
-  self:outln( 'until %s', cond )
+  self.loops = self.loops - 1
+  return self.tree:node( 'repeat', cond, self.tree:node( 'block', self.tree:list( nodes ) ) )
 end
 
 function M:parseIncStmt()
@@ -1288,7 +1674,7 @@ function M:parseIncStmt()
   end
   
   self:match( ')' )
-  self:outln( '%s = %s + %s', cid, cid, count )
+  return self.tree:node( 'inc', cid, '+', count )
 end
 
 function M:parseDecStmt()
@@ -1303,7 +1689,7 @@ function M:parseDecStmt()
   end
   
   self:match( ')' )
-  self:outln( '%s = %s - %s', cid, cid, count )
+  return self.tree:node( 'inc', cid, '-', count )
 end
 
 function M:parseDecodeDateStmt()
@@ -1318,7 +1704,7 @@ function M:parseDecodeDateStmt()
   local day = self:parseCid()
   self:match( ')' )
   
-  self:outln( '%s, %s, %s = sysutils.decodedate( %s )', day, month, year, time )
+  return self.tree:node( 'decode', 'sysutils.decodedate', time, self.tree:list{ day, month, year } )
 end
 
 function M:parseDecodeTimeStmt()
@@ -1335,7 +1721,7 @@ function M:parseDecodeTimeStmt()
   local msec = self:parseCid()
   self:match( ')' )
   
-  self:outln( '%s, %s, %s, %s = sysutils.decodetime( %s )', hour, min, sec, msec, time )
+  return self.tree:node( 'decode', 'sysutils.decodetime', time, self.tree:list{ hour, min, sec, msec } )
 end
 
 function M:parseWithStmt()
@@ -1346,14 +1732,382 @@ function M:parseInitialization()
   self:match( 'initialization' )
   self:newScope( 'local ', '' )
   
-  while self:token() ~= 'end' do
-    self:parseStatement()
-  end
+  local tree = self.tree
+  self.tree = Ast()
+  
+  local body = self:parseStatementList()
+  self:optimize( self.tree, body )
+  self:emitList( self.tree, body )
+  self:countTree()
+  self.tree = tree
   
   self:match( 'end' )
   self:match( '.' )
 end
 
+-- Emits the statements in the block n.
+function M:emitList( tree, n )
+  local items = tree.items
+  local first = tree.a[ n ]
+  
+  for i = first, first + tree.b[ n ] - 1 do
+    self:emitStatement( tree, items[ i ] )
+  end
+end
+
+function M:emitStatement( tree, n )
+  local kind = tree.kind[ n ]
+  local a, b, c, d, e = tree.a[ n ], tree.b[ n ], tree.c[ n ], tree.d[ n ], tree.e[ n ]
+  
+  if kind == 'call' then
+    self:outindent( '%s', a )
+  elseif kind == 'assign' then
+    self:outindent( '%s = %s', a, b )
+  elseif kind == 'inc' then
+    self:outln( '%s = %s %s %s', a, a, b, c )
+  elseif kind == 'decode' then
+    self:outln( '%s = %s( %s )', table.concat( tree.items, ', ', c, c + d - 1 ), a, b )
+  elseif kind == 'block' then
+    self:emitList( tree, n )
+  elseif kind == 'if' then
+    self:outln( 'if %s then', a )
+    self:indent()
+    self:emitStatement( tree, b )
+    self:unindent()
+    
+    if c then
+      self:outln( 'else' )
+      self:indent()
+      self:emitStatement( tree, c )
+      self:unindent()
+    end
+    
+    self:outln( 'end' )
+  elseif kind == 'case' then
+    self:emitCase( tree, n )
+  elseif kind == 'for' then
+    local down = ( d & forDown ) ~= 0
+    
+    if ( d & forNative ) ~= 0 then
+      self:outln( 'for %s = %s, %s%s do', a, b, c, down and ', -1' or '' )
+      self:indent()
+      self:emitStatement( tree, e )
+    else
+      self:outln( '%s = %s', a, b )
+      self:outln( 'while %s %s %s do', a, down and '>=' or '<=', c )
+      self:indent()
+      self:emitStatement( tree, e )
+      self:outln( '%s = %s %s 1', a, a, down and '-' or '+' )
+    end
+    
+    self:unindent()
+    self:outln( 'end' )
+  elseif kind == 'while' then
+    self:outln( 'while %s do', a )
+    self:indent()
+    self:emitStatement( tree, b )
+    self:unindent()
+    self:outln( 'end' )
+  elseif kind == 'repeat' then
+    self:outln( 'repeat' )
+    self:indent()
+    self:emitList( tree, b )
+    self:unindent()
+    self:outln( 'until %s', a )
+  end
+  
+  self:outln()
+end
+
+-- Integer value of a case label when it's an integer literal, nil otherwise.
+local function caseConstant( value )
+  local digits = value:match( '^%d+$' ) or value:match( '^%( (%-%d+) %)$' )
+  return digits and math.tointeger( tonumber( digits ) )
+end
+
+-- Case statements with at least this many integer intervals are dispatched
+-- with a binary search instead of a chain of comparisons.
+local caseSearchMin = 6
+
+function M:caseCondition( sel, interval )
+  if interval.lo == interval.hi then
+    return string.format( '( %s == %s )', sel, interval.lo )
+  else
+    return string.format( '( %s >= %s and %s <= %s )', sel, interval.lo, sel, interval.hi )
+  end
+end
+
+-- Binary search over the sorted, disjoint intervals first..last, with short
+-- chains at the leaves. leaf emits what runs when an interval matches.
+function M:caseSearch( sel, intervals, first, last, leaf )
+  if last - first < 3 then
+    local stmt = 'if'
+    
+    for i = first, last do
+      self:outln( '%s %s then', stmt, self:caseCondition( sel, intervals[ i ] ) )
+      self:indent()
+      leaf( intervals[ i ] )
+      self:unindent()
+      stmt = 'elseif'
+    end
+    
+    self:outln( 'end' )
+  else
+    local middle = ( first + last + 1 ) // 2
+    
+    self:outln( 'if %s < %s then', sel, intervals[ middle ].lo )
+    self:indent()
+    self:caseSearch( sel, intervals, first, middle - 1, leaf )
+    self:unindent()
+    self:outln( 'else' )
+    self:indent()
+    self:caseSearch( sel, intervals, middle, last, leaf )
+    self:unindent()
+    self:outln( 'end' )
+  end
+end
+
+function M:emitCase( tree, n )
+  local items = tree.items
+  local cid, otherwise = tree.a[ n ], tree.d[ n ]
+  
+  -- how the arms are dispatched depends on all the labels
+  local arms = {}
+  local intervals = {}
+  local ranges = false
+  local search = true
+  
+  for i = tree.b[ n ], tree.b[ n ] + tree.c[ n ] - 1 do
+    local node = items[ i ]
+    local arm = { index = #arms + 1, intervals = {}, body = tree.c[ node ] }
+    
+    for j = tree.a[ node ], tree.a[ node ] + tree.b[ node ] - 1 do
+      local label = items[ j ]
+      local lo, hi = tree.a[ label ], tree.b[ label ] or tree.a[ label ]
+      local interval = { lo = lo, hi = hi, low = caseConstant( lo ), high = caseConstant( hi ), arm = arm }
+      
+      ranges = ranges or tree.b[ label ] ~= false
+      search = search and interval.low ~= nil and interval.high ~= nil
+      arm.intervals[ #arm.intervals + 1 ] = interval
+      intervals[ #intervals + 1 ] = interval
+    end
+    
+    arms[ #arms + 1 ] = arm
+  end
+  
+  -- Only disjoint integer intervals can be searched.
+  search = search and #intervals >= caseSearchMin
+  
+  if search then
+    table.sort( intervals, function( a, b ) return a.low < b.low end )
+    
+    for i = 1, #intervals do
+      local interval = intervals[ i ]
+      
+      if interval.low > interval.high or ( i > 1 and interval.low <= intervals[ i - 1 ].high ) then
+        search = false
+        break
+      end
+    end
+  end
+  
+  -- The selector is evaluated once, unless it's already a local. The locals
+  -- go in a block of their own, so case statements don't add up to Lua's
+  -- limit on the locals of a function.
+  local sel = cid
+  local copy = not cid:match( '^[%a_][%w_]*$' ) and ( search or ranges or #intervals > 1 )
+  local dispatch = search and not ( not otherwise and #arms == #intervals )
+  local block = copy or dispatch
+  
+  if block then
+    self:outln( 'do' )
+    self:indent()
+  end
+  
+  if copy then
+    sel = '__sel'
+    self:outln( 'local %s = %s', sel, cid )
+  end
+  
+  if not search then
+    local stmt = 'if'
+    
+    for _, arm in ipairs( arms ) do
+      local conds = {}
+      
+      for i, interval in ipairs( arm.intervals ) do
+        conds[ i ] = self:caseCondition( sel, interval )
+      end
+      
+      self:outindent( stmt )
+      self:out( ' %s then', table.concat( conds, ' or ' ) )
+      self:outln()
+      self:indent()
+      self:emitStatement( tree, arm.body )
+      self:unindent()
+      self:outln()
+      stmt = 'elseif'
+    end
+    
+    if otherwise then
+      if arms[ 1 ] then
+        self:outln( 'else' )
+        self:indent()
+        self:emitList( tree, otherwise )
+        self:unindent()
+        self:outln()
+      else
+        self:emitList( tree, otherwise )
+      end
+    end
+    
+    if arms[ 1 ] then
+      self:outln( 'end' )
+    end
+  elseif not dispatch then
+    -- One interval per arm and nothing else to run: bodies go at the leaves.
+    self:caseSearch( sel, intervals, 1, #intervals, function( interval )
+      self:emitStatement( tree, interval.arm.body )
+    end )
+  else
+    -- Find the arm first, then run its body, so no body is emitted twice.
+    self:outln( 'local __arm = 0' )
+    self:caseSearch( sel, intervals, 1, #intervals, function( interval )
+      self:outln( '__arm = %d', interval.arm.index )
+    end )
+    
+    local indices = {}
+    
+    for i, arm in ipairs( arms ) do
+      indices[ i ] = { lo = i, hi = i, arm = arm }
+    end
+    
+    if otherwise then
+      table.insert( indices, 1, { lo = 0, hi = 0, arm = { body = otherwise, list = true } } )
+    end
+    
+    self:caseSearch( '__arm', indices, 1, #indices, function( interval )
+      if interval.arm.list then
+        self:emitList( tree, interval.arm.body )
+      else
+        self:emitStatement( tree, interval.arm.body )
+      end
+    end )
+  end
+  
+  if block then
+    self:unindent()
+    self:outln( 'end' )
+  end
+end
+
+-- Lua source for a constant, nil when it can't be written as a literal.
+local function literal( value )
+  local kind = type( value )
+  local str
+  
+  if kind == 'boolean' then
+    return tostring( value )
+  elseif kind == 'string' then
+    -- long strings drop a leading newline and turn \r into \n, so only
+    -- printable values are written as one, the rest are quoted on one line
+    if value:find( '[%]%c]' ) then
+      return ( string.format( '%q', value ):gsub( '\\\n', '\\n' ) )
+    end
+    
+    return string.format( '[[%s]]', value )
+  elseif math.type( value ) == 'integer' then
+    if value == math.mininteger then
+      return nil
+    end
+    
+    str = string.format( '%d', value )
+  elseif kind == 'number' then
+    if value ~= value or value == math.huge or value == -math.huge then
+      return nil
+    end
+    
+    str = string.format( '%.17g', value )
+    
+    if not str:find( '[%.e]' ) then
+      str = str .. '.0'
+    end
+  else
+    return nil
+  end
+  
+  if str:sub( 1, 1 ) == '-' then
+    str = string.format( '( %s )', str )
+  end
+  
+  return str
+end
+
+-- What the Lua operators compute, used to fold them at compile time.
+local folds = {
+  [ '==' ] = function( a, b ) return a == b end,
+  [ '~=' ] = function( a, b ) return a ~= b end,
+  [ '<' ] = function( a, b ) return a < b end,
+  [ '>' ] = function( a, b ) return a > b end,
+  [ '<=' ] = function( a, b ) return a <= b end,
+  [ '>=' ] = function( a, b ) return a >= b end,
+  [ '+' ] = function( a, b ) return a + b end,
+  [ '-' ] = function( a, b ) return a - b end,
+  [ '*' ] = function( a, b ) return a * b end,
+  [ '/' ] = function( a, b ) return a / b end,
+  [ '//' ] = function( a, b ) return a // b end,
+  [ '%' ] = function( a, b ) return a % b end,
+  [ '^' ] = function( a, b ) return a ^ b end,
+  [ '..' ] = function( a, b ) return a .. b end,
+  [ '&' ] = function( a, b ) return a & b end,
+  [ '|' ] = function( a, b ) return a | b end,
+  [ '~' ] = function( a, b ) return a ~ b end,
+  [ 'and' ] = function( a, b ) return a and b end,
+  [ 'or' ] = function( a, b ) return a or b end
+}
+
+-- Evaluates func over constants, returns the result and its literal, or
+-- nothing if it fails (i.e. integer division by zero) or has no literal.
+local function fold( func, ... )
+  local ok, value = pcall( func, ... )
+  
+  if ok then
+    local str = literal( value )
+    
+    if str then
+      return value, str
+    end
+  end
+end
+
+-- Translates a binary operation into the Lua operator op, or into its result
+-- when both operands are constants.
+function M:binary( op, type, value1, def1, value2, def2 )
+  if def1.const ~= nil and def2.const ~= nil then
+    local const, str = fold( folds[ op ], def1.const, def2.const )
+    
+    if str then
+      return str, { type = type, const = const }
+    end
+  end
+  
+  return string.format( '( %s %s %s )', value1, op, value2 ), { type = type }
+end
+
+-- Translates a call to a builtin function, or its result when the argument
+-- is a constant.
+function M:foldCall( format, func, type, value, def )
+  if def.const ~= nil then
+    local const, str = fold( func, def.const )
+    
+    if str then
+      return str, { type = type, const = const }
+    end
+  end
+  
+  return string.format( format, value ), { type = type }
+end
+
 function M:parseExpr()
   return self:parseRelational()
 end
@@ -1368,8 +2122,7 @@ function M:parseRelational()
     self:match()
     
     local value2, def2 = self:parseAdd()
-    value1 = string.format( '( %s %s %s )', value1, ops[ token ], value2 )
-    def1 = { type = 'boolean' }
+    value1, def1 = self:binary( ops[ token ], 'boolean', value1, def1, value2, def2 )
     
     token = self:token()
   end
@@ -1390,31 +2143,25 @@ function M:parseAdd()
     
     if token == 'or' then
       if def1.type == 'integer' and def2.type == 'integer' then
-        value1 = string.format( '( %s | %s )', value1, value2 )
-        def1 = { type = 'integer' }
+        value1, def1 = self:binary( '|', 'integer', value1, def1, value2, def2 )
       else
-        value1 = string.format( '( %s or %s )', value1, value2 )
-        def1 = { type = 'boolean' }
+        value1, def1 = self:binary( 'or', 'boolean', value1, def1, value2, def2 )
       end
     elseif token == 'xor' then
       if def1.type == 'integer' and def2.type == 'integer' then
-        value1 = string.format( '( %s ~ %s )', value1, value2 )
-        def1 = { type = 'integer' }
+        value1, def1 = self:binary( '~', 'integer', value1, def1, value2, def2 )
       else
-        value1 = string.format( '( ( %s and not %s ) or ( not %s and %s ) )', value1, value2, value1, value2 )
-        def1 = { type = 'boolean' }
+        -- booleans are always true or false, so xor is inequality
+        value1, def1 = self:binary( '~=', 'boolean', value1, def1, value2, def2 )
       end
     elseif token == '+' then
       if ( def1.type == 'string' or def1.type == 'char' ) and ( def2.type == 'string' or def2.type == 'char' ) then
-        value1 = string.format( '( %s .. %s )', value1, value2 )
-        def1 = { type = 'string' }
+        value1, def1 = self:binary( '..', 'string', value1, def1, value2, def2 )
       else
-        value1 = string.format( '( %s + %s )', value1, value2 )
-        def1 = { type = ( def1.type == 'fp' or def2.type == 'fp' ) and 'fp' or 'integer' }
+        value1, def1 = self:binary( '+', ( def1.type == 'fp' or def2.type == 'fp' ) and 'fp' or 'integer', value1, def1, value2, def2 )
       end
     else
-      value1 = string.format( '( %s %s %s )', value1, ops[ token ], value2 )
-      def1 = { type = 'integer' }
+      value1, def1 = self:binary( ops[ token ], ( def1.type == 'fp' or def2.type == 'fp' ) and 'fp' or 'integer', value1, def1, value2, def2 )
     end
     
     token = self:token()
@@ -1436,15 +2183,14 @@ function M:parseMultiply()
     
     if token == 'and' then
       if def1.type == 'integer' and def2.type == 'integer' then
-        value1 = string.format( '( %s & %s )', value1, value2 )
-        def1 = { type = 'integer' }
+        value1, def1 = self:binary( '&', 'integer', value1, def1, value2, def2 )
       else
-        value1 = string.format( '( %s and %s )', value1, value2 )
-        def1 = { type = 'boolean' }
+        value1, def1 = self:binary( 'and', 'boolean', value1, def1, value2, def2 )
       end
+    elseif token == '/' then
+      value1, def1 = self:binary( '/', 'fp', value1, def1, value2, def2 )
     else
-      value1 = string.format( '( %s %s %s )', value1, ops[ token ], value2 )
-      def1 = { type = 'integer' }
+      value1, def1 = self:binary( ops[ token ], ( def1.type == 'fp' or def2.type == 'fp' ) and 'fp' or 'integer', value1, def1, value2, def2 )
     end
     
     token = self:token()
@@ -1459,11 +2205,28 @@ function M:parseUnary()
   if token == 'not' then
     self:match()
     local value, def = self:parseTerminal()
-    return string.format( '( not %s )', value ), def
+    
+    if def.type == 'integer' then
+      -- not is bitwise on integers, as and, or and xor
+      return self:foldCall( '( ~%s )', function( a ) return ~a end, 'integer', value, def )
+    elseif type( def.const ) == 'boolean' then
+      return tostring( not def.const ), { type = 'boolean', const = not def.const }
+    end
+    
+    return string.format( '( not %s )', value ), { type = def.type }
   elseif token == '-' then
     self:match()
     local value, def = self:parseTerminal()
-    return string.format( '( -%s )', value ), def
+    
+    if def.const ~= nil then
+      local const, str = fold( function( a ) return -a end, def.const )
+      
+      if str then
+        return str, { type = def.type, const = const }
+      end
+    end
+    
+    return string.format( '( -%s )', value ), { type = def.type }
   else
     return self:parseTerminal()
   end
@@ -1475,26 +2238,26 @@ function M:parseTerminal()
   if token == 'integer' then
     local value = self:lexeme()
     self:match()
-    return value, { type = 'integer' }
+    return value, { type = 'integer', const = math.tointeger( tonumber( value ) ) }
   elseif token == 'fp' then
     local value = self:lexeme()
     self:match()
-    return value, { type = 'fp' }
+    return value, { type = 'fp', const = tonumber( value ) }
   elseif token == 'nil' then
     self:match()
     return 'nil', { type = 'nil' }
   elseif token == 'true' or token == 'false' then
     local value = self:lexeme()
     self:match()
-    return value, { type = 'boolean' }
+    return value, { type = 'boolean', const = token == 'true' }
   elseif token == 'string' then
-    local value = self.tokens[ self.pos ].lexeme
+    local value = self.tokens:lexeme( self.pos )
     self:match()
-    return string.format( '[[%s]]', value ), { type = 'string' }
+    return literal( value ), { type = 'string', const = value }
   elseif token == 'char' then
     local value = self:lexeme()
     self:match()
-    return string.format( '[[%s]]', value ), { type = 'char' }
+    return literal( value ), { type = 'char', const = value }
   elseif token == 'ord' then
     self:match()
     self:match( '(' )
@@ -1502,42 +2265,42 @@ function M:parseTerminal()
     self:match( ')' )
     
     if def.type == 'boolean' then
-      return string.format( '( %s and 1 or 0 )', value ), { type = 'integer' }
+      return self:foldCall( '( %s and 1 or 0 )', function( a ) return a and 1 or 0 end, 'integer', value, def )
     else
       return value, def
     end
   elseif token == 'odd' then
     self:match()
     self:match( '(' )
-    local value = self:parseExpr()
+    local value, def = self:parseExpr()
     self:match( ')' )
-    return string.format( '( %s & 1 ~= 0 )', value ), { type = 'boolean' }
+    return self:foldCall( '( ( %s & 1 ) ~= 0 )', function( a ) return a & 1 ~= 0 end, 'boolean', value, def )
   elseif token == 'chr' then
     self:match()
     self:match( '(' )
-    local value = self:parseExpr()
+    local value, def = self:parseExpr()
     self:match( ')' )
-    return string.format( '( string.char%s )', value ), { type = 'char' }
+    return self:foldCall( '( string.char( %s ) )', string.char, 'char', value, def )
   elseif token == 'trunc' then
     self:match()
     self:match( '(' )
-    local value = self:parseExpr()
+    local value, def = self:parseExpr()
     self:match( ')' )
-    return string.format( '( math.floor%s )', value ), { type = 'integer' }
+    return self:foldCall( '( math.floor( %s ) )', math.floor, 'integer', value, def )
   elseif token == 'abs' then
     self:match()
     self:match( '(' )
-    local value = self:parseExpr()
+    local value, def = self:parseExpr()
     self:match( ')' )
-    return string.format( '( math.abs%s )', value ), { type = 'integer' }
+    return self:foldCall( '( math.abs( %s ) )', math.abs, 'integer', value, def )
   elseif token == 'power' then
     self:match()
     self:match( '(' )
-    local base = self:parseExpr()
+    local base, def1 = self:parseExpr()
     self:match( ',' )
-    local exp = self:parseExpr()
+    local exp, def2 = self:parseExpr()
     self:match( ')' )
-    return string.format( '( %s ^ %s )', base, exp ), { type = 'fp' }
+    return self:binary( '^', 'fp', base, def1, exp, def2 )
   elseif token == 'self' then
     self:match()
     return
@@ -1549,6 +2312,7 @@ function M:parseTerminal()
       local cid2, def2 = self:parseCid()
       return string.format( '( %s[ %s%s ] )', cid2, self:declared( cid2 ), cid ), { type = 'boolean' }
     elseif self:token() == '(' then
+      self:call( def )
       self:match()
       local args = { ( self:parseExpr() ) }
       
@@ -1560,7 +2324,10 @@ function M:parseTerminal()
       self:match( ')' )
       return string.format( '( %s( %s ) )', cid, table.concat( args, ', ' ) ), { type = def.type }
     elseif def.type == 'function' then
+      self:call( def )
       return string.format( '( %s() )', cid ), def
+    elseif def.const ~= nil and literal( def.const ) then
+      return literal( def.const ), def
     else
       return string.format( '( %s )', cid ), def
     end
@@ -1583,6 +2350,11 @@ function M:parseTerminal()
     self:match()
     local value, def = self:parseExpr()
     self:match( ')' )
+    
+    if def.const ~= nil then
+      return value, def
+    end
+    
     return string.format( '( %s )', value ), def
   end
   
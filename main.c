@@ -1,228 +1,128 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <lua.h>
-#include <lauxlib.h>
-#include <lualib.h>
 
-#include "lexer.h"
+#include "translator.h"
+#include "batch.h"
+#include "watch.h"
+#include "cache.h"
+#include "stats.h"
 
-#include "lua/class.h"
-#include "lua/parser.h"
-#include "lua/dfm2pas.h"
-#include "lua/main.h"
-
-#include "units/classes.h"
-#include "units/controls.h"
-#include "units/dialogs.h"
-#include "units/extctrls.h"
-#include "units/fmod.h"
-#include "units/fmodtypes.h"
-#include "units/forms.h"
-#include "units/graphics.h"
-#include "units/jpeg.h"
-#include "units/math.h"
-#include "units/messages.h"
-#include "units/registry.h"
-#include "units/stdctrls.h"
-#include "units/system.h"
-#include "units/sysutils.h"
-#include "units/windows.h"
-
-static void dump_stack( lua_State* L )
+int main( int argc, const char* argv[] )
 {
-  int top = lua_gettop( L );
-  int i;
-  
-  for ( i = 1; i <= top; i++ )
+  /* --cache <dir>, --units <path>, --no-hoist, --lazy, --stats <file> and
+     --arena go before everything else, PAS2LUA_CACHE and PAS2LUA_UNITS are used
+     otherwise. */
+  const char* cache = getenv( "PAS2LUA_CACHE" );
+  const char* units = getenv( "PAS2LUA_UNITS" );
+  const char* stats = NULL;
+  unsigned options = 0;
+  
+  while ( argc > 1 )
   {
-    printf( "%2d %3d ", i, i - top - 1 );
-    
-    lua_pushvalue( L, i );
+    int used = 2;
     
-    switch ( lua_type( L, -1 ) )
+    if ( argc > 2 && !strcmp( argv[ 1 ], "--cache" ) )
+    {
+      cache = argv[ 2 ];
+    }
+    else if ( argc > 2 && !strcmp( argv[ 1 ], "--units" ) )
+    {
+      units = argv[ 2 ];
+    }
+    else if ( argc > 2 && !strcmp( argv[ 1 ], "--stats" ) )
+    {
+      stats = argv[ 2 ];
+      options |= TRANSLATOR_STATS;
+    }
+    else if ( !strcmp( argv[ 1 ], "--arena" ) )
+    {
+      options |= TRANSLATOR_ARENA;
+      used = 1;
+    }
+    else if ( !strcmp( argv[ 1 ], "--no-hoist" ) )
+    {
+      options |= TRANSLATOR_NO_HOIST;
+      used = 1;
+    }
+    else if ( !strcmp( argv[ 1 ], "--lazy" ) )
+    {
+      options |= TRANSLATOR_LAZY;
+      used = 1;
+    }
+    else
     {
-    case LUA_TNIL:
-      printf( "nil\n" );
-      break;
-    case LUA_TNUMBER:
-      printf( "%e\n", lua_tonumber( L, -1 ) );
-      break;
-    case LUA_TBOOLEAN:
-      printf( "%s\n", lua_toboolean( L, -1 ) ? "true" : "false" );
-      break;
-    case LUA_TSTRING:
-      printf( "\"%s\"\n", lua_tostring( L, -1 ) );
-      break;
-    case LUA_TTABLE:
-      printf( "table\n" );
-      break;
-    case LUA_TFUNCTION:
-      printf( "function\n" );
-      break;
-    case LUA_TUSERDATA:
-      printf( "userdata\n" );
-      break;
-    case LUA_TTHREAD:
-      printf( "thread\n" );
-      break;
-    case LUA_TLIGHTUSERDATA:
-      printf( "light userdata\n" );
-      break;
-    default:
-      printf( "?\n" );
       break;
     }
+    
+    argv[ used ] = argv[ 0 ];
+    argv += used;
+    argc -= used;
   }
   
-  lua_settop( L, top );
-}
-
-static unsigned djb2( const char* str )
-{
-  const unsigned char* aux = (const unsigned char*)str;
-  unsigned hash = 5381;
+  translator_options( options );
   
-  while ( *aux )
+  if ( units != NULL && *units != 0 && translator_units( units ) != 0 )
   {
-    hash = ( hash << 5 ) + hash + *aux++;
+    fprintf( stderr, "Could not read the units in %s\n", units );
+    return 1;
   }
   
-  return hash;
-}
-
-static int do_buffer( lua_State* L, const char* buffer, size_t buffer_size, const char* chunk_name, int ret_count )
-{
-  if ( luaL_loadbuffer( L, buffer, buffer_size, chunk_name ) != 0 )
+  /* Watching translates again when the stubs change, which the cache wouldn't notice. */
+  if ( argc > 1 && !strcmp( argv[ 1 ], "--watch" ) )
   {
-    return lua_error( L );
+    return watch_main( argc, argv, units );
   }
   
-  lua_call( L, 0, ret_count );
-  return ret_count;
-}
-
-static int load_unit( lua_State* L )
-{
-  const char* name = luaL_checkstring( L, 1 );
-  
-  switch ( djb2( name ) )
+  if ( cache != NULL && *cache != 0 && translator_cache( cache ) != 0 )
   {
-  case 0xcb8e8f13U: // classes
-    return do_buffer( L, units_classes_lua, sizeof( units_classes_lua ), name, 1 );
-  case 0x42b3ee19U: // controls
-    return do_buffer( L, units_controls_lua, sizeof( units_controls_lua ), name, 1 );
-  case 0x11856a88U: // dialogs
-    return do_buffer( L, units_dialogs_lua, sizeof( units_dialogs_lua ), name, 1 );
-  case 0xdcd0335eU: // extctrls
-    return do_buffer( L, units_extctrls_lua, sizeof( units_extctrls_lua ), name, 1 );
-  case 0x7c96dc8bU: // fmod
-    return do_buffer( L, units_fmod_lua, sizeof( units_fmod_lua ), name, 1 );
-  case 0x45f4c9a0U: // fmodtypes
-    return do_buffer( L, units_fmodtypes_lua, sizeof( units_fmodtypes_lua ), name, 1 );
-  case 0x0f73950cU: // forms
-    return do_buffer( L, units_forms_lua, sizeof( units_forms_lua ), name, 1 );
-  case 0xbc08ef36U: // graphics
-    return do_buffer( L, units_graphics_lua, sizeof( units_graphics_lua ), name, 1 );
-  case 0x7c99198bU: // jpeg
-    return do_buffer( L, units_jpeg_lua, sizeof( units_jpeg_lua ), name, 1 );
-  case 0x7c9a80cfU: // math
-    return do_buffer( L, units_math_lua, sizeof( units_math_lua ), name, 1 );
-  case 0x870e1c9dU: // messages
-    return do_buffer( L, units_messages_lua, sizeof( units_messages_lua ), name, 1 );
-  case 0x07ae803eU: // registry
-    return do_buffer( L, units_registry_lua, sizeof( units_registry_lua ), name, 1 );
-  case 0x6f2e5a98U: // stdctrls
-    return do_buffer( L, units_stdctrls_lua, sizeof( units_stdctrls_lua ), name, 1 );
-  case 0x1ceee48aU: // system
-    return do_buffer( L, units_system_lua, sizeof( units_system_lua ), name, 1 );
-  case 0x14547e95U: // sysutils
-    return do_buffer( L, units_sysutils_lua, sizeof( units_sysutils_lua ), name, 1 );
-  case 0xc8feca70U: // windows
-    return do_buffer( L, units_windows_lua, sizeof( units_windows_lua ), name, 1 );
+    fprintf( stderr, "Could not use %s as the cache directory\n", cache );
+    return 1;
   }
   
-  return luaL_error( L, "unit %s not found", name );
-}
+  if ( argc > 1 && !strcmp( argv[ 1 ], "--batch" ) )
+  {
+    return batch_main( argc, argv, stats );
+  }
 
-static int lua_main( lua_State* L )
-{
-  /* Register the builtin searcher */
-  lua_pushcfunction( L, load_unit );
-  lua_setglobal( L, "loadunit" );
-  
-  /* Load lexer. */
-  /*luaL_requiref( L, "lexer", luaopen_lexer, 1 );*/
-  luaopen_lexer( L );
-  lua_setglobal( L, "lexer" );
-  
-  do_buffer( L, lua_class_lua, sizeof( lua_class_lua ), "class.lua", 1 );
-  lua_setglobal( L, "class" );
-  
-  do_buffer( L, lua_dfm2pas_lua, sizeof( lua_dfm2pas_lua ), "dfm2pas.lua", 1 );
-  lua_setglobal( L, "dfm2pas" );
-  
-  do_buffer( L, lua_parser_lua, sizeof( lua_parser_lua ), "parser.lua", 1 );
-  lua_setglobal( L, "Parser" );
-  
-  /* Run required files, main.lua returns a function which is the main function. */
-  do_buffer( L, lua_main_lua, sizeof( lua_main_lua ), "main.lua", 1 );
+  /* Create the state. */
+  char error[ 4096 ];
+  lua_State* L = translator_new( error, sizeof( error ) );
 
-  /* Get the upvalues and create a table with the arguments passed on the command line. */
-  int argc = (int)lua_tonumber( L, lua_upvalueindex( 1 ) );
-  const char** argv = (const char**)lua_touserdata( L, lua_upvalueindex( 2 ) );
-  
-  lua_newtable( L );
-  int i;
-  
-  for ( i = 1; i < argc; i++ )
+  if ( L == NULL )
   {
-    lua_pushstring( L, argv[ i ] );
-    lua_rawseti( L, -2, i );
+    fprintf( stderr, "%s", error );
+    return 1;
   }
-  
-  /* Run the main function and return. */
-  lua_call( L, 1, 1 );
-  luaL_checkinteger( L, -1 );
-  return 1;
-}
-
-static int traceback( lua_State* L )
-{
-  /* Change the error into a detailed stack trace. */
-  luaL_traceback( L, L, lua_tostring( L, -1 ), 1 );
-  return 1;
-}
 
-int main( int argc, const char* argv[] )
-{
-  /* Create the state. */
-  lua_State* L = luaL_newstate();
-  
-  /* Open the standard libraries and clean the stack. */
-  int top = lua_gettop( L );
-  luaL_openlibs( L );
-  lua_settop( L, top );
-  
-  /* Put the traceback function on the stack. */
-  lua_pushcfunction( L, traceback );
-  
-  /* Create a closure with argc and argv. */
-  lua_pushnumber( L, argc );
-  lua_pushlightuserdata( L, (void*)argv );
-  lua_pushcclosure( L, lua_main, 2 );
-  
-  /* Call main_lua. */
-  int ret = 0;
+  /* Call the main function with the arguments passed on the command line. */
+  int ret = translator_run( L, argc - 1, argv + 1, error, sizeof( error ) );
 
-  if ( lua_pcall( L, 0, 1, -2 ) == /*LUA_OK*/ 0 )
+  if ( ret != 0 && *error != 0 )
   {
-    ret = lua_tointeger( L, -1 );
+    fprintf( stderr, "%s", error );
   }
-  else
+
+  if ( stats != NULL && argc == 4 )
   {
-    fprintf( stderr, "%s", lua_tostring( L, -1 ) );
-    ret = 1;
+    FILE* file = stats_open( stats );
+
+    if ( file == NULL )
+    {
+      fprintf( stderr, "Error writing to %s\n", stats );
+      ret = 1;
+    }
+    else
+    {
+      stats_write( file, translator_stats( L ), argv[ 1 ], ret );
+      fputc( '\n', file );
+      stats_close( file );
+    }
   }
-  
+
+  translator_close( L );
+  cache_report( stdout );
   return ret;
 }
@@ -0,0 +1,492 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include "lexer.h"
+#include "cpu.h"
+#include "rle.h"
+
+#define GROUP_NAME "rle_group_t"
+
+#define MAX_ENCODERS 16
+#define OUT_SIZE     65536
+
+/* Resources are encoded and written by a pool of threads shared by all Lua
+   states. The queue is bounded so that only a few decoded resources are in
+   memory at any time, saving blocks when it's full. */
+typedef struct group_t group_t;
+
+struct group_t
+{
+  int      pending;
+  char     error[ 512 ];
+  group_t* target;   /* where the data is saved instead, see rle_push_group */
+};
+
+typedef struct job_t job_t;
+
+struct job_t
+{
+  job_t*         next;
+  group_t*       group;
+  unsigned char* data;
+  size_t         size;
+  char*          path;
+};
+
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t  queued;  /* a job was added to the queue */
+  pthread_cond_t  dequeued;/* a job was removed from the queue */
+  pthread_cond_t  done;    /* a job was finished */
+  job_t*          head;
+  job_t*          tail;
+  int             count;
+  int             capacity;
+  int             threads;
+  unsigned        serial;
+}
+pool =
+{
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  NULL, NULL, 0, 0, 0, 0
+};
+
+typedef struct
+{
+  FILE*         file;
+  unsigned char buffer[ OUT_SIZE ];
+  size_t        used;
+  int           error;
+}
+out_t;
+
+static void flush( out_t* out )
+{
+  if ( out->error == 0 && fwrite( out->buffer, 1, out->used, out->file ) != out->used )
+  {
+    out->error = errno != 0 ? errno : EIO;
+  }
+  
+  out->used = 0;
+}
+
+static void put( out_t* out, const unsigned char* data, size_t size )
+{
+  if ( out->used + size > OUT_SIZE )
+  {
+    flush( out );
+  }
+  
+  memcpy( out->buffer + out->used, data, size );
+  out->used += size;
+}
+
+/* PackBits: a control byte c from 0 to 127 is followed by c + 1 literal
+   bytes, from 129 to 255 by one byte repeated 257 - c times. Runs of three or
+   more equal bytes are repeated, everything else goes into literals. */
+static void encode( out_t* out, const unsigned char* data, size_t size )
+{
+  unsigned char header[ 4 ] =
+  {
+    (unsigned char)size, (unsigned char)( size >> 8 ), (unsigned char)( size >> 16 ), (unsigned char)( size >> 24 )
+  };
+  
+  put( out, header, 4 );
+  
+  size_t i = 0, literal = 0;
+  
+  while ( i < size )
+  {
+    size_t run = 1;
+    
+    while ( i + run < size && run < 128 && data[ i + run ] == data[ i ] )
+    {
+      run++;
+    }
+    
+    if ( run >= 3 )
+    {
+      if ( literal != 0 )
+      {
+        unsigned char control = (unsigned char)( literal - 1 );
+        put( out, &control, 1 );
+        put( out, data + i - literal, literal );
+        literal = 0;
+      }
+      
+      unsigned char repeat[ 2 ] = { (unsigned char)( 257 - run ), data[ i ] };
+      put( out, repeat, 2 );
+      i += run;
+    }
+    else
+    {
+      i += run;
+      literal += run;
+      
+      if ( literal >= 128 )
+      {
+        unsigned char control = 127;
+        put( out, &control, 1 );
+        put( out, data + i - literal, 128 );
+        literal -= 128;
+      }
+    }
+  }
+  
+  if ( literal != 0 )
+  {
+    unsigned char control = (unsigned char)( literal - 1 );
+    put( out, &control, 1 );
+    put( out, data + size - literal, literal );
+  }
+}
+
+static int write_job( job_t* job, unsigned serial )
+{
+  /* Units translated in the same batch can extract to the same path, each
+     file is written under a temporary name and then renamed over it. */
+  size_t size = strlen( job->path ) + 32;
+  char* temp = (char*)malloc( size );
+  out_t* out = (out_t*)malloc( sizeof( out_t ) );
+  
+  if ( temp == NULL || out == NULL )
+  {
+    free( temp );
+    free( out );
+    return ENOMEM;
+  }
+  
+  snprintf( temp, size, "%s.%u.tmp", job->path, serial );
+  out->used = 0;
+  out->error = 0;
+  out->file = fopen( temp, "wb" );
+  
+  if ( out->file == NULL )
+  {
+    out->error = errno;
+  }
+  else
+  {
+    encode( out, job->data, job->size );
+    flush( out );
+    
+    if ( fclose( out->file ) != 0 && out->error == 0 )
+    {
+      out->error = errno != 0 ? errno : EIO;
+    }
+    
+#ifdef _WIN32
+    /* rename doesn't replace existing files on Windows. */
+    remove( job->path );
+#endif
+    
+    if ( out->error == 0 && rename( temp, job->path ) != 0 )
+    {
+      out->error = errno;
+    }
+    
+    if ( out->error != 0 )
+    {
+      remove( temp );
+    }
+  }
+  
+  int error = out->error;
+  free( out );
+  free( temp );
+  return error;
+}
+
+static void free_job( job_t* job )
+{
+  if ( job != NULL )
+  {
+    free( job->data );
+    free( job->path );
+    free( job );
+  }
+}
+
+static void* worker( void* arg )
+{
+  ( void )arg;
+  
+  for ( ;; )
+  {
+    pthread_mutex_lock( &pool.lock );
+    
+    while ( pool.head == NULL )
+    {
+      pthread_cond_wait( &pool.queued, &pool.lock );
+    }
+    
+    job_t* job = pool.head;
+    
+    if ( ( pool.head = job->next ) == NULL )
+    {
+      pool.tail = NULL;
+    }
+    
+    pool.count--;
+    unsigned serial = pool.serial++;
+    pthread_cond_signal( &pool.dequeued );
+    pthread_mutex_unlock( &pool.lock );
+    
+    int error = write_job( job, serial );
+    
+    pthread_mutex_lock( &pool.lock );
+    
+    if ( error != 0 && job->group->error[ 0 ] == 0 )
+    {
+      snprintf( job->group->error, sizeof( job->group->error ), "Error writing to %s: %s", job->path, strerror( error ) );
+    }
+    
+    job->group->pending--;
+    pthread_cond_broadcast( &pool.done );
+    pthread_mutex_unlock( &pool.lock );
+    
+    free_job( job );
+  }
+  
+  return NULL;
+}
+
+static void start_workers( void )
+{
+  /* Called with the lock held. */
+  int count = cpu_count();
+  
+  if ( count > MAX_ENCODERS )
+  {
+    count = MAX_ENCODERS;
+  }
+  
+  while ( pool.threads < count )
+  {
+    pthread_t thread;
+    
+    if ( pthread_create( &thread, NULL, worker, NULL ) != 0 )
+    {
+      break;
+    }
+    
+    pthread_detach( thread );
+    pool.threads++;
+  }
+  
+  pool.capacity = pool.threads;
+}
+
+static int submit( group_t* group, job_t* job )
+{
+  pthread_mutex_lock( &pool.lock );
+  
+  if ( pool.threads == 0 )
+  {
+    start_workers();
+    
+    if ( pool.threads == 0 )
+    {
+      pthread_mutex_unlock( &pool.lock );
+      return -1;
+    }
+  }
+  
+  while ( pool.count >= pool.capacity )
+  {
+    pthread_cond_wait( &pool.dequeued, &pool.lock );
+  }
+  
+  job->group = group;
+  job->next = NULL;
+  
+  if ( pool.tail != NULL )
+  {
+    pool.tail->next = job;
+  }
+  else
+  {
+    pool.head = job;
+  }
+  
+  pool.tail = job;
+  pool.count++;
+  group->pending++;
+  pthread_cond_signal( &pool.queued );
+  pthread_mutex_unlock( &pool.lock );
+  return 0;
+}
+
+static void wait_group( group_t* group )
+{
+  pthread_mutex_lock( &pool.lock );
+  
+  while ( group->pending != 0 )
+  {
+    pthread_cond_wait( &pool.done, &pool.lock );
+  }
+  
+  pthread_mutex_unlock( &pool.lock );
+}
+
+static group_t* check_group( lua_State* L, int index )
+{
+  return (group_t*)luaL_checkudata( L, index, GROUP_NAME );
+}
+
+/* Pushes the class name in the header of the data, see stream:hexdecode, and
+   returns whether it's one of the keys of the table at index classes. */
+static int push_class( lua_State* L, int classes, const unsigned char* data, size_t size )
+{
+  if ( size == 0 || data[ 0 ] == 0 || data[ 0 ] >= size )
+  {
+    lua_pushnil( L );
+    return 0;
+  }
+  
+  lua_pushlstring( L, (const char*)data + 1, data[ 0 ] );
+  lua_pushvalue( L, -1 );
+  lua_gettable( L, classes );
+  int found = lua_toboolean( L, -1 );
+  lua_pop( L, 1 );
+  return found;
+}
+
+/* group:save( stream, index, path, classes ) decodes the hexadecimal data in
+   the token at index, and queues it to be run-length encoded and written to
+   path. The data must start with the name of one of the keys in classes,
+   which is returned. */
+static int group_save( lua_State* L )
+{
+  group_t* self = check_group( L, 1 );
+  lua_Integer index = luaL_checkinteger( L, 3 );
+  const char* path = luaL_checkstring( L, 4 );
+  luaL_checktype( L, 5, LUA_TTABLE );
+  
+  size_t length;
+  const char* hex = lexer_lexeme( L, 2, index, &length );
+  
+  if ( hex == NULL )
+  {
+    return luaL_argerror( L, 3, "token index out of range" );
+  }
+  
+  if ( length != 0 && hex[ 0 ] == '{' )
+  {
+    hex++, length--;
+  }
+  
+  if ( length != 0 && hex[ length - 1 ] == '}' )
+  {
+    length--;
+  }
+  
+  job_t* job = (job_t*)calloc( 1, sizeof( job_t ) );
+  
+  if ( job == NULL || ( job->data = (unsigned char*)malloc( length / 2 + 1 ) ) == NULL || ( job->path = strdup( path ) ) == NULL )
+  {
+    free_job( job );
+    return luaL_error( L, "out of memory" );
+  }
+  
+  long size = lexer_hex_decode( hex, length, job->data );
+  
+  if ( size < 0 || !push_class( L, 5, job->data, (size_t)size ) )
+  {
+    free_job( job );
+    lua_pushnil( L );
+    lua_pushstring( L, size < 0 ? "invalid hexadecimal data" : "unknown data type" );
+    return 2;
+  }
+  
+  job->size = (size_t)size;
+  
+  if ( submit( self->target != NULL ? self->target : self, job ) != 0 )
+  {
+    free_job( job );
+    return luaL_error( L, "could not start the encoder threads" );
+  }
+  
+  return 1;
+}
+
+/* Waits for all the data saved with the group, returns true or nil plus the
+   first error. */
+static int group_wait( lua_State* L )
+{
+  group_t* self = check_group( L, 1 );
+  wait_group( self );
+  
+  if ( self->error[ 0 ] != 0 )
+  {
+    lua_pushnil( L );
+    lua_pushstring( L, self->error );
+    self->error[ 0 ] = 0;
+    return 2;
+  }
+  
+  lua_pushboolean( L, 1 );
+  return 1;
+}
+
+static int group_gc( lua_State* L )
+{
+  /* Workers point to the group. */
+  wait_group( (group_t*)lua_touserdata( L, 1 ) );
+  return 0;
+}
+
+static int create_group( lua_State* L )
+{
+  group_t* self = (group_t*)lua_newuserdata( L, sizeof( group_t ) );
+  memset( self, 0, sizeof( *self ) );
+  luaL_setmetatable( L, GROUP_NAME );
+  return 1;
+}
+
+void* rle_to_group( lua_State* L, int arg )
+{
+  return luaL_testudata( L, arg, GROUP_NAME );
+}
+
+void rle_push_group( lua_State* L, void* target )
+{
+  create_group( L );
+  ( (group_t*)lua_touserdata( L, -1 ) )->target = (group_t*)target;
+}
+
+LUALIB_API int luaopen_rle( lua_State* L )
+{
+  static const luaL_Reg statics[] =
+  {
+    { "group", create_group },
+    { NULL, NULL }
+  };
+  
+  static const luaL_Reg methods[] =
+  {
+    { "save", group_save },
+    { "wait", group_wait },
+    { "__gc", group_gc },
+    { NULL, NULL }
+  };
+  
+  luaL_newmetatable( L, GROUP_NAME );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -2, "__index" );
+  luaL_setfuncs( L, methods, 0 );
+  lua_pop( L, 1 );
+  
+  luaL_newlib( L, statics );
+  return 1;
+}
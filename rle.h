@@ -0,0 +1,16 @@
+#ifndef PAS2LUA_RLE_H
+#define PAS2LUA_RLE_H
+
+#include <lua.h>
+
+LUALIB_API int luaopen_rle( lua_State* L );
+
+/* Returns the group at arg, or NULL if it isn't one. */
+void* rle_to_group( lua_State* L, int arg );
+
+/* Pushes a group whose data is saved with target, a group returned by
+   rle_to_group, possibly in another state. Waiting for target waits for the
+   data saved with both. target must outlive the group. */
+void rle_push_group( lua_State* L, void* target );
+
+#endif /* PAS2LUA_RLE_H */
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+void stats_count( stats_t* stats, size_t osize, size_t nsize )
+{
+  stats->heap_bytes += nsize - osize;
+  
+  if ( stats->heap_bytes > stats->peak_bytes )
+  {
+    stats->peak_bytes = stats->heap_bytes;
+  }
+  
+  if ( nsize > osize )
+  {
+    stats->allocated_bytes += nsize - osize;
+  }
+  
+  if ( nsize != 0 )
+  {
+    stats->allocations++;
+  }
+}
+
+void* stats_alloc( void* ud, void* ptr, size_t osize, size_t nsize )
+{
+  stats_t* stats = (stats_t*)ud;
+  
+  /* osize is the type of the object when ptr is NULL, not a size. */
+  if ( ptr == NULL )
+  {
+    osize = 0;
+  }
+  
+  if ( nsize == 0 )
+  {
+    free( ptr );
+    stats_count( stats, osize, 0 );
+    return NULL;
+  }
+  
+  void* block = realloc( ptr, nsize );
+  
+  if ( block != NULL )
+  {
+    stats_count( stats, osize, nsize );
+  }
+  
+  return block;
+}
+
+double stats_now( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+FILE* stats_open( const char* path )
+{
+  return strcmp( path, "-" ) ? fopen( path, "w" ) : stdout;
+}
+
+void stats_close( FILE* file )
+{
+  if ( file != stdout )
+  {
+    fclose( file );
+  }
+  else
+  {
+    fflush( file );
+  }
+}
+
+static void write_string( FILE* file, const char* str )
+{
+  fputc( '"', file );
+  
+  for ( ; *str != 0; str++ )
+  {
+    unsigned char k = (unsigned char)*str;
+    
+    if ( k == '"' || k == '\\' )
+    {
+      fprintf( file, "\\%c", k );
+    }
+    else if ( k < 0x20 )
+    {
+      fprintf( file, "\\u%04x", k );
+    }
+    else
+    {
+      fputc( k, file );
+    }
+  }
+  
+  fputc( '"', file );
+}
+
+void stats_write( FILE* file, const stats_t* stats, const char* input, int status )
+{
+  fprintf( file, "{\"input\":" );
+  write_string( file, input );
+  fprintf( file, ",\"status\":%d,\"cached\":%s", status, stats->cached ? "true" : "false" );
+  
+  fprintf( file, ",\"ms\":{\"setup\":%.3f,\"chunks\":%.3f,\"tokenize\":%.3f,\"dfm\":%.3f,\"parse\":%.3f,\"flush\":%.3f,\"total\":%.3f}",
+    stats->setup_ms, stats->chunks_ms, stats->tokenize_ms, stats->dfm_ms, stats->parse_ms, stats->flush_ms, stats->total_ms );
+  
+  fprintf( file, ",\"counts\":{\"tokens\":%ld,\"scopes\":%ld,\"declarations\":%ld,\"nodes\":%ld,\"node_bytes\":%ld,\"output_bytes\":%ld}",
+    stats->tokens, stats->scopes, stats->declarations, stats->nodes, stats->node_bytes, stats->output_bytes );
+  
+  fprintf( file, ",\"heap\":{\"bytes\":%zu,\"peak_bytes\":%zu,\"allocated_bytes\":%zu,\"allocations\":%zu,\"gc_cycles\":%zu,\"arena_bytes\":%zu}}",
+    stats->heap_bytes, stats->peak_bytes, stats->allocated_bytes, stats->allocations, stats->gc_cycles, stats->arena_bytes );
+}
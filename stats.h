@@ -0,0 +1,57 @@
+#ifndef PAS2LUA_STATS_H
+#define PAS2LUA_STATS_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* What a translation did and how long it took, reported with --stats. */
+typedef struct
+{
+  /* Milliseconds. setup_ms and chunks_ms are only set for the first
+     translation done with a state, the one that paid for creating it. */
+  double setup_ms;     /* creating the state, loading the libraries and the scripts */
+  double chunks_ms;    /* loading the embedded scripts, part of setup_ms */
+  double tokenize_ms;  /* reading the unit, translating its forms included */
+  double dfm_ms;       /* translating the forms, part of tokenize_ms */
+  double parse_ms;     /* parsing and emitting the code */
+  double flush_ms;     /* waiting for the resources and closing the output */
+  double total_ms;     /* the whole translation, setup_ms not included */
+
+  long   tokens;
+  long   scopes;
+  long   declarations;
+  long   nodes;        /* syntax tree nodes */
+  long   node_bytes;   /* memory taken by the syntax trees */
+  long   output_bytes;
+
+  /* Lua heap, allocated_bytes, allocations and gc_cycles since the start of
+     the translation. */
+  size_t heap_bytes;   /* in use at the end */
+  size_t peak_bytes;
+  size_t allocated_bytes;
+  size_t allocations;
+  size_t gc_cycles;
+  size_t arena_bytes;  /* held by the arena at the end, 0 without --arena */
+
+  int    cached;       /* the output came from the translation cache */
+}
+stats_t;
+
+/* Counts a block of the heap going from osize to nsize bytes. */
+void stats_count( stats_t* stats, size_t osize, size_t nsize );
+
+/* A lua_Alloc that counts the heap in the stats_t given as its user data. */
+void* stats_alloc( void* ud, void* ptr, size_t osize, size_t nsize );
+
+/* Milliseconds from a monotonic clock. */
+double stats_now( void );
+
+/* Opens path for writing the report, - is the standard output. */
+FILE* stats_open( const char* path );
+void stats_close( FILE* file );
+
+/* Writes the stats of the translation of input as a JSON object, without a
+   line break at the end. */
+void stats_write( FILE* file, const stats_t* stats, const char* input, int status );
+
+#endif /* PAS2LUA_STATS_H */
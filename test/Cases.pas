@@ -0,0 +1,28 @@
+unit Cases;
+
+interface
+
+uses
+  SysUtils, StdCtrls;
+
+var
+  L: TLabel;
+
+implementation
+
+procedure Show(x: Integer);
+begin
+  case x of
+    0, 1: L.Left := 1;
+    2: L.Left := 2;
+    4: L.Left := 3;
+    6..9: L.Left := 4;
+    10: L.Left := 5;
+    12: L.Left := 6;
+  else
+    L.Left := 0;
+  end;
+end;
+
+initialization
+end.
@@ -0,0 +1,29 @@
+unit Fold;
+
+interface
+
+uses
+  SysUtils, StdCtrls;
+
+var
+  L: TLabel;
+  Inverted: Integer;
+  Same: Boolean;
+
+implementation
+
+const
+  CR = 13;
+  LF = 10;
+  Five = 5;
+
+initialization
+  L.Caption := Chr(CR);
+  L.Caption := 'A' + Chr(13);
+  L.Caption := Chr(LF) + 'B';
+  L.Caption := 'A' + Chr(0) + 'B';
+  L.Caption := '[' + ']';
+  Inverted := (not Five) + 1;
+  Same := (not Five) = 5;
+  Inverted := -(not Five);
+end.
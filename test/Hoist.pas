@@ -0,0 +1,21 @@
+unit Hoist;
+
+interface
+
+uses
+  SysUtils, StdCtrls;
+
+var
+  L: TLabel;
+
+implementation
+
+procedure Show(i: Integer);
+begin
+  L.Caption := IntToStr(i);
+  L.Caption := IntToStr(i + 1);
+  L.Caption := 'sysutils.inttostr' + Chr(13);
+end;
+
+initialization
+end.
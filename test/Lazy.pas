@@ -0,0 +1,54 @@
+unit Lazy;
+
+interface
+
+uses
+  Classes, StdCtrls;
+
+type
+  TCell = class
+    Value: Integer;
+    Pos: record
+      X: Integer;
+      Y: Integer;
+    end;
+  end;
+
+  TTile = class(TCell)
+    Kind: Integer;
+  end;
+
+  TBoard = class
+    Cell: TCell;
+    Tile: TTile;
+  end;
+
+  TPanel = class
+    Cell: TCell;
+    Label1: TLabel;
+  end;
+
+var
+  Grid: array [1..4, 1..3, 1..2] of Integer;
+  Flags: array [1..3] of Boolean;
+  Tiles: array [1..5] of record
+    Kind: Integer;
+    Size: Integer;
+  end;
+  Cells: array [1..3] of TTile;
+  Board: TBoard;
+  Panel: TPanel;
+  Total: Integer;
+  Flag: Boolean;
+
+implementation
+
+initialization
+  Grid[2, 3, 1] := 7;
+  Tiles[4].Kind := 2;
+  Board.Tile.Kind := 3;
+  Board.Tile.Pos.X := 5;
+  Cells[2].Value := 4;
+  Total := Grid[2, 3, 1] + Grid[1, 1, 1] + Tiles[4].Kind + Board.Tile.Kind + Board.Tile.Pos.X + Board.Cell.Value + Cells[2].Value + Cells[1].Value;
+  Flag := Flags[2];
+end.
@@ -0,0 +1,90 @@
+unit Loops;
+
+interface
+
+type
+  TLoops = class
+    Index: Integer;
+    Up, Down, Skipped, Stepped, Nested, Fields: Integer;
+    procedure CountUp(n: Integer);
+    procedure CountDown;
+    procedure Skip;
+    procedure Step;
+    procedure Nest;
+    procedure CountFields;
+  end;
+
+var
+  Loops1: TLoops;
+  Global: Integer;
+  U: Integer;
+
+implementation
+
+procedure TLoops.CountUp(n: Integer);
+var
+  i: Integer;
+begin
+  for i := 1 to n do
+    Up := Up + i;
+end;
+
+procedure TLoops.CountDown;
+var
+  d: Integer;
+begin
+  for d := 4 downto 1 do
+    Down := Down * 10 + d;
+end;
+
+procedure TLoops.Skip;
+var
+  a: Integer;
+begin
+  for a := 1 to 10 do
+  begin
+    Skipped := Skipped + a;
+    if a = 5 then
+      a := 8;
+  end;
+end;
+
+procedure TLoops.Step;
+var
+  s: Integer;
+begin
+  for s := 1 to 10 do
+  begin
+    Stepped := Stepped + s;
+    Inc(s);
+  end;
+end;
+
+procedure TLoops.Nest;
+var
+  r: Integer;
+begin
+  for r := 1 to 3 do
+  begin
+    Nested := Nested + r;
+    for r := 5 to 6 do
+      Nested := Nested + r;
+  end;
+end;
+
+procedure TLoops.CountFields;
+begin
+  for Index := 1 to 4 do
+    Fields := Fields + Index;
+end;
+
+initialization
+  Loops1.CountUp(4);
+  Loops1.CountDown;
+  Loops1.Skip;
+  Loops1.Step;
+  Loops1.Nest;
+  Loops1.CountFields;
+  for U := 1 to 3 do
+    Global := Global + U;
+end.
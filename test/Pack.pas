@@ -0,0 +1,21 @@
+unit Pack;
+
+interface
+
+uses
+  Classes, Graphics, Controls, Forms, ExtCtrls;
+
+type
+  TPackForm = class(TForm)
+    Image1: TImage;
+  end;
+
+var
+  PackForm: TPackForm;
+
+implementation
+
+{$R *.dfm}
+
+initialization
+end.
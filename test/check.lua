@@ -0,0 +1,226 @@
+-- Regression checks: translates the units in test/ with the parser embedded in
+-- pas2lua and checks the Lua it writes.
+--
+-- Usage: pas2lua --run test/check.lua <dir>
+--
+-- <dir> receives the translations and the extracted data.
+
+local dir = arg[ 1 ]
+
+if not dir then
+  io.stderr:write( 'Usage: pas2lua --run test/check.lua <dir>\n' )
+  return 1
+end
+
+local function read( path )
+  local file, err = io.open( path, 'rb' )
+  
+  if not file then
+    error( err, 0 )
+  end
+  
+  local contents = file:read( 'a' )
+  file:close()
+  return contents
+end
+
+local function translate( name, options )
+  -- each translation starts with fresh copies of the units it uses, as in translator_run
+  debug.getregistry().pas2lua_units = {}
+  
+  local outpath = dir .. '/' .. name .. '.lua'
+  local parser = Parser( 'test/' .. name .. '.pas', outpath, dir .. '/data', options or {} )
+  parser:parse()
+  return read( outpath )
+end
+
+-- Values of the expressions assigned to field in the translation, in order.
+local function assigned( code, field )
+  local values = {}
+  
+  for expr in code:gmatch( '%.' .. field .. ' = ([^\n]*)' ) do
+    values[ #values + 1 ] = assert( load( 'return ' .. expr ) )()
+  end
+  
+  return values
+end
+
+-- Runs a translation with empty stubs for the units it loads, except for
+-- labels, which count how many were created. Returns the unit and the count.
+local function run( code )
+  local labels = 0
+  local stdctrls = { tlabel = class.new() }
+  
+  stdctrls.tlabel.new = function()
+    labels = labels + 1
+  end
+  
+  local units = { class = class, stdctrls = stdctrls }
+  local system = { loadunit = function( name ) return units[ name ] or {} end }
+  local unit = assert( load( code, '=' .. dir, 't', setmetatable( { system = system }, { __index = _G } ) ) )()
+  return unit, labels
+end
+
+local checks = {}
+
+-- Folded constants must load as the values the expressions have.
+function checks.Fold()
+  local code = translate( 'Fold' )
+  local captions = assigned( code, 'caption' )
+  local expected = { '\r', 'A\r', '\nB', 'A\0B', '[]' }
+  
+  for i, value in ipairs( expected ) do
+    if captions[ i ] ~= value then
+      return string.format( 'caption %d is %q, expected %q', i, tostring( captions[ i ] ), value )
+    end
+  end
+  
+  -- not is bitwise on integer constants, the first values are the declarations
+  local inverted, same = assigned( code, 'inverted' ), assigned( code, 'same' )
+  
+  if inverted[ 2 ] ~= -5 or inverted[ 3 ] ~= 6 or same[ 2 ] ~= false then
+    return string.format( 'not 5 gives %s, %s and %s', tostring( inverted[ 2 ] ), tostring( inverted[ 3 ] ), tostring( same[ 2 ] ) )
+  end
+end
+
+-- Only the code of hoisted members is renamed, not strings that look like it.
+function checks.Hoist()
+  local code = translate( 'Hoist' )
+  
+  if not code:find( 'local __sysutils_inttostr = sysutils.inttostr', 1, true ) then
+    return 'sysutils.inttostr not hoisted'
+  end
+  
+  local captions = assigned( code:gsub( '__sysutils_inttostr%b()', '0' ), 'caption' )
+  
+  if captions[ 3 ] ~= 'sysutils.inttostr\r' then
+    return string.format( 'caption 3 is %q', tostring( captions[ 3 ] ) )
+  end
+end
+
+-- The locals of a case statement go in a block, even with a local selector.
+function checks.Cases()
+  local code = translate( 'Cases' )
+  local _, arms = code:gsub( 'local __arm', '' )
+  local _, blocks = code:gsub( 'do\n%s*local __arm', '' )
+  
+  if arms == 0 or arms ~= blocks then
+    return string.format( '%d of %d __arm in a block', blocks, arms )
+  end
+end
+
+-- Pictures are written with PackBits runs that decode to the data in the form:
+-- the picture in Pack.dfm has runs longer than 128 bytes, literals longer than
+-- 128 bytes, one cut in the middle of a pair of equal bytes, and literals at
+-- the end.
+function checks.Pack()
+  translate( 'Pack' )
+  
+  local hex = read( 'test/Pack.dfm' ):match( 'Picture%.Data = {(.-)}' ):gsub( '%s', '' )
+  local data = hex:gsub( '%x%x', function( byte ) return string.char( tonumber( byte, 16 ) ) end )
+  local rle = read( dir .. '/data/pack_image1.rle' )
+  local size, pos = string.unpack( '<I4', rle )
+  local out = {}
+  
+  while pos <= #rle do
+    local control = rle:byte( pos )
+    
+    if control < 128 then
+      out[ #out + 1 ] = rle:sub( pos + 1, pos + control + 1 )
+      pos = pos + control + 2
+    elseif control > 128 then
+      out[ #out + 1 ] = rle:sub( pos + 1, pos + 1 ):rep( 257 - control )
+      pos = pos + 2
+    else
+      return string.format( 'control byte 128 at %d', pos )
+    end
+  end
+  
+  local decoded = table.concat( out )
+  
+  if size ~= #data or #decoded ~= #data then
+    return string.format( 'decoded %d bytes of %d, header says %d', #decoded, #data, size )
+  end
+  
+  for i = 1, #data do
+    if decoded:byte( i ) ~= data:byte( i ) then
+      return string.format( 'byte %d decoded as %d, expected %d', i, decoded:byte( i ), data:byte( i ) )
+    end
+  end
+end
+
+-- Loops over local variables their bodies don't assign are numeric fors, the
+-- rest stay while loops.
+function checks.Loops()
+  local code = translate( 'Loops' )
+  
+  local expected = {
+    'for i = 1, ( n ) do',
+    'for d = 4, 1, -1 do',
+    'while a <= 10 do',
+    'while s <= 10 do',
+    'while r <= 3 do',
+    'for r = 5, 6 do',
+    'while self.index <= 4 do',
+    'while unit.u <= 3 do'
+  }
+  
+  for _, loop in ipairs( expected ) do
+    if not code:find( loop, 1, true ) then
+      return string.format( 'no %s', loop )
+    end
+  end
+end
+
+-- --lazy doesn't change the values read, and components are still created
+-- with the objects that have them.
+function checks.Lazy()
+  local function read( unit )
+    return {
+      unit.total, unit.flag, unit.grid[ 2 ][ 3 ][ 1 ], unit.grid[ 4 ][ 3 ][ 2 ], unit.flags[ 3 ], unit.tiles[ 4 ].kind,
+      unit.cells[ 3 ].kind, unit.cells[ 2 ].value, unit.board.tile.pos.x, unit.board.cell.value, unit.panel.cell.value
+    }
+  end
+  
+  local eager, eagerLabels = run( translate( 'Lazy' ) )
+  local lazy, lazyLabels = run( translate( 'Lazy', { lazy = true } ) )
+  
+  if rawget( lazy.panel, 'label1' ) == nil or lazyLabels ~= eagerLabels then
+    return string.format( '%d labels created with --lazy, %d without', lazyLabels, eagerLabels )
+  end
+  
+  if rawget( lazy.panel, 'cell' ) ~= nil then
+    return 'panel.cell created before it was read'
+  end
+  
+  local expected, values = read( eager ), read( lazy )
+  
+  for i = 1, #expected do
+    if values[ i ] ~= expected[ i ] then
+      return string.format( 'value %d is %s with --lazy, %s without', i, tostring( values[ i ] ), tostring( expected[ i ] ) )
+    end
+  end
+end
+
+local names = {}
+
+for name in pairs( checks ) do
+  names[ #names + 1 ] = name
+end
+
+table.sort( names )
+os.execute( string.format( 'mkdir -p "%s/data"', dir ) )
+local failed = 0
+
+for _, name in ipairs( names ) do
+  local ok, err = pcall( checks[ name ] )
+  
+  if ok and not err then
+    io.write( string.format( '%-20s ok\n', name ) )
+  else
+    io.write( string.format( '%-20s FAILED: %s\n', name, err ) )
+    failed = failed + 1
+  end
+end
+
+return failed == 0 and 0 or 1
@@ -0,0 +1,1261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include "lexer.h"
+#include "writer.h"
+#include "rle.h"
+#include "cache.h"
+#include "stats.h"
+#include "arena.h"
+#include "translator.h"
+
+#include "lua/class.h"
+#include "lua/class.luac.h"
+#include "lua/ast.h"
+#include "lua/ast.luac.h"
+#include "lua/parser.h"
+#include "lua/parser.luac.h"
+#include "lua/dfm2pas.h"
+#include "lua/dfm2pas.luac.h"
+#include "lua/main.h"
+#include "lua/main.luac.h"
+
+#include "units/classes.h"
+#include "units/classes.luac.h"
+#include "units/controls.h"
+#include "units/controls.luac.h"
+#include "units/dialogs.h"
+#include "units/dialogs.luac.h"
+#include "units/extctrls.h"
+#include "units/extctrls.luac.h"
+#include "units/fmod.h"
+#include "units/fmod.luac.h"
+#include "units/fmodtypes.h"
+#include "units/fmodtypes.luac.h"
+#include "units/forms.h"
+#include "units/forms.luac.h"
+#include "units/graphics.h"
+#include "units/graphics.luac.h"
+#include "units/jpeg.h"
+#include "units/jpeg.luac.h"
+#include "units/math.h"
+#include "units/math.luac.h"
+#include "units/messages.h"
+#include "units/messages.luac.h"
+#include "units/registry.h"
+#include "units/registry.luac.h"
+#include "units/stdctrls.h"
+#include "units/stdctrls.luac.h"
+#include "units/system.h"
+#include "units/system.luac.h"
+#include "units/sysutils.h"
+#include "units/sysutils.luac.h"
+#include "units/windows.h"
+#include "units/windows.luac.h"
+
+static void dump_stack( lua_State* L )
+{
+  int top = lua_gettop( L );
+  int i;
+  
+  for ( i = 1; i <= top; i++ )
+  {
+    printf( "%2d %3d ", i, i - top - 1 );
+    
+    lua_pushvalue( L, i );
+    
+    switch ( lua_type( L, -1 ) )
+    {
+    case LUA_TNIL:
+      printf( "nil\n" );
+      break;
+    case LUA_TNUMBER:
+      printf( "%e\n", lua_tonumber( L, -1 ) );
+      break;
+    case LUA_TBOOLEAN:
+      printf( "%s\n", lua_toboolean( L, -1 ) ? "true" : "false" );
+      break;
+    case LUA_TSTRING:
+      printf( "\"%s\"\n", lua_tostring( L, -1 ) );
+      break;
+    case LUA_TTABLE:
+      printf( "table\n" );
+      break;
+    case LUA_TFUNCTION:
+      printf( "function\n" );
+      break;
+    case LUA_TUSERDATA:
+      printf( "userdata\n" );
+      break;
+    case LUA_TTHREAD:
+      printf( "thread\n" );
+      break;
+    case LUA_TLIGHTUSERDATA:
+      printf( "light userdata\n" );
+      break;
+    default:
+      printf( "?\n" );
+      break;
+    }
+  }
+  
+  lua_settop( L, top );
+}
+
+/* Bump when a change to the C code changes the translations, the embedded
+   scripts and units are part of the cache keys already. */
+#define TRANSLATOR_VERSION "1"
+
+static unsigned djb2( const char* str )
+{
+  const unsigned char* aux = (const unsigned char*)str;
+  unsigned hash = 5381;
+  
+  while ( *aux )
+  {
+    hash = ( hash << 5 ) + hash + *aux++;
+  }
+  
+  return hash;
+}
+
+static int load_buffer( lua_State* L, const char* bytecode, size_t bytecode_size, const char* buffer, size_t buffer_size, const char* chunk_name )
+{
+  /* The precompiled chunk is refused if it was built for another Lua version,
+     or is empty when luac wasn't available; compile the source then. */
+  if ( bytecode_size == 0 || luaL_loadbufferx( L, bytecode, bytecode_size, chunk_name, "b" ) != 0 )
+  {
+    if ( bytecode_size != 0 )
+    {
+      lua_pop( L, 1 );
+    }
+    
+    if ( luaL_loadbufferx( L, buffer, buffer_size, chunk_name, "t" ) != 0 )
+    {
+      return lua_error( L );
+    }
+  }
+  
+  return 1;
+}
+
+static int do_buffer( lua_State* L, const char* bytecode, size_t bytecode_size, const char* buffer, size_t buffer_size, const char* chunk_name, int ret_count )
+{
+  load_buffer( L, bytecode, bytecode_size, buffer, buffer_size, chunk_name );
+  lua_call( L, 0, ret_count );
+  return ret_count;
+}
+
+#define LOAD_CHUNK( L, chunk, chunk_name ) \
+  load_buffer( L, chunk ## _luac, chunk ## _luac_len, chunk ## _lua, sizeof( chunk ## _lua ), chunk_name )
+
+#define DO_CHUNK( L, chunk, chunk_name, ret_count ) \
+  do_buffer( L, chunk ## _luac, chunk ## _luac_len, chunk ## _lua, sizeof( chunk ## _lua ), chunk_name, ret_count )
+
+/* Stubs found in the unit path, sorted by name. Only the file names are read
+   when the path is set, the files are compiled when a unit uses them. */
+typedef struct
+{
+  char*    name;
+  char*    path;
+  uint64_t size;
+  int64_t  mtime;
+  int      order;
+}
+unit_file_t;
+
+static unit_file_t* unit_files;
+static size_t       unit_file_count;
+
+static unsigned options;
+
+/* Collection pause with TRANSLATOR_ARENA, see translator_new. */
+#define GC_PAUSE 1000
+
+/* What the translator keeps for each state, the user data of its allocator. */
+typedef struct
+{
+  stats_t    stats;     /* of the last translation, must be the first member */
+  arena_t    arena;     /* used with TRANSLATOR_ARENA */
+  double     setup_ms;  /* set in the stats of the first translation only */
+  double     chunks_ms;
+  int        closing;
+  lua_State* forms;     /* translates the forms on another thread, see start_form */
+}
+state_t;
+
+/* Counters and timers in the stats table, and where they go in stats_t. */
+static const struct
+{
+  const char* key;
+  size_t      offset;
+  int         timer;
+}
+stats_fields[] =
+{
+  { "tokenize", offsetof( stats_t, tokenize_ms ), 1 },
+  { "dfm", offsetof( stats_t, dfm_ms ), 1 },
+  { "parse", offsetof( stats_t, parse_ms ), 1 },
+  { "flush", offsetof( stats_t, flush_ms ), 1 },
+  { "tokens", offsetof( stats_t, tokens ), 0 },
+  { "scopes", offsetof( stats_t, scopes ), 0 },
+  { "declarations", offsetof( stats_t, declarations ), 0 },
+  { "nodes", offsetof( stats_t, nodes ), 0 },
+  { "nodeBytes", offsetof( stats_t, node_bytes ), 0 },
+  { "outputBytes", offsetof( stats_t, output_bytes ), 0 }
+};
+
+static void* arena_alloc( void* ud, void* ptr, size_t osize, size_t nsize )
+{
+  state_t* state = (state_t*)ud;
+  
+  if ( ptr == NULL )
+  {
+    osize = 0;
+  }
+  
+  void* block = arena_realloc( &state->arena, ptr, osize, nsize );
+  
+  if ( block != NULL || nsize == 0 )
+  {
+    stats_count( &state->stats, osize, nsize );
+  }
+  
+  return block;
+}
+
+static state_t* get_state( lua_State* L )
+{
+  void* ud;
+  lua_getallocf( L, &ud );
+  return (state_t*)ud;
+}
+
+static int compare_unit_files( const void* e1, const void* e2 )
+{
+  const unit_file_t* f1 = (const unit_file_t*)e1;
+  const unit_file_t* f2 = (const unit_file_t*)e2;
+  int res = strcmp( f1->name, f2->name );
+  return res != 0 ? res : f1->order - f2->order;
+}
+
+static int add_unit_file( size_t* reserved, const char* dir, size_t dir_length, const char* file_name, uint64_t size, int64_t mtime )
+{
+  if ( unit_file_count == *reserved )
+  {
+    size_t count = *reserved ? *reserved * 2 : 64;
+    unit_file_t* files = (unit_file_t*)realloc( unit_files, count * sizeof( unit_file_t ) );
+    
+    if ( files == NULL )
+    {
+      return -1;
+    }
+    
+    unit_files = files;
+    *reserved = count;
+  }
+  
+  /* Unit names are case insensitive, the .lua extension isn't part of the name. */
+  size_t length = strlen( file_name ) - 4;
+  char* name = (char*)malloc( length + 1 );
+  char* path = (char*)malloc( dir_length + length + 6 );
+  
+  if ( name == NULL || path == NULL )
+  {
+    free( name );
+    free( path );
+    return -1;
+  }
+  
+  size_t i;
+  
+  for ( i = 0; i < length; i++ )
+  {
+    name[ i ] = tolower( (unsigned char)file_name[ i ] );
+  }
+  
+  name[ length ] = 0;
+  sprintf( path, "%.*s/%s", (int)dir_length, dir, file_name );
+  
+  unit_file_t* file = unit_files + unit_file_count;
+  file->name = name;
+  file->path = path;
+  file->size = size;
+  file->mtime = mtime;
+  file->order = (int)unit_file_count++;
+  return 0;
+}
+
+static int is_unit_file( const char* file_name )
+{
+  size_t length = strlen( file_name );
+  
+  if ( length <= 4 || file_name[ length - 4 ] != '.' )
+  {
+    return 0;
+  }
+  
+  const char* ext = file_name + length - 3;
+  return tolower( (unsigned char)ext[ 0 ] ) == 'l' && tolower( (unsigned char)ext[ 1 ] ) == 'u' && tolower( (unsigned char)ext[ 2 ] ) == 'a';
+}
+
+static int scan_unit_dir( size_t* reserved, const char* dir, size_t dir_length )
+{
+#ifdef _WIN32
+  char pattern[ MAX_PATH ];
+  snprintf( pattern, sizeof( pattern ), "%.*s\\*.lua", (int)dir_length, dir );
+  
+  WIN32_FIND_DATAA data;
+  HANDLE handle = FindFirstFileA( pattern, &data );
+  
+  if ( handle == INVALID_HANDLE_VALUE )
+  {
+    return GetLastError() == ERROR_FILE_NOT_FOUND ? 0 : -1;
+  }
+  
+  int res = 0;
+  
+  do
+  {
+    if ( !( data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ) && is_unit_file( data.cFileName ) )
+    {
+      uint64_t size = (uint64_t)data.nFileSizeHigh << 32 | data.nFileSizeLow;
+      int64_t mtime = (int64_t)data.ftLastWriteTime.dwHighDateTime << 32 | data.ftLastWriteTime.dwLowDateTime;
+      res = add_unit_file( reserved, dir, dir_length, data.cFileName, size, mtime );
+    }
+  }
+  while ( res == 0 && FindNextFileA( handle, &data ) );
+  
+  FindClose( handle );
+  return res;
+#else
+  char path[ 4096 ];
+  snprintf( path, sizeof( path ), "%.*s", (int)dir_length, dir );
+  DIR* handle = opendir( path );
+  
+  if ( handle == NULL )
+  {
+    return -1;
+  }
+  
+  struct dirent* entry;
+  int res = 0;
+  
+  while ( res == 0 && ( entry = readdir( handle ) ) != NULL )
+  {
+    struct stat buf;
+    
+    if ( is_unit_file( entry->d_name ) )
+    {
+      snprintf( path, sizeof( path ), "%.*s/%s", (int)dir_length, dir, entry->d_name );
+      
+      if ( stat( path, &buf ) == 0 && S_ISREG( buf.st_mode ) )
+      {
+        res = add_unit_file( reserved, dir, dir_length, entry->d_name, buf.st_size, buf.st_mtime );
+      }
+    }
+  }
+  
+  closedir( handle );
+  return res;
+#endif
+}
+
+static const char* find_unit_file( const char* name )
+{
+  char lower[ 256 ];
+  size_t i;
+  
+  for ( i = 0; name[ i ] != 0 && i < sizeof( lower ) - 1; i++ )
+  {
+    lower[ i ] = tolower( (unsigned char)name[ i ] );
+  }
+  
+  lower[ i ] = 0;
+  
+  /* The first one in the path wins when the same unit is in more than one directory. */
+  size_t low = 0, high = unit_file_count;
+  
+  while ( low < high )
+  {
+    size_t middle = low + ( high - low ) / 2;
+    
+    if ( strcmp( unit_files[ middle ].name, lower ) < 0 )
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+  
+  return low < unit_file_count && !strcmp( unit_files[ low ].name, lower ) ? unit_files[ low ].path : NULL;
+}
+
+static int compile_unit( lua_State* L, const char* name )
+{
+  /* Stubs in the unit path take precedence over the builtin ones. */
+  const char* path = find_unit_file( name );
+  
+  if ( path != NULL )
+  {
+    if ( luaL_loadfile( L, path ) != 0 )
+    {
+      return lua_error( L );
+    }
+    
+    return 1;
+  }
+  
+  switch ( djb2( name ) )
+  {
+  case 0xcb8e8f13U: // classes
+    return LOAD_CHUNK( L, units_classes, name );
+  case 0x42b3ee19U: // controls
+    return LOAD_CHUNK( L, units_controls, name );
+  case 0x11856a88U: // dialogs
+    return LOAD_CHUNK( L, units_dialogs, name );
+  case 0xdcd0335eU: // extctrls
+    return LOAD_CHUNK( L, units_extctrls, name );
+  case 0x7c96dc8bU: // fmod
+    return LOAD_CHUNK( L, units_fmod, name );
+  case 0x45f4c9a0U: // fmodtypes
+    return LOAD_CHUNK( L, units_fmodtypes, name );
+  case 0x0f73950cU: // forms
+    return LOAD_CHUNK( L, units_forms, name );
+  case 0xbc08ef36U: // graphics
+    return LOAD_CHUNK( L, units_graphics, name );
+  case 0x7c99198bU: // jpeg
+    return LOAD_CHUNK( L, units_jpeg, name );
+  case 0x7c9a80cfU: // math
+    return LOAD_CHUNK( L, units_math, name );
+  case 0x870e1c9dU: // messages
+    return LOAD_CHUNK( L, units_messages, name );
+  case 0x07ae803eU: // registry
+    return LOAD_CHUNK( L, units_registry, name );
+  case 0x6f2e5a98U: // stdctrls
+    return LOAD_CHUNK( L, units_stdctrls, name );
+  case 0x1ceee48aU: // system
+    return LOAD_CHUNK( L, units_system, name );
+  case 0x14547e95U: // sysutils
+    return LOAD_CHUNK( L, units_sysutils, name );
+  case 0xc8feca70U: // windows
+    return LOAD_CHUNK( L, units_windows, name );
+  }
+  
+  return luaL_error( L, "unit %s not found", name );
+}
+
+static int load_unit( lua_State* L )
+{
+  const char* name = luaL_checkstring( L, 1 );
+  
+  /* Units are loaded once per translation, which is free to change their definitions. */
+  lua_getfield( L, LUA_REGISTRYINDEX, "pas2lua_units" );
+  lua_getfield( L, -1, name );
+  
+  if ( !lua_isnil( L, -1 ) )
+  {
+    return 1;
+  }
+  
+  lua_pop( L, 1 );
+  
+  /* Stubs are compiled only once for all the translations done with the state. */
+  lua_getfield( L, LUA_REGISTRYINDEX, "pas2lua_chunks" );
+  lua_getfield( L, -1, name );
+  
+  if ( lua_isnil( L, -1 ) )
+  {
+    lua_pop( L, 1 );
+    compile_unit( L, name );
+    lua_pushvalue( L, -1 );
+    lua_setfield( L, -3, name );
+  }
+  
+  lua_call( L, 0, 1 );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -4, name );
+  return 1;
+}
+
+static int stats_clock( lua_State* L )
+{
+  lua_pushnumber( L, stats_now() );
+  return 1;
+}
+
+static int gc_sentinel( lua_State* L )
+{
+  /* Finalized once per collection cycle, and replaced by a new sentinel for
+     the next one. */
+  state_t* state = get_state( L );
+  state->stats.gc_cycles++;
+  
+  if ( !state->closing )
+  {
+    lua_newuserdata( L, 1 );
+    luaL_setmetatable( L, "pas2lua_sentinel" );
+    lua_pop( L, 1 );
+  }
+  
+  return 0;
+}
+
+/* Forms smaller than this are translated right away, a thread wouldn't pay
+   for itself. */
+#define FORM_THREAD_MIN ( 64 * 1024 )
+
+/* A .dfm translated by dfm2pas on a thread with its own state, while the
+   unit it belongs to goes on being read. */
+typedef struct
+{
+  pthread_t  thread;
+  lua_State* W;         /* NULL once released, or if there was no thread */
+  char*      path;
+  char*      datadir;
+  void*      resources; /* the group of the unit, the pictures are saved with it */
+  int        status;
+  int        running;
+  int        waited;
+}
+form_t;
+
+static int setup_form_state( lua_State* W )
+{
+  luaopen_lexer( W );
+  lua_setglobal( W, "lexer" );
+  
+  luaopen_rle( W );
+  lua_setglobal( W, "rle" );
+  
+  DO_CHUNK( W, lua_class, "class.lua", 1 );
+  lua_setglobal( W, "class" );
+  
+  DO_CHUNK( W, lua_dfm2pas, "dfm2pas.lua", 1 );
+  lua_setglobal( W, "dfm2pas" );
+  return 0;
+}
+
+static lua_State* new_form_state( void )
+{
+  lua_State* W = luaL_newstate();
+  
+  if ( W != NULL )
+  {
+    luaL_openlibs( W );
+    lua_pushcfunction( W, setup_form_state );
+    
+    if ( lua_pcall( W, 0, 0, 0 ) != /*LUA_OK*/ 0 )
+    {
+      lua_close( W );
+      W = NULL;
+    }
+  }
+  
+  return W;
+}
+
+static int parse_form( lua_State* W )
+{
+  /* dfm2pas( path, datadir, resources ):parse() */
+  lua_getglobal( W, "dfm2pas" );
+  lua_insert( W, 1 );
+  lua_call( W, 3, 1 );
+  lua_getfield( W, -1, "parse" );
+  lua_insert( W, -2 );
+  lua_call( W, 1, 1 );
+  return 1;
+}
+
+static void* form_worker( void* arg )
+{
+  form_t* form = (form_t*)arg;
+  lua_State* W = form->W;
+  
+  /* The garbage of the last form translated with the state goes first. */
+  lua_settop( W, 0 );
+  lua_gc( W, LUA_GCCOLLECT, 0 );
+  
+  lua_pushcfunction( W, parse_form );
+  lua_pushstring( W, form->path );
+  lua_pushstring( W, form->datadir );
+  rle_push_group( W, form->resources );
+  form->status = lua_pcall( W, 3, 1, 0 );
+  return NULL;
+}
+
+static void join_form( form_t* form )
+{
+  if ( form->running )
+  {
+    pthread_join( form->thread, NULL );
+    form->running = 0;
+  }
+  
+  free( form->path );
+  free( form->datadir );
+  form->path = form->datadir = NULL;
+}
+
+static void release_form( lua_State* L, form_t* form )
+{
+  /* The state is kept for the next form. */
+  state_t* state = get_state( L );
+  
+  if ( state->forms == NULL && !state->closing )
+  {
+    lua_settop( form->W, 0 );
+    state->forms = form->W;
+  }
+  else
+  {
+    lua_close( form->W );
+  }
+  
+  form->W = NULL;
+}
+
+/* startform( path, datadir, resources ) starts translating the .dfm in path
+   on another thread, form:wait() returns what dfm2pas( path, datadir,
+   resources ):parse() does, or raises its error. */
+static int start_form( lua_State* L )
+{
+  const char* path = luaL_checkstring( L, 1 );
+  const char* datadir = luaL_checkstring( L, 2 );
+  void* resources = rle_to_group( L, 3 );
+  luaL_argcheck( L, resources != NULL, 3, "resources must be a rle group" );
+  
+  form_t* form = (form_t*)lua_newuserdata( L, sizeof( form_t ) );
+  memset( form, 0, sizeof( *form ) );
+  luaL_setmetatable( L, "pas2lua_form" );
+  
+  /* Small forms, and missing ones, are translated with L as they always were,
+     the result is kept in the form's user value. */
+  struct stat buf;
+  
+  if ( stat( path, &buf ) != 0 || buf.st_size < FORM_THREAD_MIN )
+  {
+    lua_pushcfunction( L, parse_form );
+    lua_pushvalue( L, 1 );
+    lua_pushvalue( L, 2 );
+    lua_pushvalue( L, 3 );
+    lua_call( L, 3, 1 );
+    lua_setuservalue( L, -2 );
+    return 1;
+  }
+  
+  state_t* state = get_state( L );
+  
+  if ( state->forms != NULL )
+  {
+    form->W = state->forms;
+    state->forms = NULL;
+  }
+  else if ( ( form->W = new_form_state() ) == NULL )
+  {
+    return luaL_error( L, "could not create the Lua state for %s", path );
+  }
+  
+  form->path = strdup( path );
+  form->datadir = strdup( datadir );
+  form->resources = resources;
+  
+  if ( form->path == NULL || form->datadir == NULL )
+  {
+    return luaL_error( L, "out of memory" );
+  }
+  
+  /* Without a thread the form is translated right away. */
+  form->running = pthread_create( &form->thread, NULL, form_worker, form ) == 0;
+  
+  if ( !form->running )
+  {
+    form_worker( form );
+  }
+  
+  return 1;
+}
+
+static int form_wait( lua_State* L )
+{
+  form_t* form = (form_t*)luaL_checkudata( L, 1, "pas2lua_form" );
+  
+  if ( form->waited )
+  {
+    return luaL_error( L, "the form was already waited for" );
+  }
+  
+  form->waited = 1;
+  
+  if ( form->W == NULL )
+  {
+    lua_getuservalue( L, 1 );
+    return 1;
+  }
+  
+  join_form( form );
+  lua_State* W = form->W;
+  
+  if ( form->status != /*LUA_OK*/ 0 )
+  {
+    lua_pushstring( L, lua_tostring( W, -1 ) );
+    release_form( L, form );
+    return lua_error( L );
+  }
+  
+  /* Copy { implementation = stream, initialization = stream, extracted = { names } }. */
+  lua_createtable( L, 0, 3 );
+  int res = 0;
+  
+  lua_getfield( W, -1, "implementation" );
+  res |= lexer_copy_stream( L, W, -1 );
+  lua_setfield( L, -2, "implementation" );
+  lua_pop( W, 1 );
+  
+  lua_getfield( W, -1, "initialization" );
+  res |= lexer_copy_stream( L, W, -1 );
+  lua_setfield( L, -2, "initialization" );
+  lua_pop( W, 1 );
+  
+  lua_getfield( W, -1, "extracted" );
+  int count = (int)lua_rawlen( W, -1 ), i;
+  lua_createtable( L, count, 0 );
+  
+  for ( i = 1; i <= count; i++ )
+  {
+    lua_rawgeti( W, -1, i );
+    lua_pushstring( L, lua_tostring( W, -1 ) );
+    lua_rawseti( L, -2, i );
+    lua_pop( W, 1 );
+  }
+  
+  lua_setfield( L, -2, "extracted" );
+  release_form( L, form );
+  
+  if ( res != 0 )
+  {
+    return luaL_error( L, "out of memory" );
+  }
+  
+  return 1;
+}
+
+static int form_gc( lua_State* L )
+{
+  /* The thread uses the form, and the group of the unit. */
+  form_t* form = (form_t*)lua_touserdata( L, 1 );
+  
+  if ( form->W != NULL )
+  {
+    join_form( form );
+    release_form( L, form );
+  }
+  
+  return 0;
+}
+
+static int setup( lua_State* L )
+{
+  /* Register the builtin searcher */
+  lua_pushcfunction( L, load_unit );
+  lua_setglobal( L, "loadunit" );
+  
+  lua_newtable( L );
+  lua_setfield( L, LUA_REGISTRYINDEX, "pas2lua_chunks" );
+  
+  /* Load lexer. */
+  /*luaL_requiref( L, "lexer", luaopen_lexer, 1 );*/
+  luaopen_lexer( L );
+  lua_setglobal( L, "lexer" );
+  
+  /* Load the output writer. */
+  luaopen_writer( L );
+  lua_setglobal( L, "writer" );
+  
+  /* Load the resource encoder. */
+  luaopen_rle( L );
+  lua_setglobal( L, "rle" );
+  
+  /* Forms are translated on another thread, see start_form. */
+  luaL_newmetatable( L, "pas2lua_form" );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -2, "__index" );
+  lua_pushcfunction( L, form_wait );
+  lua_setfield( L, -2, "wait" );
+  lua_pushcfunction( L, form_gc );
+  lua_setfield( L, -2, "__gc" );
+  lua_pop( L, 1 );
+  
+  lua_pushcfunction( L, start_form );
+  lua_setglobal( L, "startform" );
+  
+  /* Options read by the translator scripts. */
+  lua_createtable( L, 0, 2 );
+  lua_pushboolean( L, !( options & TRANSLATOR_NO_HOIST ) );
+  lua_setfield( L, -2, "hoist" );
+  lua_pushboolean( L, options & TRANSLATOR_LAZY );
+  lua_setfield( L, -2, "lazy" );
+  lua_setglobal( L, "options" );
+  
+  /* The stats table has the counters and timers the scripts update, the
+     global is only set with --stats. */
+  if ( options & TRANSLATOR_STATS )
+  {
+    lua_createtable( L, 0, sizeof( stats_fields ) / sizeof( stats_fields[ 0 ] ) + 1 );
+    lua_pushcfunction( L, stats_clock );
+    lua_setfield( L, -2, "clock" );
+    lua_setglobal( L, "stats" );
+    
+    luaL_newmetatable( L, "pas2lua_sentinel" );
+    lua_pushcfunction( L, gc_sentinel );
+    lua_setfield( L, -2, "__gc" );
+    lua_pop( L, 1 );
+    
+    lua_newuserdata( L, 1 );
+    luaL_setmetatable( L, "pas2lua_sentinel" );
+    lua_pop( L, 1 );
+  }
+  
+  double start = stats_now();
+  
+  DO_CHUNK( L, lua_class, "class.lua", 1 );
+  lua_setglobal( L, "class" );
+  
+  DO_CHUNK( L, lua_ast, "ast.lua", 1 );
+  lua_setglobal( L, "Ast" );
+  
+  DO_CHUNK( L, lua_dfm2pas, "dfm2pas.lua", 1 );
+  lua_setglobal( L, "dfm2pas" );
+  
+  DO_CHUNK( L, lua_parser, "parser.lua", 1 );
+  lua_setglobal( L, "Parser" );
+  
+  /* Run required files, main.lua returns a function which is the main function. */
+  DO_CHUNK( L, lua_main, "main.lua", 1 );
+  luaL_checktype( L, -1, LUA_TFUNCTION );
+  
+  /* Keep the main function in the registry, translator_run calls it for each unit. */
+  lua_setfield( L, LUA_REGISTRYINDEX, "pas2lua_main" );
+  get_state( L )->chunks_ms = stats_now() - start;
+  return 0;
+}
+
+static int run( lua_State* L )
+{
+  /* Get the upvalues and create a table with the arguments. */
+  int argc = (int)lua_tonumber( L, lua_upvalueindex( 1 ) );
+  const char** argv = (const char**)lua_touserdata( L, lua_upvalueindex( 2 ) );
+  const unsigned char* key = (const unsigned char*)lua_touserdata( L, lua_upvalueindex( 3 ) );
+  
+  /* Each translation starts with fresh copies of the units it uses. */
+  lua_newtable( L );
+  lua_setfield( L, LUA_REGISTRYINDEX, "pas2lua_units" );
+  
+  /* And with its counters at zero. */
+  if ( lua_getglobal( L, "stats" ) == LUA_TTABLE )
+  {
+    size_t i;
+    
+    for ( i = 0; i < sizeof( stats_fields ) / sizeof( stats_fields[ 0 ] ); i++ )
+    {
+      lua_pushinteger( L, 0 );
+      lua_setfield( L, -2, stats_fields[ i ].key );
+    }
+  }
+  
+  lua_pop( L, 1 );
+  
+  lua_getfield( L, LUA_REGISTRYINDEX, "pas2lua_main" );
+  lua_newtable( L );
+  int i;
+  
+  for ( i = 0; i < argc; i++ )
+  {
+    lua_pushstring( L, argv[ i ] );
+    lua_rawseti( L, -2, i + 1 );
+  }
+  
+  /* Run the main function, which also returns the files it extracted to the data directory. */
+  lua_call( L, 1, 2 );
+  int ret = (int)luaL_checkinteger( L, -2 );
+  
+  if ( ret == 0 && key != NULL && lua_type( L, -1 ) == LUA_TTABLE )
+  {
+    int count = (int)luaL_len( L, -1 );
+    const char** files = (const char**)lua_newuserdata( L, ( count + 1 ) * sizeof( const char* ) );
+    
+    for ( i = 0; i < count; i++ )
+    {
+      lua_rawgeti( L, -2, i + 1 );
+      files[ i ] = luaL_checkstring( L, -1 );
+      lua_pop( L, 1 );
+    }
+    
+    /* The strings are alive in the table. */
+    cache_store( key, argv[ 1 ], argv[ 2 ], files, count );
+    lua_pop( L, 1 );
+  }
+  
+  lua_pop( L, 1 );
+  return 1;
+}
+
+static int traceback( lua_State* L )
+{
+  /* Change the error into a detailed stack trace. */
+  luaL_traceback( L, L, lua_tostring( L, -1 ), 1 );
+  return 1;
+}
+
+static int protected_call( lua_State* L, int nargs, char* error, size_t error_size )
+{
+  /* Put the traceback function below the function and its arguments. */
+  int base = lua_gettop( L ) - nargs;
+  lua_pushcfunction( L, traceback );
+  lua_insert( L, base );
+  
+  if ( lua_pcall( L, nargs, 1, base ) != /*LUA_OK*/ 0 )
+  {
+    snprintf( error, error_size, "%s", lua_tostring( L, -1 ) );
+    lua_settop( L, base - 1 );
+    return -1;
+  }
+  
+  int ret = (int)lua_tointeger( L, -1 );
+  lua_settop( L, base - 1 );
+  return ret;
+}
+
+static int panic( lua_State* L )
+{
+  fprintf( stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring( L, -1 ) );
+  return 0;
+}
+
+static void read_stats( lua_State* L, stats_t* stats )
+{
+  if ( lua_getglobal( L, "stats" ) == LUA_TTABLE )
+  {
+    size_t i;
+    
+    for ( i = 0; i < sizeof( stats_fields ) / sizeof( stats_fields[ 0 ] ); i++ )
+    {
+      lua_getfield( L, -1, stats_fields[ i ].key );
+      char* field = (char*)stats + stats_fields[ i ].offset;
+      
+      if ( stats_fields[ i ].timer )
+      {
+        *(double*)field = lua_tonumber( L, -1 );
+      }
+      else
+      {
+        *(long*)field = (long)lua_tointeger( L, -1 );
+      }
+      
+      lua_pop( L, 1 );
+    }
+  }
+  
+  lua_pop( L, 1 );
+}
+
+lua_State* translator_new( char* error, size_t error_size )
+{
+  /* Create the state, with an allocator that counts the heap for --stats. */
+  double start = stats_now();
+  state_t* state = (state_t*)calloc( 1, sizeof( state_t ) );
+  lua_State* L = NULL;
+  
+  if ( state != NULL )
+  {
+    arena_init( &state->arena );
+    L = lua_newstate( options & TRANSLATOR_ARENA ? arena_alloc : stats_alloc, state );
+  }
+  
+  if ( L == NULL )
+  {
+    free( state );
+    snprintf( error, error_size, "could not create the Lua state" );
+    return NULL;
+  }
+  
+  lua_atpanic( L, panic );
+  
+  /* With the arena, a new collection cycle only starts when the heap has
+     grown to GC_PAUSE percent of what was alive after the last one, which
+     translator_run collects after each unit. Most units are translated
+     without collecting at all, big ones still keep their heap bounded. */
+  if ( options & TRANSLATOR_ARENA )
+  {
+    lua_gc( L, LUA_GCSETPAUSE, GC_PAUSE );
+  }
+  
+  /* Open the standard libraries and clean the stack. */
+  int top = lua_gettop( L );
+  luaL_openlibs( L );
+  lua_settop( L, top );
+  
+  /* Load everything the translation needs. */
+  lua_pushcfunction( L, setup );
+  
+  if ( protected_call( L, 0, error, error_size ) != 0 )
+  {
+    translator_close( L );
+    return NULL;
+  }
+  
+  /* The first unit starts with the garbage of the setup collected, as the others do. */
+  lua_gc( L, LUA_GCCOLLECT, 0 );
+  state->setup_ms = stats_now() - start;
+  return L;
+}
+
+void translator_close( lua_State* L )
+{
+  state_t* state = get_state( L );
+  state->closing = 1;
+  lua_close( L );
+  
+  if ( state->forms != NULL )
+  {
+    lua_close( state->forms );
+  }
+  
+  arena_destroy( &state->arena );
+  free( state );
+}
+
+const stats_t* translator_stats( lua_State* L )
+{
+  return &get_state( L )->stats;
+}
+
+int translator_run( lua_State* L, int argc, const char* argv[], char* error, size_t error_size )
+{
+  *error = 0;
+  
+  /* The heap counters start over, the state's setup is charged to its first translation. */
+  state_t* state = get_state( L );
+  stats_t* stats = &state->stats;
+  double start = stats_now();
+  size_t heap = stats->heap_bytes;
+  
+  memset( stats, 0, sizeof( *stats ) );
+  stats->heap_bytes = stats->peak_bytes = heap;
+  stats->setup_ms = state->setup_ms;
+  stats->chunks_ms = state->chunks_ms;
+  state->setup_ms = state->chunks_ms = 0.0;
+  
+  /* Units whose inputs didn't change since they were last translated come from the cache. */
+  unsigned char key[ CACHE_KEY_SIZE ];
+  int cached = cache_enabled() && argc == 3;
+  
+  if ( cached && cache_lookup( argv[ 0 ], argv[ 1 ], argv[ 2 ], key ) )
+  {
+    stats->cached = 1;
+    stats->total_ms = stats_now() - start;
+    return 0;
+  }
+  
+  /* Create a closure with argc, argv and the cache key. */
+  lua_pushnumber( L, argc );
+  lua_pushlightuserdata( L, (void*)argv );
+  lua_pushlightuserdata( L, cached ? key : NULL );
+  lua_pushcclosure( L, run, 3 );
+  
+  int ret = protected_call( L, 0, error, error_size );
+  
+  if ( ret < 0 )
+  {
+    ret = 1;
+  }
+  
+  read_stats( L, stats );
+  stats->arena_bytes = state->arena.reserved;
+  stats->total_ms = stats_now() - start;
+  
+  /* Collect whatever the translation left behind before the next unit. */
+  lua_gc( L, LUA_GCCOLLECT, 0 );
+  return ret;
+}
+
+void translator_used_units( lua_State* L, void ( *func )( void* ud, const char* name ), void* ud )
+{
+  lua_getfield( L, LUA_REGISTRYINDEX, "pas2lua_units" );
+  
+  if ( lua_istable( L, -1 ) )
+  {
+    lua_pushnil( L );
+    
+    while ( lua_next( L, -2 ) != 0 )
+    {
+      lua_pop( L, 1 );
+      
+      if ( lua_type( L, -1 ) == LUA_TSTRING )
+      {
+        func( ud, lua_tostring( L, -1 ) );
+      }
+    }
+  }
+  
+  lua_pop( L, 1 );
+}
+
+void translator_forget_unit( lua_State* L, const char* name )
+{
+  char lower[ 256 ];
+  size_t i;
+  
+  for ( i = 0; name[ i ] != 0 && i < sizeof( lower ) - 1; i++ )
+  {
+    lower[ i ] = tolower( (unsigned char)name[ i ] );
+  }
+  
+  lower[ i ] = 0;
+  
+  lua_getfield( L, LUA_REGISTRYINDEX, "pas2lua_chunks" );
+  lua_pushnil( L );
+  lua_setfield( L, -2, lower );
+  lua_pop( L, 1 );
+}
+
+int translator_cache( const char* dir )
+{
+  static const struct
+  {
+    const char* data;
+    size_t      size;
+  }
+  chunks[] =
+  {
+    { lua_class_lua, sizeof( lua_class_lua ) },
+    { lua_ast_lua, sizeof( lua_ast_lua ) },
+    { lua_parser_lua, sizeof( lua_parser_lua ) },
+    { lua_dfm2pas_lua, sizeof( lua_dfm2pas_lua ) },
+    { lua_main_lua, sizeof( lua_main_lua ) },
+    { units_classes_lua, sizeof( units_classes_lua ) },
+    { units_controls_lua, sizeof( units_controls_lua ) },
+    { units_dialogs_lua, sizeof( units_dialogs_lua ) },
+    { units_extctrls_lua, sizeof( units_extctrls_lua ) },
+    { units_fmod_lua, sizeof( units_fmod_lua ) },
+    { units_fmodtypes_lua, sizeof( units_fmodtypes_lua ) },
+    { units_forms_lua, sizeof( units_forms_lua ) },
+    { units_graphics_lua, sizeof( units_graphics_lua ) },
+    { units_jpeg_lua, sizeof( units_jpeg_lua ) },
+    { units_math_lua, sizeof( units_math_lua ) },
+    { units_messages_lua, sizeof( units_messages_lua ) },
+    { units_registry_lua, sizeof( units_registry_lua ) },
+    { units_stdctrls_lua, sizeof( units_stdctrls_lua ) },
+    { units_system_lua, sizeof( units_system_lua ) },
+    { units_sysutils_lua, sizeof( units_sysutils_lua ) },
+    { units_windows_lua, sizeof( units_windows_lua ) }
+  };
+  
+  /* Everything that goes into a translation besides the unit and its form. */
+  cache_hash_t hash;
+  unsigned char identity[ CACHE_KEY_SIZE ];
+  size_t i;
+  
+  cache_hash_init( &hash );
+  cache_hash_update( &hash, TRANSLATOR_VERSION, sizeof( TRANSLATOR_VERSION ) );
+  /* --stats and --arena don't change the output. */
+  unsigned flags = options & ~( TRANSLATOR_STATS | TRANSLATOR_ARENA );
+  cache_hash_update( &hash, &flags, sizeof( flags ) );
+  
+  for ( i = 0; i < sizeof( chunks ) / sizeof( chunks[ 0 ] ); i++ )
+  {
+    uint64_t size = chunks[ i ].size;
+    cache_hash_update( &hash, &size, sizeof( size ) );
+    cache_hash_update( &hash, chunks[ i ].data, chunks[ i ].size );
+  }
+  
+  /* Stubs in the unit path are identified by their names, sizes and modification times. */
+  for ( i = 0; i < unit_file_count; i++ )
+  {
+    cache_hash_update( &hash, unit_files[ i ].name, strlen( unit_files[ i ].name ) + 1 );
+    cache_hash_update( &hash, &unit_files[ i ].size, sizeof( unit_files[ i ].size ) );
+    cache_hash_update( &hash, &unit_files[ i ].mtime, sizeof( unit_files[ i ].mtime ) );
+  }
+  
+  cache_hash_final( &hash, identity );
+  return cache_open( dir, identity );
+}
+
+void translator_options( unsigned flags )
+{
+  options = flags;
+}
+
+int translator_units( const char* path )
+{
+#ifdef _WIN32
+  const char separator = ';';
+#else
+  const char separator = ':';
+#endif
+  
+  size_t reserved = 0, i;
+  
+  /* Start over, watching the path reads it again when a stub is added or removed. */
+  for ( i = 0; i < unit_file_count; i++ )
+  {
+    free( unit_files[ i ].name );
+    free( unit_files[ i ].path );
+  }
+  
+  free( unit_files );
+  unit_files = NULL;
+  unit_file_count = 0;
+  
+  while ( *path != 0 )
+  {
+    const char* end = strchr( path, separator );
+    size_t length = end != NULL ? (size_t)( end - path ) : strlen( path );
+    
+    if ( length != 0 && scan_unit_dir( &reserved, path, length ) != 0 )
+    {
+      return -1;
+    }
+    
+    path += length + ( end != NULL );
+  }
+  
+  /* Sort by name and drop the units hidden by the ones earlier in the path. */
+  qsort( unit_files, unit_file_count, sizeof( unit_file_t ), compare_unit_files );
+  size_t count = 0;
+  
+  for ( i = 0; i < unit_file_count; i++ )
+  {
+    if ( count != 0 && !strcmp( unit_files[ count - 1 ].name, unit_files[ i ].name ) )
+    {
+      free( unit_files[ i ].name );
+      free( unit_files[ i ].path );
+    }
+    else
+    {
+      unit_files[ count++ ] = unit_files[ i ];
+    }
+  }
+  
+  unit_file_count = count;
+  return 0;
+}
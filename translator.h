@@ -0,0 +1,50 @@
+#ifndef PAS2LUA_TRANSLATOR_H
+#define PAS2LUA_TRANSLATOR_H
+
+#include <stddef.h>
+
+#include <lua.h>
+
+#include "stats.h"
+
+/* Creates a Lua state with the lexer, the translator scripts and the unit stubs loaded. */
+lua_State* translator_new( char* error, size_t error_size );
+
+/* Closes a state created by translator_new. */
+void translator_close( lua_State* L );
+
+/* Runs the main function of main.lua with the given arguments and returns its exit code. */
+int translator_run( lua_State* L, int argc, const char* argv[], char* error, size_t error_size );
+
+/* What the last translation run with L did, see stats.h. The counters and
+   timers set by the scripts are only there with TRANSLATOR_STATS. */
+const stats_t* translator_stats( lua_State* L );
+
+/* Calls func with the name of each unit the last translation run with L used. */
+void translator_used_units( lua_State* L, void ( *func )( void* ud, const char* name ), void* ud );
+
+/* Makes L compile the stub of the unit name again the next time a translation
+   uses it, after the stub changed. */
+void translator_forget_unit( lua_State* L, const char* name );
+
+/* Makes the .lua stubs found in the directories of path, separated by : (; on
+   Windows), the units that can be used, replacing the ones found by a previous
+   call. Must be called before translator_cache and translating, or while no
+   state is translating. */
+int translator_units( const char* path );
+
+/* Enables the translation cache in dir, see cache.h. Must be called before
+   translating. */
+int translator_cache( const char* dir );
+
+/* Options for translator_options. */
+#define TRANSLATOR_NO_HOIST 0x01 /* Don't hold members used often in locals. */
+#define TRANSLATOR_LAZY     0x02 /* Create arrays and pure fields on first read. */
+#define TRANSLATOR_STATS    0x04 /* Count and time what the translations do. */
+#define TRANSLATOR_ARENA    0x08 /* Allocate from an arena, and collect less often. */
+
+/* Sets the options of the states created afterwards. Must be called before
+   translator_cache, the options are part of the cache identity. */
+void translator_options( unsigned flags );
+
+#endif /* PAS2LUA_TRANSLATOR_H */
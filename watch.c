@@ -0,0 +1,596 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <strings.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#endif
+
+#include <lua.h>
+
+#include "lexer.h"
+#include "translator.h"
+#include "batch.h"
+#include "stats.h"
+#include "watch.h"
+
+static int usage( void )
+{
+  fprintf( stderr, "Usage: pas2lua [--units <path>] [--no-hoist] [--lazy] [--arena] --watch <outdir> <datadir> <srcdir>...\n" );
+  return 1;
+}
+
+#ifdef __linux__
+
+/* Files are translated when they're closed after being written or moved into
+   place, which is how editors save them. */
+#define WATCH_MASK ( IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE )
+
+typedef struct
+{
+  char* input;
+  char* output;
+  char* units;   /* used by its last translation, as :name:name: */
+  int   dirty;
+  int   failed;  /* its last translation failed, maybe for a missing stub */
+}
+watched_t;
+
+typedef struct
+{
+  int   wd;
+  char* path;
+  int   stubs;   /* a directory in the unit path */
+}
+dir_t;
+
+typedef struct
+{
+  lua_State*  L;
+  int         fd;
+  const char* outdir;
+  const char* datadir;
+  const char* unit_path;
+  watched_t*  units;
+  int         count;
+  int         reserved;
+  dir_t*      dirs;
+  int         dir_count;
+  int         dir_reserved;
+  int         reload;    /* a stub was added, changed or removed */
+}
+watch_t;
+
+static int has_extension( const char* name, const char* ext )
+{
+  size_t length = strlen( name ), ext_length = strlen( ext );
+  return length > ext_length && !strcasecmp( name + length - ext_length, ext );
+}
+
+static char* join( const char* dir, const char* name )
+{
+  size_t size = strlen( dir ) + strlen( name ) + 2;
+  char* path = (char*)malloc( size );
+  
+  if ( path != NULL )
+  {
+    snprintf( path, size, "%s/%s", dir, name );
+  }
+  
+  return path;
+}
+
+static watched_t* find_unit( watch_t* watch, const char* input )
+{
+  int i;
+  
+  for ( i = 0; i < watch->count; i++ )
+  {
+    if ( !strcmp( watch->units[ i ].input, input ) )
+    {
+      return watch->units + i;
+    }
+  }
+  
+  return NULL;
+}
+
+static int add_unit( watch_t* watch, const char* input )
+{
+  watched_t* unit = find_unit( watch, input );
+  
+  if ( unit != NULL )
+  {
+    unit->dirty = 1;
+    return 0;
+  }
+  
+  if ( watch->count == watch->reserved )
+  {
+    int size = watch->reserved ? watch->reserved * 2 : 64;
+    watched_t* units = (watched_t*)realloc( watch->units, size * sizeof( watched_t ) );
+    
+    if ( units == NULL )
+    {
+      return -1;
+    }
+    
+    watch->units = units;
+    watch->reserved = size;
+  }
+  
+  unit = watch->units + watch->count;
+  unit->input = strdup( input );
+  unit->output = batch_output_path( watch->outdir, input );
+  unit->units = NULL;
+  unit->dirty = 1;
+  unit->failed = 0;
+  
+  if ( unit->input == NULL || unit->output == NULL )
+  {
+    free( unit->input );
+    free( unit->output );
+    return -1;
+  }
+  
+  /* Units with the same name in different directories would write the same
+     files, the one found first is kept. */
+  int i;
+  
+  for ( i = 0; i < watch->count; i++ )
+  {
+    if ( !strcasecmp( watch->units[ i ].output, unit->output ) )
+    {
+      fprintf( stderr, "%s and %s would both be written to %s, not watching %s\n", watch->units[ i ].input, input, unit->output, input );
+      free( unit->input );
+      free( unit->output );
+      return 0;
+    }
+  }
+  
+  watch->count++;
+  return 0;
+}
+
+static void remove_unit( watch_t* watch, const char* input )
+{
+  watched_t* unit = find_unit( watch, input );
+  
+  if ( unit != NULL )
+  {
+    free( unit->input );
+    free( unit->output );
+    free( unit->units );
+    *unit = watch->units[ --watch->count ];
+  }
+}
+
+static dir_t* find_dir( watch_t* watch, int wd )
+{
+  int i;
+  
+  for ( i = 0; i < watch->dir_count; i++ )
+  {
+    if ( watch->dirs[ i ].wd == wd )
+    {
+      return watch->dirs + i;
+    }
+  }
+  
+  return NULL;
+}
+
+static int add_dir( watch_t* watch, const char* path, int stubs )
+{
+  int wd = inotify_add_watch( watch->fd, path, WATCH_MASK );
+  
+  if ( wd < 0 )
+  {
+    fprintf( stderr, "Could not watch %s\n", path );
+    return -1;
+  }
+  
+  /* Watching the same directory again gives the same descriptor. */
+  if ( find_dir( watch, wd ) != NULL )
+  {
+    return 0;
+  }
+  
+  if ( watch->dir_count == watch->dir_reserved )
+  {
+    int size = watch->dir_reserved ? watch->dir_reserved * 2 : 16;
+    dir_t* dirs = (dir_t*)realloc( watch->dirs, size * sizeof( dir_t ) );
+    
+    if ( dirs == NULL )
+    {
+      return -1;
+    }
+    
+    watch->dirs = dirs;
+    watch->dir_reserved = size;
+  }
+  
+  dir_t* dir = watch->dirs + watch->dir_count;
+  
+  if ( ( dir->path = strdup( path ) ) == NULL )
+  {
+    return -1;
+  }
+  
+  dir->wd = wd;
+  dir->stubs = stubs;
+  watch->dir_count++;
+  
+  if ( stubs )
+  {
+    return 0;
+  }
+  
+  /* Add the units already there, and watch the directories below. */
+  DIR* handle = opendir( path );
+  
+  if ( handle == NULL )
+  {
+    fprintf( stderr, "Error reading from %s\n", path );
+    return -1;
+  }
+  
+  struct dirent* entry;
+  int res = 0;
+  
+  while ( res == 0 && ( entry = readdir( handle ) ) != NULL )
+  {
+    /* Skips . and .., and hidden directories such as .git. */
+    if ( entry->d_name[ 0 ] == '.' )
+    {
+      continue;
+    }
+    
+    char* child = join( path, entry->d_name );
+    struct stat buf;
+    
+    if ( child == NULL )
+    {
+      res = -1;
+    }
+    else if ( stat( child, &buf ) == 0 && S_ISDIR( buf.st_mode ) )
+    {
+      res = add_dir( watch, child, 0 );
+    }
+    else if ( has_extension( entry->d_name, ".pas" ) )
+    {
+      res = add_unit( watch, child );
+    }
+    
+    free( child );
+  }
+  
+  closedir( handle );
+  return res;
+}
+
+static void add_used_unit( void* ud, const char* name )
+{
+  char** units = (char**)ud;
+  size_t length = *units != NULL ? strlen( *units ) : 0;
+  char* aux = (char*)realloc( *units, length + strlen( name ) + 3 );
+  
+  /* Without memory, the unit isn't translated again when this stub changes. */
+  if ( aux != NULL )
+  {
+    if ( length == 0 )
+    {
+      strcpy( aux, ":" );
+    }
+    
+    strcat( aux, name );
+    strcat( aux, ":" );
+    *units = aux;
+  }
+}
+
+static void stub_changed( watch_t* watch, const char* file_name )
+{
+  /* Unit names are lower case, without the .lua extension. */
+  char key[ 256 ];
+  size_t length = strlen( file_name ) - 4, i;
+  
+  if ( length > sizeof( key ) - 3 )
+  {
+    length = sizeof( key ) - 3;
+  }
+  
+  key[ 0 ] = ':';
+  
+  for ( i = 0; i < length; i++ )
+  {
+    key[ i + 1 ] = tolower( (unsigned char)file_name[ i ] );
+  }
+  
+  key[ length + 1 ] = 0;
+  translator_forget_unit( watch->L, key + 1 );
+  strcat( key, ":" );
+  watch->reload = 1;
+  
+  int j;
+  
+  /* A unit that failed never got to record the stub that was missing. */
+  for ( j = 0; j < watch->count; j++ )
+  {
+    if ( watch->units[ j ].failed || ( watch->units[ j ].units != NULL && strstr( watch->units[ j ].units, key ) != NULL ) )
+    {
+      watch->units[ j ].dirty = 1;
+    }
+  }
+}
+
+static int handle_event( watch_t* watch, const struct inotify_event* event )
+{
+  dir_t* dir = find_dir( watch, event->wd );
+  
+  if ( dir == NULL || event->len == 0 )
+  {
+    return 0;
+  }
+  
+  char* path = join( dir->path, event->name );
+  
+  if ( path == NULL )
+  {
+    return -1;
+  }
+  
+  int res = 0;
+  
+  if ( dir->stubs )
+  {
+    if ( has_extension( event->name, ".lua" ) && !( event->mask & IN_CREATE ) )
+    {
+      stub_changed( watch, event->name );
+    }
+  }
+  else if ( event->mask & IN_ISDIR )
+  {
+    if ( ( event->mask & ( IN_CREATE | IN_MOVED_TO ) ) && event->name[ 0 ] != '.' )
+    {
+      res = add_dir( watch, path, 0 );
+    }
+  }
+  else if ( has_extension( event->name, ".pas" ) )
+  {
+    if ( event->mask & ( IN_DELETE | IN_MOVED_FROM ) )
+    {
+      remove_unit( watch, path );
+    }
+    else if ( event->mask & ( IN_CLOSE_WRITE | IN_MOVED_TO ) )
+    {
+      res = add_unit( watch, path );
+    }
+  }
+  else if ( has_extension( event->name, ".dfm" ) && !( event->mask & IN_CREATE ) )
+  {
+    /* The form goes with the unit with the same name. */
+    strcpy( path + strlen( path ) - 4, ".pas" );
+    watched_t* unit = find_unit( watch, path );
+    
+    if ( unit != NULL )
+    {
+      unit->dirty = 1;
+    }
+  }
+  
+  free( path );
+  return res;
+}
+
+static int translate( watch_t* watch )
+{
+  int i, failed = 0;
+  
+  for ( i = 0; i < watch->count; i++ )
+  {
+    watched_t* unit = watch->units + i;
+    
+    if ( !unit->dirty )
+    {
+      continue;
+    }
+    
+    char error[ 2048 ];
+    const char* args[] = { unit->input, unit->output, watch->datadir };
+    double start = stats_now();
+    int status = translator_run( watch->L, 3, args, error, sizeof( error ) );
+    double ms = stats_now() - start;
+    
+    unit->dirty = 0;
+    unit->failed = status != 0;
+    free( unit->units );
+    unit->units = NULL;
+    translator_used_units( watch->L, add_used_unit, &unit->units );
+    
+    if ( status != 0 )
+    {
+      failed++;
+      
+      if ( *error != 0 )
+      {
+        fprintf( stderr, "%s: %s\n", unit->input, error );
+      }
+    }
+    
+    printf( "%10.3f ms  %s%s\n", ms, unit->input, status != 0 ? " (failed)" : "" );
+  }
+  
+  fflush( stdout );
+  return failed;
+}
+
+static int watch_unit_path( watch_t* watch )
+{
+  const char* path = watch->unit_path;
+  
+  while ( path != NULL && *path != 0 )
+  {
+    const char* end = strchr( path, ':' );
+    size_t length = end != NULL ? (size_t)( end - path ) : strlen( path );
+    
+    if ( length != 0 )
+    {
+      char* dir = strndup( path, length );
+      int res = dir != NULL ? add_dir( watch, dir, 1 ) : -1;
+      free( dir );
+      
+      if ( res != 0 )
+      {
+        return -1;
+      }
+    }
+    
+    path += length + ( end != NULL );
+  }
+  
+  return 0;
+}
+
+int watch_main( int argc, const char* argv[], const char* units )
+{
+  /* argv[ 1 ] is --watch. */
+  if ( argc < 5 )
+  {
+    return usage();
+  }
+  
+  watch_t watch;
+  memset( &watch, 0, sizeof( watch ) );
+  watch.outdir = argv[ 2 ];
+  watch.datadir = argv[ 3 ];
+  watch.unit_path = units != NULL && *units != 0 ? units : NULL;
+  
+  /* Editors may rewrite a file in place while it's being translated, which
+     would kill the process if it was mapped. */
+  lexer_map_files( 0 );
+  
+  /* The state is created once, the scripts and the stubs stay compiled in it. */
+  char error[ 4096 ];
+  double start = stats_now();
+  
+  if ( ( watch.L = translator_new( error, sizeof( error ) ) ) == NULL )
+  {
+    fprintf( stderr, "%s", error );
+    return 1;
+  }
+  
+  double startup = stats_now() - start;
+  
+  if ( ( watch.fd = inotify_init1( IN_CLOEXEC ) ) < 0 )
+  {
+    fprintf( stderr, "Could not start watching: %s\n", strerror( errno ) );
+    translator_close( watch.L );
+    return 1;
+  }
+  
+  int i, res = watch_unit_path( &watch );
+  
+  for ( i = 4; res == 0 && i < argc; i++ )
+  {
+    res = add_dir( &watch, argv[ i ], 0 );
+  }
+  
+  if ( res == 0 )
+  {
+    int failed = translate( &watch );
+    printf( "%d units, %d failed, %.3f ms creating the state, watching %d directories\n", watch.count, failed, startup, watch.dir_count );
+    fflush( stdout );
+  }
+  
+  /* Each read returns all the events queued, so a save that touches several
+     files translates each unit once. */
+  char buffer[ 64 * 1024 ] __attribute__(( aligned( __alignof__( struct inotify_event ) ) ));
+  
+  while ( res == 0 )
+  {
+    ssize_t length = read( watch.fd, buffer, sizeof( buffer ) );
+    
+    if ( length < 0 && errno == EINTR )
+    {
+      continue;
+    }
+    
+    if ( length <= 0 )
+    {
+      fprintf( stderr, "Error watching the directories: %s\n", strerror( errno ) );
+      res = -1;
+      break;
+    }
+    
+    const char* ptr;
+    const struct inotify_event* event;
+    
+    for ( ptr = buffer; res == 0 && ptr < buffer + length; ptr += sizeof( struct inotify_event ) + event->len )
+    {
+      event = (const struct inotify_event*)ptr;
+      
+      /* Events were lost, translate everything. */
+      if ( event->mask & IN_Q_OVERFLOW )
+      {
+        for ( i = 0; i < watch.count; i++ )
+        {
+          watch.units[ i ].dirty = 1;
+        }
+      }
+      
+      res = handle_event( &watch, event );
+    }
+    
+    /* Stubs may have been added to the unit path, or removed from it. */
+    if ( watch.reload && watch.unit_path != NULL && translator_units( watch.unit_path ) != 0 )
+    {
+      fprintf( stderr, "Could not read the units in %s\n", watch.unit_path );
+    }
+    
+    watch.reload = 0;
+    
+    if ( res == 0 )
+    {
+      translate( &watch );
+    }
+  }
+  
+  close( watch.fd );
+  translator_close( watch.L );
+  
+  for ( i = 0; i < watch.count; i++ )
+  {
+    free( watch.units[ i ].input );
+    free( watch.units[ i ].output );
+    free( watch.units[ i ].units );
+  }
+  
+  for ( i = 0; i < watch.dir_count; i++ )
+  {
+    free( watch.dirs[ i ].path );
+  }
+  
+  free( watch.units );
+  free( watch.dirs );
+  return 1;
+}
+
+#else
+
+int watch_main( int argc, const char* argv[], const char* units )
+{
+  ( void )argc;
+  ( void )argv;
+  ( void )units;
+  fprintf( stderr, "--watch uses inotify and is only available on Linux\n" );
+  return usage();
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef PAS2LUA_WATCH_H
+#define PAS2LUA_WATCH_H
+
+/* Translates the units in the source directories and then waits for them to
+   change, translating again the units whose source, form or stubs in the unit
+   path changed with a single Lua state kept from the start. Only returns on
+   errors. units is the unit path given to translator_units, or NULL. */
+int watch_main( int argc, const char* argv[], const char* units );
+
+#endif /* PAS2LUA_WATCH_H */
@@ -0,0 +1,191 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include "writer.h"
+
+#define MY_NAME "writer_t"
+
+/* Chunks at least this big skip the buffer and go straight to the file. */
+#define BUFFER_SIZE 65536
+
+typedef struct
+{
+  FILE*  file;
+  char*  buffer;
+  size_t used;
+  size_t size;  /* bytes written so far */
+  int    error; /* errno of the first failed write, 0 if none */
+}
+writer_t;
+
+static writer_t* check_writer( lua_State* L, int index )
+{
+  writer_t* self = (writer_t*)luaL_checkudata( L, index, MY_NAME );
+  
+  if ( self->file == NULL )
+  {
+    luaL_error( L, "attempt to use a closed writer" );
+  }
+  
+  return self;
+}
+
+static void write_block( writer_t* self, const char* data, size_t size )
+{
+  if ( size != 0 && self->error == 0 && fwrite( data, 1, size, self->file ) != size )
+  {
+    self->error = errno != 0 ? errno : EIO;
+  }
+}
+
+static void flush_buffer( writer_t* self )
+{
+  write_block( self, self->buffer, self->used );
+  self->used = 0;
+}
+
+static int writer_write( lua_State* L )
+{
+  writer_t* self = check_writer( L, 1 );
+  int top = lua_gettop( L );
+  int i;
+  
+  for ( i = 2; i <= top; i++ )
+  {
+    size_t size;
+    const char* data = luaL_checklstring( L, i, &size );
+    self->size += size;
+    
+    if ( self->used + size > BUFFER_SIZE )
+    {
+      flush_buffer( self );
+      
+      if ( size >= BUFFER_SIZE )
+      {
+        write_block( self, data, size );
+        continue;
+      }
+    }
+    
+    memcpy( self->buffer + self->used, data, size );
+    self->used += size;
+  }
+  
+  return 0;
+}
+
+static int writer_size( lua_State* L )
+{
+  writer_t* self = (writer_t*)luaL_checkudata( L, 1, MY_NAME );
+  lua_pushinteger( L, (lua_Integer)self->size );
+  return 1;
+}
+
+static int close_writer( writer_t* self )
+{
+  flush_buffer( self );
+  
+  if ( fclose( self->file ) != 0 && self->error == 0 )
+  {
+    self->error = errno != 0 ? errno : EIO;
+  }
+  
+  self->file = NULL;
+  free( self->buffer );
+  self->buffer = NULL;
+  return self->error;
+}
+
+static int writer_close( lua_State* L )
+{
+  writer_t* self = check_writer( L, 1 );
+  int error = close_writer( self );
+  
+  if ( error != 0 )
+  {
+    lua_pushnil( L );
+    lua_pushstring( L, strerror( error ) );
+    return 2;
+  }
+  
+  lua_pushboolean( L, 1 );
+  return 1;
+}
+
+static int writer_gc( lua_State* L )
+{
+  writer_t* self = (writer_t*)lua_touserdata( L, 1 );
+  
+  if ( self->file != NULL )
+  {
+    close_writer( self );
+  }
+  
+  return 0;
+}
+
+static int open_writer( lua_State* L )
+{
+  const char* path = luaL_checkstring( L, 1 );
+  
+  writer_t* self = (writer_t*)lua_newuserdata( L, sizeof( writer_t ) );
+  memset( self, 0, sizeof( *self ) );
+  luaL_setmetatable( L, MY_NAME );
+  
+  self->buffer = (char*)malloc( BUFFER_SIZE );
+  
+  if ( self->buffer == NULL )
+  {
+    return luaL_error( L, "out of memory" );
+  }
+  
+  self->file = fopen( path, "wb" );
+  
+  if ( self->file == NULL )
+  {
+    int error = errno;
+    free( self->buffer );
+    self->buffer = NULL;
+    
+    lua_pushnil( L );
+    lua_pushfstring( L, "%s: %s", path, strerror( error ) );
+    return 2;
+  }
+  
+  /* The writer does its own buffering. */
+  setvbuf( self->file, NULL, _IONBF, 0 );
+  return 1;
+}
+
+LUALIB_API int luaopen_writer( lua_State* L )
+{
+  static const luaL_Reg statics[] =
+  {
+    { "open", open_writer },
+    { NULL, NULL }
+  };
+  
+  static const luaL_Reg methods[] =
+  {
+    { "write", writer_write },
+    { "close", writer_close },
+    { "size", writer_size },
+    { "__gc", writer_gc },
+    { NULL, NULL }
+  };
+  
+  luaL_newmetatable( L, MY_NAME );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -2, "__index" );
+  luaL_setfuncs( L, methods, 0 );
+  lua_pop( L, 1 );
+  
+  luaL_newlib( L, statics );
+  return 1;
+}
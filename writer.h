@@ -0,0 +1,8 @@
+#ifndef PAS2LUA_WRITER_H
+#define PAS2LUA_WRITER_H
+
+#include <lua.h>
+
+LUALIB_API int luaopen_writer( lua_State* L );
+
+#endif /* PAS2LUA_WRITER_H */